@@ -0,0 +1,488 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+// workq++ のマイクロベンチマーク
+//
+// 結果は JSON で標準出力 (または --out で指定したファイル) へ出力する.
+// 各測定は固定の件数, 乱数シードで行い, スループットは繰り返しの中央値を出力する.
+//
+//   bench-workq++ [--quick] [--filter <名前の一部>] [--backend <global_fifo|work_stealing|lock_free_ring|earliest_deadline>] [--out <file>]
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/workq++.hpp"
+#include "../include/co-routine.hpp"
+#include "../include/wq-intervatimer.hpp"
+
+namespace {
+  using sharaku::workque::workque;
+  using sharaku::workque::sched_mode;
+  using sharaku::workque::latency_histogram;
+
+  struct options {
+    bool quick = false;
+    std::string filter;
+    std::string backend;
+    std::string out;
+  } opt;
+
+  const char *mode_name(sched_mode mode) {
+    switch (mode) {
+    case sched_mode::global_fifo:    return "global_fifo";
+    case sched_mode::work_stealing:  return "work_stealing";
+    case sched_mode::lock_free_ring: return "lock_free_ring";
+    case sched_mode::earliest_deadline: return "earliest_deadline";
+    }
+    return "unknown";
+  }
+
+  const sched_mode all_modes[] = {
+    sched_mode::global_fifo, sched_mode::work_stealing, sched_mode::lock_free_ring,
+    sched_mode::earliest_deadline,
+  };
+
+  uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // 結果1件分の JSON オブジェクトを組み立てる
+  class record {
+    std::string body_;
+
+    void key(const char *k) {
+      body_ += body_.empty() ? "{" : ", ";
+      body_ += "\"";
+      body_ += k;
+      body_ += "\": ";
+    }
+
+   public:
+    record(const char *name, sched_mode mode) {
+      add("name", name);
+      add("backend", mode_name(mode));
+    }
+    record& add(const char *k, const char *v) {
+      key(k);
+      body_ += "\"";
+      body_ += v;
+      body_ += "\"";
+      return *this;
+    }
+    record& add(const char *k, uint64_t v) {
+      key(k);
+      body_ += std::to_string(v);
+      return *this;
+    }
+    record& add(const char *k, double v) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%.3f", v);
+      key(k);
+      body_ += buf;
+      return *this;
+    }
+    // パーセンタイル (ns) をまとめて出力する
+    record& add(const char *k, const latency_histogram &h) {
+      key(k);
+      char buf[256];
+      snprintf(buf, sizeof(buf),
+        "{\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+        (unsigned long long)h.count, (unsigned long long)h.mean(),
+        (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.9),
+        (unsigned long long)h.percentile(0.99), (unsigned long long)h.percentile(0.999),
+        (unsigned long long)h.max_ns);
+      body_ += buf;
+      return *this;
+    }
+    std::string str() const {
+      return body_ + "}";
+    }
+  };
+
+  std::vector<std::string> results;
+
+  void emit(const record &r) {
+    results.push_back(r.str());
+    fprintf(stderr, "%s\n", r.str().c_str());
+  }
+
+  void hist_add(latency_histogram &h, uint64_t ns) {
+    h.counts[latency_histogram::bucket(ns)]++;
+    h.count++;
+    h.sum_ns += ns;
+    h.max_ns = std::max(h.max_ns, ns);
+  }
+
+  bool selected(const char *name, sched_mode mode) {
+    if (!opt.filter.empty() && strstr(name, opt.filter.c_str()) == nullptr) {
+      return false;
+    }
+    if (!opt.backend.empty() && opt.backend != mode_name(mode)) {
+      return false;
+    }
+    return true;
+  }
+
+  // 中央値
+  double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+  }
+
+  const int reps = 3;
+
+  unsigned int worker_count() {
+    return std::max(2u, std::min(8u, std::thread::hardware_concurrency()));
+  }
+
+  // 複数スレッドから登録し, すべて実行されるまでのスループット
+  void bench_push_throughput(sched_mode mode) {
+    if (!selected("push_throughput", mode)) {
+      return;
+    }
+    const uint64_t total = opt.quick ? 100000 : 1000000;
+    const unsigned int workers = worker_count();
+    for (unsigned int producers : {1u, 2u, 4u, 8u}) {
+      std::vector<double> secs;
+      for (int r = 0; r < reps; r++) {
+        workque wq(mode);
+        std::atomic<uint64_t> done{0};
+        wq.start(workers);
+        const uint64_t per = total / producers;
+        const uint64_t t0 = now_ns();
+        std::vector<std::thread> th;
+        for (unsigned int p = 0; p < producers; p++) {
+          th.emplace_back([&wq, &done, per]() {
+            for (uint64_t i = 0; i < per; i++) {
+              wq.push([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+          });
+        }
+        for (auto &t : th) {
+          t.join();
+        }
+        while (done.load() < per * producers) {
+          std::this_thread::yield();
+        }
+        secs.push_back((now_ns() - t0) / 1e9);
+        wq.stop();
+      }
+      const double s = median(secs);
+      emit(record("push_throughput", mode)
+        .add("producers", (uint64_t)producers)
+        .add("workers", (uint64_t)workers)
+        .add("ops", (total / producers) * producers)
+        .add("seconds", s)
+        .add("ops_per_sec", (total / producers) * producers / s));
+    }
+  }
+
+  // 登録から実行開始までの時間
+  void bench_latency(sched_mode mode) {
+    if (!selected("latency", mode)) {
+      return;
+    }
+    const uint64_t n = opt.quick ? 20000 : 200000;
+    const uint64_t gap_ns = 10000;
+    workque wq(mode);
+    std::vector<uint64_t> lat(n);
+    std::atomic<uint64_t> done{0};
+    wq.start(worker_count());
+    for (uint64_t i = 0; i < n; i++) {
+      const uint64_t t = now_ns();
+      wq.push([&lat, &done, i, t]() {
+        lat[i] = now_ns() - t;
+        done.fetch_add(1, std::memory_order_release);
+      });
+      // 一定間隔で登録する
+      while (now_ns() - t < gap_ns) {
+      }
+    }
+    while (done.load(std::memory_order_acquire) < n) {
+      std::this_thread::yield();
+    }
+    wq.stop();
+
+    latency_histogram h;
+    for (uint64_t v : lat) {
+      hist_add(h, v);
+    }
+    emit(record("latency", mode)
+      .add("ops", n)
+      .add("gap_ns", gap_ns)
+      .add("latency_ns", h));
+  }
+
+  // 大量のタイマー登録と, 発火の遅れ
+  void bench_timer_storm(sched_mode mode) {
+    if (!selected("timer_storm", mode)) {
+      return;
+    }
+    const uint64_t n = opt.quick ? 20000 : 200000;
+    const int max_delay_ms = 50;
+    workque wq(mode);
+    std::vector<uint64_t> late(n);
+    std::atomic<uint64_t> done{0};
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(1, max_delay_ms);
+    wq.start(worker_count());
+
+    const uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+      const int ms = dist(rng);
+      const uint64_t deadline = now_ns() + ms * 1000000ull;
+      wq.push_for(std::chrono::milliseconds(ms), [&late, &done, i, deadline]() {
+        const uint64_t t = now_ns();
+        late[i] = t > deadline ? t - deadline : 0;
+        done.fetch_add(1, std::memory_order_release);
+      });
+    }
+    const double insert_s = (now_ns() - t0) / 1e9;
+    while (done.load(std::memory_order_acquire) < n) {
+      std::this_thread::yield();
+    }
+    wq.stop();
+
+    latency_histogram h;
+    for (uint64_t v : late) {
+      hist_add(h, v);
+    }
+    emit(record("timer_storm", mode)
+      .add("timers", n)
+      .add("max_delay_ms", (uint64_t)max_delay_ms)
+      .add("inserts_per_sec", n / insert_s)
+      .add("lateness_ns", h));
+  }
+
+  // 大半を取り消す負荷 (キュー待ち, タイマー待ち)
+  void bench_cancel_heavy(sched_mode mode) {
+    if (!selected("cancel_heavy", mode)) {
+      return;
+    }
+    const uint64_t n = opt.quick ? 50000 : 500000;
+    for (bool timer : {false, true}) {
+      workque wq(mode);
+      std::atomic<uint64_t> done{0};
+      std::vector<std::shared_ptr<sharaku::workque::event>> evs;
+      evs.reserve(n);
+      std::function<void(void)> func = [&done]() { done.fetch_add(1, std::memory_order_relaxed); };
+      if (timer) {
+        wq.start(worker_count());
+      }
+      for (uint64_t i = 0; i < n; i++) {
+        if (timer) {
+          evs.push_back(wq.push_for(std::chrono::milliseconds(50), 0, std::function<void(void)>(func)));
+        } else {
+          evs.push_back(wq.push(0, std::function<void(void)>(func)));
+        }
+      }
+      // 9割を取り消す
+      uint64_t cancelled = 0;
+      const uint64_t t0 = now_ns();
+      for (uint64_t i = 0; i < n; i++) {
+        if (i % 10 && wq.cancel(evs[i])) {
+          cancelled ++;
+        }
+      }
+      const uint64_t cancel_ns = now_ns() - t0;
+
+      const uint64_t t1 = now_ns();
+      if (!timer) {
+        wq.start(worker_count());
+      }
+      while (done.load() < n - cancelled) {
+        std::this_thread::yield();
+      }
+      const uint64_t drain_ns = now_ns() - t1;
+      wq.stop();
+
+      emit(record("cancel_heavy", mode)
+        .add("queue", timer ? "timer" : "ready")
+        .add("events", n)
+        .add("cancelled", cancelled)
+        .add("executed", done.load())
+        .add("cancel_ns_per_op", (double)cancel_ns / (n - n / 10))
+        .add("drain_seconds", drain_ns / 1e9));
+    }
+  }
+
+  // coroutine の1ステップあたりの時間
+  void bench_coroutine(sched_mode mode) {
+    if (!selected("coroutine", mode)) {
+      return;
+    }
+    const uint64_t steps = opt.quick ? 100000 : 1000000;
+    {
+      workque wq(mode);
+      std::atomic<bool> finished{false};
+      uint64_t count = 0;
+      sharaku::workque::coroutine co(&wq, 0);
+      co.push([&count, &finished, steps]() {
+        if (++count < steps) {
+          return sharaku::workque::coroutine::result::retry;
+        }
+        finished = true;
+        return sharaku::workque::coroutine::result::end;
+      });
+      wq.start(1);
+      const uint64_t t0 = now_ns();
+      co.start();
+      while (!finished.load()) {
+        std::this_thread::yield();
+      }
+      const uint64_t ns = now_ns() - t0;
+      wq.stop();
+      emit(record("coroutine_step", mode)
+        .add("steps", steps)
+        .add("ns_per_step", (double)ns / steps));
+    }
+    {
+      const uint64_t routines = opt.quick ? 10000 : 100000;
+      workque wq(mode);
+      std::atomic<uint64_t> done{0};
+      sharaku::workque::coroutine_parallel co(&wq, 0);
+      for (uint64_t i = 0; i < routines; i++) {
+        co.push([&done]() {
+          done.fetch_add(1, std::memory_order_relaxed);
+          return sharaku::workque::coroutine::result::next;
+        });
+      }
+      wq.start(worker_count());
+      const uint64_t t0 = now_ns();
+      co.start();
+      while (done.load() < routines) {
+        std::this_thread::yield();
+      }
+      const uint64_t ns = now_ns() - t0;
+      wq.stop();
+      emit(record("coroutine_parallel", mode)
+        .add("routines", routines)
+        .add("ns_per_routine", (double)ns / routines));
+    }
+  }
+
+  // intervaltimer の周期のずれ
+  void bench_intervaltimer(sched_mode mode) {
+    if (!selected("intervaltimer", mode)) {
+      return;
+    }
+    const uint64_t ticks = opt.quick ? 20 : 100;
+    const uint64_t interval_ms = 10;
+    workque wq(mode);
+    std::vector<uint64_t> at;
+    at.reserve(ticks);
+    std::atomic<bool> finished{false};
+    sharaku::workque::intervaltimer it(&wq, 0);
+    it.with_interval(std::chrono::milliseconds(interval_ms))
+      .push([&at, &finished, ticks]() {
+        if (at.size() < ticks) {
+          at.push_back(now_ns());
+        } else {
+          finished = true;
+        }
+      });
+    wq.start(2);
+    it.start();
+    while (!finished.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    wq.stop();
+
+    // 周期のずれ, 最初の実行からの累積のずれ
+    latency_histogram jitter;
+    for (size_t i = 1; i < at.size(); i++) {
+      const int64_t d = (int64_t)(at[i] - at[i - 1]) - (int64_t)(interval_ms * 1000000);
+      hist_add(jitter, d < 0 ? -d : d);
+    }
+    const int64_t drift = (int64_t)(at.back() - at.front()) - (int64_t)((at.size() - 1) * interval_ms * 1000000);
+    emit(record("intervaltimer", mode)
+      .add("ticks", (uint64_t)at.size())
+      .add("interval_ms", interval_ms)
+      .add("jitter_ns", jitter)
+      .add("drift_ns", (uint64_t)(drift < 0 ? -drift : drift)));
+  }
+
+  bool parse(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--quick") == 0) {
+        opt.quick = true;
+      } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+        opt.filter = argv[++i];
+      } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+        opt.backend = argv[++i];
+      } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+        opt.out = argv[++i];
+      } else {
+        fprintf(stderr,
+          "usage: %s [--quick] [--filter <name>] [--backend <global_fifo|work_stealing|lock_free_ring|earliest_deadline>] [--out <file>]\n",
+          argv[0]);
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  if (!parse(argc, argv)) {
+    return 1;
+  }
+
+  for (sched_mode mode : all_modes) {
+    bench_push_throughput(mode);
+    bench_latency(mode);
+    bench_timer_storm(mode);
+    bench_cancel_heavy(mode);
+    bench_coroutine(mode);
+    bench_intervaltimer(mode);
+  }
+
+  FILE *fp = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+  if (fp == nullptr) {
+    perror(opt.out.c_str());
+    return 1;
+  }
+  fprintf(fp, "{\n  \"version\": 1,\n  \"hardware_concurrency\": %u,\n  \"quick\": %s,\n  \"results\": [\n",
+          std::thread::hardware_concurrency(), opt.quick ? "true" : "false");
+  for (size_t i = 0; i < results.size(); i++) {
+    fprintf(fp, "    %s%s\n", results[i].c_str(), i + 1 < results.size() ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  if (fp != stdout) {
+    fclose(fp);
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include "../include/workq++.hpp"
+#include "../include/co-await.hpp"
+
+namespace co = sharaku::workque::co;
+
+co::task<int> square(sharaku::workque::workque &scheduler, int v)
+{
+  co_await co::sleep_for(scheduler, std::chrono::milliseconds(100 * v));
+  printf("square(%d)\n", v);
+  co_return v * v;
+}
+
+co::task<void> main_task(sharaku::workque::workque &scheduler)
+{
+  printf("start\n");
+  co_await co::schedule(scheduler, 1);
+
+  std::vector<co::task<int>> tasks;
+  for (int i = 1; i <= 3; i++) {
+    tasks.push_back(square(scheduler, i));
+  }
+  std::vector<int> results = co_await co::when_all(scheduler, std::move(tasks));
+  printf("sum = %d\n", results[0] + results[1] + results[2]);
+
+  scheduler.quit();
+}
+
+int
+main(void)
+{
+  sharaku::workque::workque scheduler;
+  co::spawn(scheduler, main_task(scheduler));
+  scheduler.run();
+  return 0;
+}
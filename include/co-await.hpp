@@ -0,0 +1,371 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef LIBSHARAKU_WORKQ_CO_AWAIT_HPP
+#define LIBSHARAKU_WORKQ_CO_AWAIT_HPP
+
+// C++20 のコルーチン (co_await) でworkqueを使用する.
+// C++11 でも使用できる callback 形式のコルーチンは co-routine.hpp を参照.
+#if !defined(__cpp_impl_coroutine)
+#error "co-await.hpp requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <workq++.hpp>
+
+namespace sharaku {
+namespace workque {
+namespace co {
+  template<class T = void>
+  class task;
+
+  namespace __internal__ {
+    // task の promise で共通の部分
+    class promise_base {
+     protected:
+      // 完了時に再開するコルーチン
+      std::coroutine_handle<> continuation_ = nullptr;
+      std::exception_ptr exception_ = nullptr;
+
+     public:
+      // 完了時に待っている側へ直接制御を移す (symmetric transfer)
+      struct final_awaiter {
+        bool await_ready() noexcept {
+          return false;
+        }
+        template<class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+          std::coroutine_handle<> c = h.promise().continuation_;
+          return c ? c : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+
+      std::suspend_always initial_suspend() noexcept {
+        return {};
+      }
+      final_awaiter final_suspend() noexcept {
+        return {};
+      }
+      void unhandled_exception() noexcept {
+        exception_ = std::current_exception();
+      }
+      void set_continuation(std::coroutine_handle<> c) noexcept {
+        continuation_ = c;
+      }
+      void rethrow_if_exception() {
+        if (exception_) {
+          std::rethrow_exception(exception_);
+        }
+      }
+    };
+
+    template<class T>
+    class promise : public promise_base {
+      std::optional<T> value_;
+
+     public:
+      task<T> get_return_object() noexcept;
+
+      template<class U>
+      void return_value(U &&v) {
+        value_.emplace(std::forward<U>(v));
+      }
+      T result() {
+        rethrow_if_exception();
+        return std::move(*value_);
+      }
+    };
+
+    template<>
+    class promise<void> : public promise_base {
+     public:
+      task<void> get_return_object() noexcept;
+
+      void return_void() noexcept {}
+      void result() {
+        rethrow_if_exception();
+      }
+    };
+
+    // 開始後, 誰も待たないコルーチン. 完了時に自身を破棄する.
+    struct detached {
+      struct promise_type {
+        detached get_return_object() noexcept {
+          return {};
+        }
+        std::suspend_never initial_suspend() noexcept {
+          return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+          return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+          std::terminate();
+        }
+      };
+    };
+  }
+
+  // co_await で結果を待つコルーチン
+  //
+  // 生成時には実行されず, co_await した時点で開始する.
+  // 完了すると待っている側をそのまま再開するため, 再開にキューを使用しない.
+  template<class T>
+  class task {
+   public:
+    using promise_type = __internal__::promise<T>;
+
+   private:
+    std::coroutine_handle<promise_type> h_ = nullptr;
+
+   public:
+    task() noexcept {}
+    explicit task(std::coroutine_handle<promise_type> h) noexcept
+     : h_(h)
+    {}
+    task(task &&t) noexcept
+     : h_(std::exchange(t.h_, nullptr))
+    {}
+    task& operator=(task &&t) noexcept {
+      if (this != &t) {
+        if (h_) {
+          h_.destroy();
+        }
+        h_ = std::exchange(t.h_, nullptr);
+      }
+      return *this;
+    }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task() {
+      if (h_) {
+        h_.destroy();
+      }
+    }
+
+    struct awaiter {
+      std::coroutine_handle<promise_type> h;
+
+      bool await_ready() noexcept {
+        return !h || h.done();
+      }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h.promise().set_continuation(caller);
+        return h;
+      }
+      T await_resume() {
+        return h.promise().result();
+      }
+    };
+
+    awaiter operator co_await() & noexcept {
+      return awaiter{h_};
+    }
+    awaiter operator co_await() && noexcept {
+      return awaiter{h_};
+    }
+
+    bool done() const noexcept {
+      return !h_ || h_.done();
+    }
+  };
+
+  namespace __internal__ {
+    template<class T>
+    inline task<T> promise<T>::get_return_object() noexcept {
+      return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+    }
+    inline task<void> promise<void>::get_return_object() noexcept {
+      return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+    }
+
+    // workqueのキューでコルーチンを再開する.
+    // コルーチンのハンドルのみを持つ関数オブジェクトは task に直接保持されるため, メモリ確保を行わない.
+    inline void resume_on(sharaku::workque::workque &wq, nice_t nice, std::coroutine_handle<> h) {
+      wq.push_continuation(nice, [h]() { h.resume(); });
+    }
+  }
+
+  // co_await するとworkqueのワーカーへ移って再開する
+  class schedule {
+    sharaku::workque::workque &wq_;
+    nice_t nice_;
+
+   public:
+    schedule(sharaku::workque::workque &wq, nice_t nice = 0)
+     : wq_(wq), nice_(nice)
+    {}
+
+    bool await_ready() noexcept {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+      __internal__::resume_on(wq_, nice_, h);
+    }
+    void await_resume() noexcept {}
+  };
+
+  // co_await すると指定時間後にworkqueのワーカーで再開する.
+  // タイマーのtick単位に切り上げる.
+  class sleep_for {
+    sharaku::workque::workque &wq_;
+    std::chrono::nanoseconds ns_;
+    nice_t nice_;
+
+   public:
+    template<class Rep, class Period>
+    sleep_for(sharaku::workque::workque &wq, std::chrono::duration<Rep, Period> d, nice_t nice = 0)
+     : wq_(wq), ns_(std::chrono::ceil<std::chrono::nanoseconds>(d)), nice_(nice)
+    {}
+
+    bool await_ready() noexcept {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+      wq_.push_for(ns_, nice_, [h]() { h.resume(); });
+    }
+    void await_resume() noexcept {}
+  };
+
+  namespace __internal__ {
+    // when_all の完了待ち. 全ての子と親の分を数え, 最後に減らした側が親を再開する.
+    // 子が投げた例外は最初のものを覚え, 全ての完了後に親で投げ直す.
+    class when_all_latch {
+      std::atomic<size_t> count_;
+      std::coroutine_handle<> parent_ = nullptr;
+      std::atomic<bool> failed_{false};
+      std::exception_ptr error_;
+
+     public:
+      when_all_latch(size_t n)
+       : count_(n + 1)
+      {}
+
+      void arrive() {
+        if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          parent_.resume();
+        }
+      }
+
+      // arrive() の前に呼び出す
+      void fail(std::exception_ptr e) {
+        if (!failed_.exchange(true, std::memory_order_relaxed)) {
+          error_ = std::move(e);
+        }
+      }
+
+      // 全ての完了後に呼び出す
+      void rethrow_if_exception() {
+        if (error_) {
+          std::rethrow_exception(error_);
+        }
+      }
+
+      bool await_ready() noexcept {
+        return count_.load(std::memory_order_acquire) == 1;
+      }
+      bool await_suspend(std::coroutine_handle<> h) noexcept {
+        parent_ = h;
+        return count_.fetch_sub(1, std::memory_order_acq_rel) != 1;
+      }
+      void await_resume() noexcept {}
+    };
+
+    template<class T>
+    detached when_all_child(sharaku::workque::workque &wq, nice_t nice, task<T> &t,
+                            std::optional<T> &result, when_all_latch &latch) {
+      co_await schedule(wq, nice);
+      try {
+        result.emplace(co_await t);
+      } catch (...) {
+        latch.fail(std::current_exception());
+      }
+      latch.arrive();
+    }
+
+    inline detached when_all_child(sharaku::workque::workque &wq, nice_t nice, task<void> &t,
+                                   when_all_latch &latch) {
+      co_await schedule(wq, nice);
+      try {
+        co_await t;
+      } catch (...) {
+        latch.fail(std::current_exception());
+      }
+      latch.arrive();
+    }
+
+    inline detached spawn(sharaku::workque::workque &wq, nice_t nice, task<void> t) {
+      co_await schedule(wq, nice);
+      co_await t;
+    }
+  }
+
+  // すべての task をworkqueで並行に実行し, 完了を待って結果を登録順に返す.
+  // 例外を投げた task があれば, すべての完了を待ってから最初の例外を投げ直す.
+  template<class T>
+  task<std::vector<T>> when_all(sharaku::workque::workque &wq, std::vector<task<T>> tasks, nice_t nice = 0) {
+    std::vector<std::optional<T>> results(tasks.size());
+    __internal__::when_all_latch latch(tasks.size());
+    for (size_t i = 0; i < tasks.size(); i++) {
+      __internal__::when_all_child(wq, nice, tasks[i], results[i], latch);
+    }
+    co_await latch;
+    latch.rethrow_if_exception();
+
+    std::vector<T> values;
+    values.reserve(results.size());
+    for (auto &r : results) {
+      values.push_back(std::move(*r));
+    }
+    co_return values;
+  }
+
+  inline task<void> when_all(sharaku::workque::workque &wq, std::vector<task<void>> tasks, nice_t nice = 0) {
+    __internal__::when_all_latch latch(tasks.size());
+    for (auto &t : tasks) {
+      __internal__::when_all_child(wq, nice, t, latch);
+    }
+    co_await latch;
+    latch.rethrow_if_exception();
+  }
+
+  // task をworkqueで開始する. 完了は待たない.
+  inline void spawn(sharaku::workque::workque &wq, task<void> t, nice_t nice = 0) {
+    __internal__::spawn(wq, nice, std::move(t));
+  }
+}
+}
+}
+
+#endif // LIBSHARAKU_WORKQ_CO_AWAIT_HPP
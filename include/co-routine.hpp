@@ -89,9 +89,10 @@ namespace workque {
       }
 
       void start() {
-        ev = std::make_shared<event>(0);
-        ev->set_nice(nice);
-        ev->set_function(func);
+        // 2回目以降は同じイベントを再投入し, 確保と関数のコピーを省く
+        if (!ev || ev->get_nice() != nice) {
+          ev = wq->make_event(nice, func);
+        }
         if (ms != std::chrono::milliseconds(0)) {
           wq->push_for(ms, ev);
         } else {
@@ -121,7 +122,6 @@ namespace workque {
      * @param[in] nice 登録するnice
      */
     coroutine(workque *wq, nice_t nice = 0) {
-      ev_ = std::make_shared<event>(0);
       wq_ = wq;
       nice_ = nice;
     }
@@ -494,6 +494,7 @@ namespace workque {
     virtual coroutine_switch<KEY>& switch_function(std::function<KEY(void)> func) {
       routine_.wq = wq_;
       routine_.nice = nice_;
+      routine_.ev = nullptr;
       routine_.func = [this, func]() {
         ++ counter_;
         KEY result = func();
@@ -28,7 +28,7 @@
 #define LIBSHARAKU_WORKQ_PLUSPLUS_HPP
 
 #include <functional>
-#include <deque>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <memory>
@@ -37,6 +37,18 @@
 #include <atomic>
 #include <condition_variable>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <iterator>
+#include <string>
+#include <fstream>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace sharaku {
 namespace workque {
@@ -44,262 +56,4111 @@ namespace workque {
   // 処理優先度の型
   using nice_t = uint32_t;
 
+  // スケジューリング方式
+  enum class sched_mode : int {
+    global_fifo,        // 全ワーカーで1つのFIFOを共有する (nice値内の順序を厳密に保つ)
+    work_stealing,      // ワーカー毎のローカルキューを持ち, 空いたワーカーが他から盗み出す
+    lock_free_ring,     // ロックフリーの固定長リングを共有する (nice値による優先順位は付けない)
+    earliest_deadline,  // 全ワーカーで期限順のキューを共有する (期限が同じものはnice値順)
+  };
+
+  // 期限を過ぎてから取り出した処理の扱い
+  enum class deadline_miss : int {
+    run,                // 遅れて実行する
+    drop,               // 実行せずに捨てる
+  };
+
+  // 周期実行が遅れ, 次の期限を過ぎていた場合の扱い
+  enum class missed_tick : int {
+    catch_up,           // 過ぎた回をすべて続けて実行し, 遅れを取り戻す
+    skip,               // 過ぎた回は実行せず, 次の期限まで待つ
+    coalesce,           // 過ぎた回をまとめて1回だけ直ちに実行する
+  };
+
+  // ワーカーのグループ (NUMAノード等)
+  struct worker_group {
+    // グループのワーカーを固定するCPU番号. 空の場合は固定しない.
+    std::vector<int> cpus;
+    // ワーカー数. 0 の場合は cpus の数 (cpus も空の場合は1).
+    uint32_t threads = 0;
+
+    worker_group() {}
+    worker_group(std::vector<int> c, uint32_t n = 0)
+     : cpus(std::move(c)), threads(n)
+    {}
+  };
+
+  // ワーカーの配置
+  //
+  // work_stealing 時, 各ワーカーはまず同じグループのワーカーから盗み,
+  // グループ内に処理がない場合のみ他のグループから盗む.
+  // ノードを優先するのは work_stealing のみで, 他の方式ではCPUへの固定のみを行う.
+  // ワーカー以外から登録したものは, 登録したスレッドのノードに関係なく共有のキューへ積む.
+  struct topology {
+    std::vector<worker_group> groups;
+
+    // "0-3,8-11" 形式のCPU(ノード)番号の一覧を解釈する
+    static std::vector<int> parse_cpulist(const std::string &str) {
+      std::vector<int> list;
+      size_t pos = 0;
+      while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos) {
+          end = str.size();
+        }
+        const std::string item = str.substr(pos, end - pos);
+        const size_t dash = item.find('-');
+        try {
+          if (dash == std::string::npos) {
+            list.push_back(std::stoi(item));
+          } else {
+            const int first = std::stoi(item.substr(0, dash));
+            const int last = std::stoi(item.substr(dash + 1));
+            for (int i = first; i <= last; i++) {
+              list.push_back(i);
+            }
+          }
+        } catch (const std::exception &) {
+          // 解釈できない項目は無視する
+        }
+        pos = end + 1;
+      }
+      return list;
+    }
+
+    // 指定したCPUへ固定する1グループの配置
+    static topology with_cpus(std::vector<int> cpus, uint32_t threads = 0) {
+      topology topo;
+      topo.groups.push_back(worker_group{std::move(cpus), threads});
+      return topo;
+    }
+
+    // NUMAノード毎にグループを作る (/sys/devices/system/node を参照する).
+    // ノード情報を取得できない場合は, CPU数分のワーカーを固定せずに1グループで作る.
+    static topology numa(uint32_t threads_per_node = 0) {
+      topology topo;
+      const std::string base = "/sys/devices/system/node/";
+      std::ifstream online(base + "online");
+      std::string line;
+      if (online && std::getline(online, line)) {
+        for (int node : parse_cpulist(line)) {
+          std::ifstream cpulist(base + "node" + std::to_string(node) + "/cpulist");
+          std::string cpus;
+          if (cpulist && std::getline(cpulist, cpus)) {
+            worker_group g{parse_cpulist(cpus), threads_per_node};
+            if (!g.cpus.empty()) {
+              topo.groups.push_back(std::move(g));
+            }
+          }
+        }
+      }
+      if (topo.groups.empty()) {
+        const uint32_t n = std::max(1u, std::thread::hardware_concurrency());
+        topo.groups.push_back(worker_group{{}, threads_per_node ? threads_per_node : n});
+      }
+      return topo;
+    }
+  };
+
+  // 負荷に応じてワーカー数を増減する設定
+  //
+  // 積まれている数, または登録から実行開始までの時間が閾値を超え, 空いているワーカーがいなければ
+  // max_threads まで1つずつスレッドを追加する. keepalive の間処理のなかったスレッドは
+  // min_threads まで終了する. 実行中の処理が中断されることはない.
+  struct elastic_config {
+    // スレッド数の下限. 0 の場合, 処理がない間はスレッドを残さない.
+    uint32_t min_threads = 1;
+    // スレッド数の上限. 0 の場合はCPU数.
+    uint32_t max_threads = 0;
+    // 積まれている数がこれ以上であればスレッドを追加する
+    size_t backlog = 8;
+    // 登録から実行開始までの時間がこれを超えればスレッドを追加する. 0 の場合は見ない.
+    std::chrono::nanoseconds max_delay{0};
+    // これ以上処理がなかったスレッドを終了する
+    std::chrono::nanoseconds keepalive = std::chrono::seconds(10);
+  };
+
+  // 積まれている数が上限に達した場合の扱い
+  enum class overflow_policy : int {
+    block,              // 空くまで待つ (ワーカー内からの登録で時間の上限がなければ呼び出し元で実行する)
+    reject,             // 登録せずに捨てる
+    caller_runs,        // 登録せずに呼び出し元で実行する
+    drop_oldest,        // 最も古いものを捨てて登録する (捨てられるものがなければ reject と同じ)
+  };
+
+  // 積まれている数の上限
+  //
+  // 実行を待っている数 (グローバルのFIFO, リング) を数える. 上限を設定すると, work_stealing でも
+  // ワーカー内からの登録をローカルキューへ積まずにグローバルへ積み, 上限を適用する.
+  // タイムアウトしたタイマー, reactor が受け取ったI/O,
+  // push_continuation() で積む内部の継続 (strand, taskgraph, future, co_await, parallel_for) は制限しない.
+  struct capacity_config {
+    // 全体, nice値の段毎の上限. 0 は無制限.
+    size_t total = 0;
+    size_t per_level = 0;
+    overflow_policy policy = overflow_policy::block;
+    // block 時に待つ時間の上限. 0 は無制限. 超えた場合は捨てる.
+    std::chrono::nanoseconds block_timeout{0};
+  };
+
+  // 待ち合わせ(起床)に関する統計
+  struct wakeup_stats {
+    // ワーカーが待ちに入った回数
+    uint64_t parks = 0;
+    // 待っているワーカーを起こした回数
+    uint64_t wakeups = 0;
+    // 待っているワーカーがいないため起こさなかった回数
+    uint64_t wakeups_skipped = 0;
+    // 待ちに入る前のスピン中に処理が見つかった回数
+    uint64_t spin_hits = 0;
+    // タイマーのslackにより他のタイマーとまとめてタイムアウトさせ, 省略できた起床の回数
+    uint64_t timer_wakeups_saved = 0;
+  };
+
+  // eventのメモリプールに関する統計
+  struct pool_stats {
+    // プールから払い出した数
+    uint64_t allocs = 0;
+    // プールへ返却された数
+    uint64_t frees = 0;
+    // スレッド毎のキャッシュから払い出した数
+    uint64_t cache_hits = 0;
+    // スラブ (ブロックの塊) を確保した数
+    uint64_t slab_allocs = 0;
+    // ブロックに収まらず通常のヒープを使用した数
+    uint64_t heap_fallbacks = 0;
+  };
+
+  // 時間の分布 (HDR形式のヒストグラム, 単位 ns)
+  // 2の冪乗毎の区間を 2^sub_bits 等分したバケットに数えるため, 相対誤差は 1/2^sub_bits 以内.
+  struct latency_histogram {
+    static constexpr uint32_t sub_bits = 3;
+    static constexpr uint32_t buckets = 64 << sub_bits;
+
+    uint64_t counts[buckets] = {};
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+
+    // 値が入るバケット
+    static uint32_t bucket(uint64_t ns) {
+      if (ns < (1u << sub_bits)) {
+        return static_cast<uint32_t>(ns);
+      }
+      const uint32_t msb = 63 - __builtin_clzll(ns);
+      return ((msb - sub_bits + 1) << sub_bits) |
+             static_cast<uint32_t>((ns >> (msb - sub_bits)) & ((1u << sub_bits) - 1));
+    }
+
+    // バケットに入る最小値
+    static uint64_t lower_bound(uint32_t b) {
+      if (b < (1u << sub_bits)) {
+        return b;
+      }
+      const uint32_t e = b >> sub_bits;
+      return static_cast<uint64_t>((1u << sub_bits) | (b & ((1u << sub_bits) - 1))) << (e - 1);
+    }
+
+    // p (0.0〜1.0) の位置の値. バケットの上限で返す.
+    uint64_t percentile(double p) const {
+      if (count == 0) {
+        return 0;
+      }
+      uint64_t target = static_cast<uint64_t>(p * static_cast<double>(count));
+      if (target == 0) {
+        target = 1;
+      }
+      uint64_t acc = 0;
+      for (uint32_t b = 0; b < buckets; b++) {
+        acc += counts[b];
+        if (acc >= target) {
+          const uint64_t upper = b + 1 < buckets ? lower_bound(b + 1) - 1 : UINT64_MAX;
+          return std::min(upper, max_ns);
+        }
+      }
+      return max_ns;
+    }
+
+    uint64_t mean() const {
+      return count ? sum_ns / count : 0;
+    }
+  };
+
+  // ワーカースレッド毎の統計
+  struct worker_stats {
+    // 実行中のスレッドか
+    bool active = false;
+    // 実行した数
+    uint64_t executed = 0;
+    // 処理を実行していた時間, 処理を待っていた時間 (with_stats() 有効時のみ)
+    uint64_t busy_ns = 0;
+    uint64_t idle_ns = 0;
+  };
+
+  // スケジューラの統計
+  struct sched_stats {
+    // nice値の段毎にFIFOに積まれている数 (取消済みで未破棄のものを含む)
+    std::vector<size_t> depth;
+    // ワーカーのローカルキュー (work_stealing), リング (lock_free_ring) に積まれている数
+    size_t local_depth = 0;
+    size_t ring_depth = 0;
+    // タイマー待ちの数
+    size_t timers = 0;
+    // 実行した数
+    uint64_t executed = 0;
+    std::vector<worker_stats> workers;
+    // 登録から実行開始までの時間, 実行時間 (with_stats() 有効時のみ)
+    latency_histogram queue_delay;
+    latency_histogram exec_time;
+    // 伸縮するスレッドの現在の数, 追加した数, 終了した数 (start(elastic_config) 時のみ)
+    uint32_t threads = 0;
+    uint64_t threads_started = 0;
+    uint64_t threads_retired = 0;
+    // 期限を過ぎてから取り出した数, そのうち実行せずに捨てた数
+    uint64_t deadline_missed = 0;
+    uint64_t deadline_dropped = 0;
+    // 上限に達した際に, 捨てた数, 古いものを捨てた数, 呼び出し元で実行した数, 空きを待った数
+    uint64_t rejected = 0;
+    uint64_t evicted = 0;
+    uint64_t caller_ran = 0;
+    uint64_t blocked = 0;
+  };
+
+  namespace __internal__ { namespace workque {
+    class workque_internal___;
+    struct entry;
+
+    // 空の関数オブジェクトか (std::function, 関数ポインタのみ判定できる)
+    template<class F>
+    bool is_null_function(const std::function<F> &f) {
+      return !f;
+    }
+    template<class F>
+    bool is_null_function(F *f) {
+      return f == nullptr;
+    }
+    template<class F>
+    bool is_null_function(const F &) {
+      return false;
+    }
+
+    // 引数なしで呼び出せるか (std::is_invocable<F> 相当)
+    template<class F, class = void>
+    struct is_invocable___ : std::false_type {};
+    template<class F>
+    struct is_invocable___<F, decltype(void(std::declval<F>()()))> : std::true_type {};
+  } }
+
+  // ムーブのみ可能な関数オブジェクト
+  //
+  // inline_size 以下でムーブ時に例外を投げない関数オブジェクトは内部領域に保持し,
+  // メモリ確保を行わない. それ以外はヒープに確保する.
+  class task {
+   public:
+    static constexpr size_t inline_size = 48;
+
+   private:
+    struct ops_t {
+      void (*call)(void *p);
+      void (*move)(void *dst, void *src);
+      void (*destroy)(void *p);
+    };
+
+    template<class F>
+    static constexpr bool is_inline() {
+      return sizeof(F) <= inline_size &&
+             alignof(F) <= alignof(std::max_align_t) &&
+             std::is_nothrow_move_constructible<F>::value;
+    }
+
+    // 内部領域に保持する場合の操作
+    template<class F>
+    struct inline_ops {
+      static void call(void *p) {
+        (*static_cast<F*>(p))();
+      }
+      static void move(void *dst, void *src) {
+        new (dst) F(std::move(*static_cast<F*>(src)));
+        static_cast<F*>(src)->~F();
+      }
+      static void destroy(void *p) {
+        static_cast<F*>(p)->~F();
+      }
+      static constexpr ops_t ops = {call, move, destroy};
+    };
+
+    // ヒープに保持する場合の操作. 内部領域にはポインタを置く.
+    template<class F>
+    struct heap_ops {
+      static void call(void *p) {
+        (**static_cast<F**>(p))();
+      }
+      static void move(void *dst, void *src) {
+        *static_cast<F**>(dst) = *static_cast<F**>(src);
+      }
+      static void destroy(void *p) {
+        delete *static_cast<F**>(p);
+      }
+      static constexpr ops_t ops = {call, move, destroy};
+    };
+
+    alignas(std::max_align_t) unsigned char buf_[inline_size];
+    const ops_t *ops_ = nullptr;
+
+    void reset() {
+      if (ops_) {
+        ops_->destroy(buf_);
+        ops_ = nullptr;
+      }
+    }
+
+    template<class T, class F>
+    void init(F &&func, std::true_type) {
+      new (buf_) T(std::forward<F>(func));
+      ops_ = &inline_ops<T>::ops;
+    }
+
+    template<class T, class F>
+    void init(F &&func, std::false_type) {
+      *reinterpret_cast<T**>(buf_) = new T(std::forward<F>(func));
+      ops_ = &heap_ops<T>::ops;
+    }
+
+   public:
+    task() noexcept {}
+    task(std::nullptr_t) noexcept {}
+
+    template<class F, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<F>::type, task>::value &&
+      !std::is_same<typename std::decay<F>::type, std::nullptr_t>::value>::type>
+    task(F &&func) {
+      using T = typename std::decay<F>::type;
+      if (__internal__::workque::is_null_function(func)) {
+        return;
+      }
+      init<T>(std::forward<F>(func), std::integral_constant<bool, is_inline<T>()>());
+    }
+
+    task(task &&t) noexcept {
+      if (t.ops_) {
+        t.ops_->move(buf_, t.buf_);
+        ops_ = t.ops_;
+        t.ops_ = nullptr;
+      }
+    }
+
+    task& operator=(task &&t) noexcept {
+      if (this != &t) {
+        reset();
+        if (t.ops_) {
+          t.ops_->move(buf_, t.buf_);
+          ops_ = t.ops_;
+          t.ops_ = nullptr;
+        }
+      }
+      return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task() {
+      reset();
+    }
+
+    explicit operator bool() const noexcept {
+      return ops_ != nullptr;
+    }
+
+    // 保持している関数オブジェクトを実行する
+    void operator()() {
+      ops_->call(buf_);
+    }
+  };
+
+#if __cplusplus < 201703L
+  // C++17 より前は, アドレスを取る static constexpr メンバに定義が必要
+  template<class F>
+  constexpr task::ops_t task::inline_ops<F>::ops;
+  template<class F>
+  constexpr task::ops_t task::heap_ops<F>::ops;
+#endif
+
   //イベントクラス
   class event {
+    friend class __internal__::workque::workque_internal___;
+    friend struct __internal__::workque::entry;
+
    private:
-    std::function<void(void)> func_ = nullptr;
+    // 状態 (下位2bit) と登録毎に進める世代 (上位bit)
+    static constexpr uint64_t state_idle = 0;
+    static constexpr uint64_t state_pending = 1;
+    static constexpr uint64_t state_running = 2;
+    static constexpr uint64_t state_mask = 3;
+
+    task func_ = nullptr;
     nice_t nice_ = 0;
+    std::atomic<uint64_t> state_{state_idle};
+    // タイマー待ちのハンドル (workqueの mtx_ で保護)
+    uint32_t timer_index_ = UINT32_MAX;
+    uint32_t timer_gen_ = 0;
+    // タイマーへ積んだ時の世代
+    uint64_t timer_ev_gen_ = 0;
+    // ワーカーのローカルキューに積まれている間, 自身を保持するための参照
+    std::shared_ptr<event> queued_ref_ = nullptr;
+    // ローカルキューに積まれている間 true
+    std::atomic<bool> in_local_{false};
+    // ローカルキューに積んだ時の世代, 時刻
+    uint64_t local_gen_ = 0;
+    int64_t local_enqueued_ = 0;
+    // 周期実行の状態 (periodic_*)
+    static constexpr uint32_t periodic_none = 0;
+    static constexpr uint32_t periodic_active = 1;
+    static constexpr uint32_t periodic_stopped = 2;
+    std::atomic<uint32_t> periodic_{periodic_none};
+
+    // 待ち状態にし, 登録の世代を gen に返す. 既に待ち状態の場合は false.
+    bool mark_pending(uint64_t &gen) {
+      uint64_t s = state_.load(std::memory_order_relaxed);
+      do {
+        if ((s & state_mask) == state_pending) {
+          return false;
+        }
+        gen = ((s & ~state_mask) + (state_mask + 1)) | state_pending;
+      } while (!state_.compare_exchange_weak(s, gen, std::memory_order_acq_rel));
+      return true;
+    }
+
+    // 世代 gen の登録を実行状態にする. 取消済み, 登録し直された場合は false.
+    bool claim(uint64_t gen) {
+      return state_.compare_exchange_strong(gen, (gen & ~state_mask) | state_running,
+                                            std::memory_order_acq_rel);
+    }
+
+    // 実行を終える. 実行中に登録し直された場合は待ち状態のまま.
+    void finish(uint64_t gen) {
+      uint64_t s = (gen & ~state_mask) | state_running;
+      state_.compare_exchange_strong(s, gen & ~state_mask, std::memory_order_acq_rel);
+    }
+
+    // 待ち状態を取り消す. 待ち状態でなければ false.
+    bool mark_cancel() {
+      uint64_t s = state_.load(std::memory_order_relaxed);
+      do {
+        if ((s & state_mask) != state_pending) {
+          return false;
+        }
+      } while (!state_.compare_exchange_weak(s, s & ~state_mask, std::memory_order_acq_rel));
+      return true;
+    }
 
    public:
     event() = delete;
     event(nice_t nice) {
       nice_ = nice;
     }
-    event(nice_t nice, std::function<void(void)> func) {
+    template<class F>
+    event(nice_t nice, F &&func)
+     : func_(std::forward<F>(func))
+    {
+      nice_ = nice;
+    }
+
+    event& set_nice(nice_t nice) {
       nice_ = nice;
-      func_ = func;
+      return *this;
+    }
+
+    template<class F>
+    event& set_function(F &&func) {
+      func_ = task(std::forward<F>(func));
+      return *this;
+    }
+
+    // nice値を取得
+    nice_t get_nice() {
+      return nice_;
+    }
+
+    // キューまたはタイマーに積まれ, 実行を待っているか
+    bool is_pending() const {
+      return (state_.load(std::memory_order_acquire) & state_mask) == state_pending;
+    }
+
+    // 登録された処理を実行
+    void operator()() {
+      if (func_) {
+        func_();
+      }
     }
+  };
+
+  namespace __internal__ { namespace workque {
+    using event = sharaku::workque::event;
+
+    // event用のスラブプール
+    //
+    // 同じ大きさのブロックをスラブ単位でまとめて確保し, 解放されたブロックは
+    // フリーリストで再利用する. スレッド毎に少数のブロックをキャッシュし,
+    // 同じスレッドでの確保, 解放ではロックを取らない.
+    // ブロックの大きさは最初の確保要求で決まり, それより大きな要求は通常のヒープを使用する.
+    class event_pool_internal___ : public std::enable_shared_from_this<event_pool_internal___> {
+     protected:
+      struct free_block {
+        free_block *next;
+      };
+
+      // スレッド毎のキャッシュ. 直近に使用したプール1つ分を保持する.
+      struct thread_cache {
+        std::shared_ptr<event_pool_internal___> pool;
+        free_block *head = nullptr;
+        uint32_t count = 0;
+
+        ~thread_cache() {
+          flush();
+        }
+
+        void flush() {
+          if (pool) {
+            pool->release_list(head, count);
+            head = nullptr;
+            count = 0;
+            pool.reset();
+          }
+        }
+      };
+
+      static constexpr uint32_t blocks_per_slab = 64;
+      static constexpr uint32_t cache_max = 64;
+      static constexpr uint32_t refill_count = 32;
+
+
+      std::mutex mtx_;
+      free_block *free_ = nullptr;
+      std::vector<std::unique_ptr<unsigned char[]>> slabs_;
+      std::atomic<size_t> block_size_{0};
+
+      std::atomic<uint64_t> stat_allocs_{0};
+      std::atomic<uint64_t> stat_frees_{0};
+      std::atomic<uint64_t> stat_cache_hits_{0};
+      std::atomic<uint64_t> stat_slab_allocs_{0};
+      std::atomic<uint64_t> stat_heap_fallbacks_{0};
+
+      // フリーリストをまとめて返却する
+      void release_list(free_block *head, uint32_t count) {
+        if (head == nullptr) {
+          return;
+        }
+        free_block *tail = head;
+        for (uint32_t i = 1; i < count; i++) {
+          tail = tail->next;
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        tail->next = free_;
+        free_ = head;
+      }
+
+      // フリーリストから最大 n 個を取り出す. 空ならスラブを確保する.
+      free_block *acquire_list(uint32_t n, uint32_t &count) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (free_ == nullptr) {
+          const size_t bs = block_size_.load(std::memory_order_relaxed);
+          slabs_.emplace_back(new unsigned char[bs * blocks_per_slab]);
+          stat_slab_allocs_.fetch_add(1, std::memory_order_relaxed);
+          unsigned char *slab = slabs_.back().get();
+          for (uint32_t i = 0; i < blocks_per_slab; i++) {
+            free_block *b = reinterpret_cast<free_block*>(slab + bs * i);
+            b->next = free_;
+            free_ = b;
+          }
+        }
+        free_block *head = free_;
+        free_block *tail = head;
+        count = 1;
+        while (count < n && tail->next) {
+          tail = tail->next;
+          count ++;
+        }
+        free_ = tail->next;
+        tail->next = nullptr;
+        return head;
+      }
+
+      // このスレッドのキャッシュをこのプール用にする
+      thread_cache &local_cache() {
+        static thread_local thread_cache cache;
+        thread_cache &c = cache;
+        if (c.pool.get() != this) {
+          c.flush();
+          c.pool = shared_from_this();
+        }
+        return c;
+      }
+
+     public:
+      event_pool_internal___() = default;
+      event_pool_internal___(const event_pool_internal___&) = delete;
+      event_pool_internal___& operator=(const event_pool_internal___&) = delete;
+
+      void *allocate(size_t size, size_t align) {
+        size_t bs = block_size_.load(std::memory_order_relaxed);
+        if (bs == 0) {
+          // 最初の要求でブロックの大きさを決める
+          const size_t a = alignof(std::max_align_t);
+          size_t want = (size + a - 1) / a * a;
+          if (block_size_.compare_exchange_strong(bs, want)) {
+            bs = want;
+          }
+        }
+        if (size > bs || align > alignof(std::max_align_t)) {
+          stat_heap_fallbacks_.fetch_add(1, std::memory_order_relaxed);
+          return ::operator new(size);
+        }
+
+        stat_allocs_.fetch_add(1, std::memory_order_relaxed);
+        thread_cache &c = local_cache();
+        if (c.head) {
+          stat_cache_hits_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          c.head = acquire_list(refill_count, c.count);
+        }
+        free_block *b = c.head;
+        c.head = b->next;
+        c.count --;
+        return b;
+      }
+
+      void deallocate(void *p, size_t size) {
+        if (size > block_size_.load(std::memory_order_relaxed)) {
+          ::operator delete(p);
+          return;
+        }
+        stat_frees_.fetch_add(1, std::memory_order_relaxed);
+        thread_cache &c = local_cache();
+        free_block *b = static_cast<free_block*>(p);
+        b->next = c.head;
+        c.head = b;
+        c.count ++;
+        if (c.count > cache_max) {
+          // 溢れた分をプールへ戻す
+          uint32_t n = 0;
+          free_block *keep = c.head;
+          for (n = 1; n < cache_max / 2; n++) {
+            keep = keep->next;
+          }
+          free_block *rest = keep->next;
+          keep->next = nullptr;
+          release_list(rest, c.count - n);
+          c.count = n;
+        }
+      }
+
+      pool_stats get_stats() const {
+        pool_stats st;
+        st.allocs = stat_allocs_.load(std::memory_order_relaxed);
+        st.frees = stat_frees_.load(std::memory_order_relaxed);
+        st.cache_hits = stat_cache_hits_.load(std::memory_order_relaxed);
+        st.slab_allocs = stat_slab_allocs_.load(std::memory_order_relaxed);
+        st.heap_fallbacks = stat_heap_fallbacks_.load(std::memory_order_relaxed);
+        return st;
+      }
+    };
+
+    // event_pool_internal___ から確保するアロケータ.
+    // std::allocate_shared と組み合わせ, event と参照カウントを1つのブロックに置く.
+    // アロケータがプールへの参照を持つため, 払い出したeventが残っている間はプールも残る.
+    template<class T>
+    struct pool_allocator___ {
+      using value_type = T;
+
+      std::shared_ptr<event_pool_internal___> pool;
+
+      pool_allocator___(std::shared_ptr<event_pool_internal___> p)
+       : pool(std::move(p))
+      {}
+      template<class U>
+      pool_allocator___(const pool_allocator___<U> &a)
+       : pool(a.pool)
+      {}
+
+      T *allocate(size_t n) {
+        return static_cast<T*>(pool->allocate(sizeof(T) * n, alignof(T)));
+      }
+      void deallocate(T *p, size_t n) {
+        pool->deallocate(p, sizeof(T) * n);
+      }
+
+      template<class U>
+      bool operator==(const pool_allocator___<U> &a) const {
+        return pool == a.pool;
+      }
+      template<class U>
+      bool operator!=(const pool_allocator___<U> &a) const {
+        return pool != a.pool;
+      }
+    };
+
+    // キューに積む単位
+    // 取消用のハンドルが必要な場合は event を, 不要な場合は関数オブジェクトを直接保持する.
+    struct entry {
+      std::shared_ptr<event> ev;
+      task func;
+      nice_t nice = 0;
+      // ev を登録した時の世代
+      uint64_t gen = 0;
+      // 積んだ時刻 (統計有効時のみ. steady_clockのカウント値)
+      int64_t enqueued = 0;
+      // 期限 (steady_clockのカウント値. 0 は期限なし), 期限を過ぎていた場合に捨てるか
+      int64_t deadline = 0;
+      bool drop_late = false;
+      // 期限順のキューで同じ期限, nice値のものを登録順にするための番号
+      uint64_t seq = 0;
+
+      entry() {}
+      entry(std::shared_ptr<event> e, uint64_t g)
+       : ev(std::move(e)), gen(g)
+      {
+        nice = ev->get_nice();
+      }
+      entry(nice_t n, task &&f)
+       : func(std::move(f)), nice(n)
+      {}
+
+      explicit operator bool() const {
+        return ev || func;
+      }
+
+      // 取消済み, 登録し直されたeventは実行しない. 実行した場合は true.
+      bool operator()() {
+        if (ev) {
+          if (!ev->claim(gen)) {
+            return false;
+          }
+          (*ev)();
+          ev->finish(gen);
+          return true;
+        } else if (func) {
+          func();
+          return true;
+        }
+        return false;
+      }
+    };
+
+    // 拡張可能なリングバッファによるFIFO
+    // 一度確保した領域は再利用するため, 定常状態では push/pop でメモリ確保が発生しない.
+    template<class T>
+    class ring_fifo_internal___ {
+     protected:
+      std::vector<T> buf_;
+      size_t head_ = 0;
+      size_t count_ = 0;
+
+      T& at(size_t i) {
+        return buf_[(head_ + i) & (buf_.size() - 1)];
+      }
+
+      void grow() {
+        std::vector<T> buf(buf_.size() ? buf_.size() * 2 : 16);
+        for (size_t i = 0; i < count_; i++) {
+          buf[i] = std::move(at(i));
+        }
+        buf_.swap(buf);
+        head_ = 0;
+      }
+
+     public:
+      void push_back(T v) {
+        if (count_ == buf_.size()) {
+          grow();
+        }
+        at(count_) = std::move(v);
+        count_ ++;
+      }
+
+      T& front() {
+        return at(0);
+      }
+
+      void pop_front() {
+        at(0) = T();
+        head_ = (head_ + 1) & (buf_.size() - 1);
+        count_ --;
+      }
+
+      // 条件に一致する最初の要素を取り除く
+      template<class F>
+      bool erase_first(F pred) {
+        for (size_t i = 0; i < count_; i++) {
+          if (pred(at(i))) {
+            for (; i + 1 < count_; i++) {
+              at(i) = std::move(at(i + 1));
+            }
+            at(count_ - 1) = T();
+            count_ --;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      size_t size() const {
+        return count_;
+      }
+
+      bool empty() const {
+        return count_ == 0;
+      }
+
+      void clear() {
+        buf_.clear();
+        head_ = 0;
+        count_ = 0;
+      }
+    };
+
+    // nice値毎のFIFOを持つ優先度付きキュー
+    //
+    // 段数は生成時に指定し (最大 max_levels), 範囲外のnice値は最も優先度の低い段へ丸める.
+    // 空でない段を2段のビットマップで管理し, 取り出しは find-first-set で O(1) に行う.
+    //
+    // 重みを設定すると, 空でない段を優先度順に巡回する deficit round robin で取り出す.
+    // 段は1巡毎に重みの数だけ取り出せるため, 低い優先度の段も重みに比例した割合で実行される.
+    template<class T>
+    class prio_fifo_internal___ {
+     public:
+      static constexpr nice_t max_levels = 64 * 64;
+
+     protected:
+      std::vector<ring_fifo_internal___<T>> fifo_;
+      // 段毎の使用状況と, 空でないビットマップのワードの使用状況
+      std::vector<uint64_t> bitmap_;
+      uint64_t summary_ = 0;
+      // 段毎の重み. 空の場合は厳密な優先順.
+      std::vector<uint32_t> weight_;
+      // 段毎の残りの取り出し数, 巡回中の段 (levels() 以上の場合は巡回前)
+      std::vector<int64_t> deficit_;
+      nice_t cur_ = max_levels;
+
+      void mark(nice_t level) {
+        bitmap_[level / 64] |= 1ull << (level % 64);
+        summary_ |= 1ull << (level / 64);
+      }
+
+      void unmark(nice_t level) {
+        bitmap_[level / 64] &= ~(1ull << (level % 64));
+        if (bitmap_[level / 64] == 0) {
+          summary_ &= ~(1ull << (level / 64));
+        }
+      }
+
+     public:
+      prio_fifo_internal___(nice_t levels = 64) {
+        if (levels == 0) {
+          levels = 1;
+        } else if (levels > max_levels) {
+          levels = max_levels;
+        }
+        fifo_.resize(levels);
+        bitmap_.assign((levels + 63) / 64, 0);
+      }
+
+      nice_t levels() const {
+        return static_cast<nice_t>(fifo_.size());
+      }
+
+      // nice値を段に丸める
+      nice_t level(nice_t nice) const {
+        return nice < levels() ? nice : levels() - 1;
+      }
+
+      void push(nice_t nice, T v) {
+        const nice_t l = level(nice);
+        fifo_[l].push_back(std::move(v));
+        mark(l);
+      }
+
+      // 段毎の重みを設定する. 足りない段は最後の重みを使用し, 空の場合は厳密な優先順に戻す.
+      void set_weights(const std::vector<uint32_t> &weights) {
+        if (weights.empty()) {
+          weight_.clear();
+          deficit_.clear();
+          return;
+        }
+        weight_.resize(levels());
+        for (nice_t l = 0; l < levels(); l++) {
+          const uint32_t w = l < weights.size() ? weights[l] : weights.back();
+          weight_[l] = w ? w : 1;
+        }
+        deficit_.assign(levels(), 0);
+        cur_ = levels();
+      }
+
+      bool weighted() const {
+        return !weight_.empty();
+      }
+
+      // nice値の段の重み. 重みを設定していない場合は 1.
+      uint32_t weight(nice_t nice) const {
+        return weighted() ? weight_[level(nice)] : 1;
+      }
+
+      // 段 from 以降で空でない最初の段. なければ false.
+      bool find_level(nice_t from, nice_t &l) const {
+        nice_t w = from / 64;
+        if (w >= bitmap_.size()) {
+          return false;
+        }
+        const uint64_t bits = bitmap_[w] & (~0ull << (from % 64));
+        if (bits) {
+          l = w * 64 + __builtin_ctzll(bits);
+          return true;
+        }
+        const uint64_t words = w + 1 < 64 ? summary_ & (~0ull << (w + 1)) : 0;
+        if (words == 0) {
+          return false;
+        }
+        w = __builtin_ctzll(words);
+        l = w * 64 + __builtin_ctzll(bitmap_[w]);
+        return true;
+      }
+
+      // 次に取り出す段の番号. 空の場合は false.
+      // 厳密な優先順では最も優先度の高い段, 重み付きでは巡回中の段 (使い切っていれば次の段).
+      bool front_level(nice_t &l) const {
+        if (summary_ == 0) {
+          return false;
+        }
+        if (weighted()) {
+          if (cur_ < levels() && deficit_[cur_] > 0 && !fifo_[cur_].empty()) {
+            l = cur_;
+            return true;
+          }
+          if (find_level(cur_ + 1, l)) {
+            return true;
+          }
+        }
+        const nice_t w = __builtin_ctzll(summary_);
+        l = w * 64 + __builtin_ctzll(bitmap_[w]);
+        return true;
+      }
+
+      // 次の段から取り出す
+      bool pop(T &v) {
+        nice_t l;
+        if (!front_level(l)) {
+          return false;
+        }
+        if (weighted()) {
+          // 巡回が次の段へ移れば, その段の1巡分を足す
+          if (l != cur_ || deficit_[l] <= 0) {
+            cur_ = l;
+            deficit_[l] += weight_[l];
+          }
+          deficit_[l] --;
+        }
+        v = std::move(fifo_[l].front());
+        fifo_[l].pop_front();
+        if (fifo_[l].empty()) {
+          unmark(l);
+          if (weighted()) {
+            deficit_[l] = 0;
+          }
+        }
+        return true;
+      }
+
+      // 最も優先度の低い段の番号. 空の場合は false.
+      bool back_level(nice_t &l) const {
+        if (summary_ == 0) {
+          return false;
+        }
+        const nice_t w = 63 - __builtin_clzll(summary_);
+        l = w * 64 + 63 - __builtin_clzll(bitmap_[w]);
+        return true;
+      }
+
+      // 段 l の先頭 (最も古いもの) を取り出す
+      bool pop_level(nice_t l, T &v) {
+        if (fifo_[l].empty()) {
+          return false;
+        }
+        v = std::move(fifo_[l].front());
+        fifo_[l].pop_front();
+        if (fifo_[l].empty()) {
+          unmark(l);
+          if (weighted()) {
+            deficit_[l] = 0;
+          }
+        }
+        return true;
+      }
+
+      // 指定したnice値の段から条件に一致するものを取り除く
+      template<class F>
+      bool erase(nice_t nice, F pred) {
+        const nice_t l = level(nice);
+        if (!fifo_[l].erase_first(pred)) {
+          return false;
+        }
+        if (fifo_[l].empty()) {
+          unmark(l);
+          if (weighted()) {
+            deficit_[l] = 0;
+          }
+        }
+        return true;
+      }
+
+      // 段毎の数
+      size_t size(nice_t l) const {
+        return fifo_[l].size();
+      }
+
+      void clear() {
+        for (auto &fifo : fifo_) {
+          fifo.clear();
+        }
+        std::fill(bitmap_.begin(), bitmap_.end(), 0);
+        summary_ = 0;
+        std::fill(deficit_.begin(), deficit_.end(), 0);
+        cur_ = levels();
+      }
+    };
+
+    // 期限順のキュー
+    //
+    // 期限 (deadline) の早いものから取り出す二分ヒープ. 期限が同じものはnice値,
+    // 登録順に取り出し, 期限のないものは期限のあるものの後になる.
+    template<class T>
+    class deadline_heap_internal___ {
+     protected:
+      std::vector<T> heap_;
+      uint64_t seq_ = 0;
+
+      // a を b より後に取り出すか
+      static bool later(const T &a, const T &b) {
+        const uint64_t da = a.deadline ? (uint64_t)a.deadline : UINT64_MAX;
+        const uint64_t db = b.deadline ? (uint64_t)b.deadline : UINT64_MAX;
+        if (da != db) {
+          return da > db;
+        }
+        if (a.nice != b.nice) {
+          return a.nice > b.nice;
+        }
+        return a.seq > b.seq;
+      }
+
+     public:
+      void push(T v) {
+        v.seq = seq_++;
+        heap_.push_back(std::move(v));
+        std::push_heap(heap_.begin(), heap_.end(), later);
+      }
+
+      bool pop(T &v) {
+        if (heap_.empty()) {
+          return false;
+        }
+        std::pop_heap(heap_.begin(), heap_.end(), later);
+        v = std::move(heap_.back());
+        heap_.pop_back();
+        return true;
+      }
+
+      // 最も古く登録したものを取り出す (O(n))
+      bool pop_oldest(T &v) {
+        if (heap_.empty()) {
+          return false;
+        }
+        auto it = std::min_element(heap_.begin(), heap_.end(),
+                                   [](const T &a, const T &b) { return a.seq < b.seq; });
+        v = std::move(*it);
+        *it = std::move(heap_.back());
+        heap_.pop_back();
+        std::make_heap(heap_.begin(), heap_.end(), later);
+        return true;
+      }
+
+      // 次に取り出すもの. 空の場合は nullptr.
+      const T *front() const {
+        return heap_.empty() ? nullptr : &heap_.front();
+      }
+
+      size_t size() const {
+        return heap_.size();
+      }
+
+      void clear() {
+        heap_.clear();
+      }
+    };
+
+    // 階層タイミングホイール
+    //
+    // 1段あたり64スロットのホイールを levels 段持ち, tick 単位で時刻を管理する.
+    // 登録, 取消はノード番号(世代付き)によって O(1) で行い, ノードは内部の
+    // 配列から再利用するため登録毎のメモリ確保は発生しない.
+    // 最上段の範囲を超える遠いタイマーはオーバーフローリストで保持し,
+    // 最上段が一周する毎に再配置する.
+    //
+    // slack を指定したタイマーは [期限, 期限 + slack] の中で下位bitが最も多く0になるtickで
+    // タイムアウトさせる. 範囲が重なるタイマーは同じtickに揃い, 1回の起床でまとめて処理される.
+    template<class T>
+    class timer_wheel_internal___ {
+     public:
+      using clock = std::chrono::steady_clock;
+
+      static constexpr uint32_t slot_bits = 6;
+      static constexpr uint32_t slots = 1u << slot_bits;
+      static constexpr uint32_t npos = UINT32_MAX;
+
+      // 登録したタイマーを指すハンドル
+      struct handle {
+        uint32_t index = npos;
+        uint32_t gen = 0;
+
+        handle() {}
+        handle(uint32_t i, uint32_t g) : index(i), gen(g) {}
+      };
+
+     protected:
+      struct node {
+        T value;
+        // タイムアウトするtick
+        uint64_t expire = 0;
+        // 本来の期限のtick (slack で遅らせる前)
+        uint64_t due = 0;
+        // 所属するリスト (npos: 未使用)
+        uint32_t list = npos;
+        uint32_t prev = npos;
+        uint32_t next = npos;
+        uint32_t gen = 0;
+      };
+
+      clock::duration tick_;
+      uint32_t levels_;
+      clock::time_point origin_;
+      // 処理済みのtick
+      uint64_t now_tick_ = 0;
+
+      std::vector<node> nodes_;
+      uint32_t free_ = npos;
+      // リスト先頭, 末尾. [段 * slots + スロット], 最後はオーバーフローリスト.
+      std::vector<uint32_t> heads_;
+      std::vector<uint32_t> tails_;
+      // 段毎のスロット使用状況
+      std::vector<uint64_t> bitmap_;
+      size_t count_ = 0;
+
+      // 処理中のtickでタイムアウトしたもののうち, 期限がそのtickのものがあるか, 遅らせたものの数
+      bool step_due_ = false;
+      uint64_t step_deferred_ = 0;
+      // slack によって省略できた起床の回数
+      uint64_t saved_ = 0;
+
+      uint32_t overflow_list() const {
+        return levels_ * slots;
+      }
+
+      // リスト末尾へ繋ぐ (同じtickのものは登録順にタイムアウトさせる)
+      void link(uint32_t idx, uint32_t list) {
+        node &n = nodes_[idx];
+        n.list = list;
+        n.next = npos;
+        n.prev = tails_[list];
+        if (n.prev != npos) {
+          nodes_[n.prev].next = idx;
+        } else {
+          heads_[list] = idx;
+        }
+        tails_[list] = idx;
+        if (list < overflow_list()) {
+          bitmap_[list / slots] |= 1ull << (list % slots);
+        }
+      }
+
+      void unlink(uint32_t idx) {
+        node &n = nodes_[idx];
+        if (n.prev != npos) {
+          nodes_[n.prev].next = n.next;
+        } else {
+          heads_[n.list] = n.next;
+        }
+        if (n.next != npos) {
+          nodes_[n.next].prev = n.prev;
+        } else {
+          tails_[n.list] = n.prev;
+        }
+        if (heads_[n.list] == npos && n.list < overflow_list()) {
+          bitmap_[n.list / slots] &= ~(1ull << (n.list % slots));
+        }
+        n.list = npos;
+      }
+
+      void release(uint32_t idx) {
+        node &n = nodes_[idx];
+        n.value = T();
+        n.gen ++;
+        n.next = free_;
+        free_ = idx;
+        count_ --;
+      }
+
+      // 現在のtickを基準に段, スロットを決めて繋ぐ. 期限切れの場合は false.
+      bool place(uint32_t idx) {
+        const uint64_t expire = nodes_[idx].expire;
+        if (expire <= now_tick_) {
+          return false;
+        }
+        for (uint32_t level = 0; level < levels_; level++) {
+          const uint32_t shift = slot_bits * (level + 1);
+          if ((expire >> shift) == (now_tick_ >> shift)) {
+            link(idx, level * slots + ((expire >> (slot_bits * level)) & (slots - 1)));
+            return true;
+          }
+        }
+        link(idx, overflow_list());
+        return true;
+      }
+
+      // リストを外して再配置する. 期限切れのものは func へ渡す.
+      template<class F>
+      void cascade(uint32_t list, F &func) {
+        // 同じリストへ戻るものがあるため, 先にリストごと切り離す
+        uint32_t idx = heads_[list];
+        heads_[list] = npos;
+        tails_[list] = npos;
+        if (list < overflow_list()) {
+          bitmap_[list / slots] &= ~(1ull << (list % slots));
+        }
+        while (idx != npos) {
+          uint32_t next = nodes_[idx].next;
+          nodes_[idx].list = npos;
+          if (!place(idx)) {
+            expire_node(idx, func);
+          }
+          idx = next;
+        }
+      }
+
+      template<class F>
+      void expire_node(uint32_t idx, F &func) {
+        if (nodes_[idx].due < now_tick_) {
+          step_deferred_ ++;
+        } else {
+          step_due_ = true;
+        }
+        T value = std::move(nodes_[idx].value);
+        release(idx);
+        func(std::move(value));
+      }
+
+      // 次に処理 (タイムアウトまたは再配置) が必要なtick. なければ UINT64_MAX.
+      uint64_t next_tick() const {
+        for (uint32_t level = 0; level < levels_; level++) {
+          const uint32_t shift = slot_bits * level;
+          const uint32_t cur = (now_tick_ >> shift) & (slots - 1);
+          uint64_t bm = bitmap_[level];
+          bm &= (cur == slots - 1) ? 0 : ~((2ull << cur) - 1);
+          if (bm) {
+            const uint64_t base = (now_tick_ >> (shift + slot_bits)) << (shift + slot_bits);
+            return base + (static_cast<uint64_t>(__builtin_ctzll(bm)) << shift);
+          }
+        }
+        if (heads_[overflow_list()] != npos) {
+          const uint32_t shift = slot_bits * levels_;
+          return ((now_tick_ >> shift) + 1) << shift;
+        }
+        return UINT64_MAX;
+      }
+
+      uint64_t to_tick(clock::time_point tp) const {
+        if (tp <= origin_) {
+          return 0;
+        }
+        return static_cast<uint64_t>((tp - origin_) / tick_);
+      }
+
+      // [lo, hi] の中で下位bitが最も多く0になるtick
+      static uint64_t align(uint64_t lo, uint64_t hi) {
+        if (hi <= lo) {
+          return lo;
+        }
+        const uint32_t bit = 63 - __builtin_clzll(lo ^ hi);
+        return hi & ~((1ull << bit) - 1);
+      }
+
+     public:
+      timer_wheel_internal___(clock::duration tick = std::chrono::milliseconds(1), uint32_t levels = 4) {
+        reset(tick, levels);
+      }
+
+      // tick幅, 段数を設定する. 登録済みのタイマーがある場合は失敗する.
+      bool reset(clock::duration tick, uint32_t levels) {
+        if (count_) {
+          return false;
+        }
+        tick_ = tick.count() > 0 ? tick : clock::duration(1);
+        levels_ = levels ? levels : 1;
+        if (levels_ * slot_bits > 60) {
+          levels_ = 60 / slot_bits;
+        }
+        origin_ = clock::now();
+        now_tick_ = 0;
+        heads_.assign(levels_ * slots + 1, npos);
+        tails_.assign(levels_ * slots + 1, npos);
+        bitmap_.assign(levels_, 0);
+        nodes_.clear();
+        free_ = npos;
+        return true;
+      }
+
+      clock::duration tick() const {
+        return tick_;
+      }
+
+      uint32_t levels() const {
+        return levels_;
+      }
+
+      size_t size() const {
+        return count_;
+      }
+
+      // slack によって省略できた起床の回数
+      uint64_t wakeups_saved() const {
+        return saved_;
+      }
+
+      // 指定時刻から slack の間にタイムアウトするよう登録する
+      handle insert(clock::time_point tp, T value, clock::duration slack = clock::duration::zero()) {
+        uint32_t idx = free_;
+        if (idx != npos) {
+          free_ = nodes_[idx].next;
+        } else {
+          idx = static_cast<uint32_t>(nodes_.size());
+          nodes_.emplace_back();
+        }
+        node &n = nodes_[idx];
+        n.value = std::move(value);
+        // 早く発火しないよう切り上げる
+        n.due = to_tick(tp);
+        if (origin_ + tick_ * n.due < tp) {
+          n.due ++;
+        }
+        if (n.due <= now_tick_) {
+          n.due = now_tick_ + 1;
+        }
+        n.expire = slack > clock::duration::zero() ? align(n.due, to_tick(tp + slack)) : n.due;
+        count_ ++;
+        place(idx);
+        return handle{idx, n.gen};
+      }
+
+      // 登録を取り消す. 既にタイムアウト済み, 取消済みの場合は false.
+      bool cancel(handle h) {
+        if (h.index >= nodes_.size()) {
+          return false;
+        }
+        node &n = nodes_[h.index];
+        if (n.gen != h.gen || n.list == npos) {
+          return false;
+        }
+        unlink(h.index);
+        release(h.index);
+        return true;
+      }
+
+      // 次のタイムアウト(または再配置)時刻. なければ time_point().
+      clock::time_point next_time() const {
+        const uint64_t t = next_tick();
+        if (t == UINT64_MAX) {
+          return clock::time_point();
+        }
+        return origin_ + tick_ * t;
+      }
+
+      // 指定時刻までを進め, タイムアウトしたものを順に func へ渡す
+      template<class F>
+      void advance(clock::time_point tp, F func) {
+        const uint64_t target = to_tick(tp);
+        while (count_) {
+          const uint64_t t = next_tick();
+          if (t > target) {
+            break;
+          }
+          now_tick_ = t;
+          step_due_ = false;
+          step_deferred_ = 0;
+
+          // 上位段から順に, 境界に達したスロットを再配置する
+          if ((t & ((1ull << (slot_bits * levels_)) - 1)) == 0) {
+            cascade(overflow_list(), func);
+          }
+          for (uint32_t level = levels_ - 1; level > 0; level--) {
+            const uint32_t shift = slot_bits * level;
+            if ((t & ((1ull << shift) - 1)) == 0) {
+              cascade(level * slots + ((t >> shift) & (slots - 1)), func);
+            }
+          }
+
+          // 最下段のスロットはすべてタイムアウト
+          const uint32_t list = t & (slots - 1);
+          uint32_t idx = heads_[list];
+          while (idx != npos) {
+            uint32_t next = nodes_[idx].next;
+            unlink(idx);
+            expire_node(idx, func);
+            idx = next;
+          }
+
+          // 遅らせたものはそれぞれ1回の起床を省略できた. 期限がこのtickのものがなければ,
+          // 遅らせたもののうち1つの分は起床している.
+          if (step_deferred_) {
+            saved_ += step_due_ ? step_deferred_ : step_deferred_ - 1;
+          }
+        }
+        if (target > now_tick_) {
+          now_tick_ = target;
+        }
+      }
+
+      // すべて破棄する
+      void clear() {
+        for (uint32_t i = 0; i < nodes_.size(); i++) {
+          if (nodes_[i].list != npos) {
+            unlink(i);
+            release(i);
+          }
+        }
+      }
+    };
+
+#if __cplusplus < 201703L
+    template<class T>
+    constexpr uint32_t timer_wheel_internal___<T>::npos;
+#endif
+
+    // FIFOの管理を行うクラス
+    class workque_fifo_internal___ {
+     protected:
+      prio_fifo_internal___<entry> fifo_;
+      // earliest_deadline 時は fifo_ の代わりに使用する
+      deadline_heap_internal___<entry> edf_;
+      bool use_edf_ = false;
+      timer_wheel_internal___<entry> timer_wheel_;
+
+      // FIFO, タイマーに積まれている数 (ロックなしで参照するためatomicで持つ)
+      std::atomic<size_t> count_{0};
+      std::unique_ptr<std::atomic<size_t>[]> level_count_;
+      std::atomic<size_t> timer_count_{0};
+      // 直近のタイムアウト時刻 (steady_clockのカウント値)
+      std::atomic<std::chrono::steady_clock::rep> next_timeo_{0};
+      // 登録時に指定しない場合のタイマーのslack
+      std::chrono::nanoseconds timer_slack_{0};
+
+      // タイマー数, 直近のタイムアウト時刻を更新する
+      void update_next_timeo() {
+        timer_count_.store(timer_wheel_.size(), std::memory_order_relaxed);
+        if (timer_wheel_.size()) {
+          next_timeo_.store(timer_wheel_.next_time().time_since_epoch().count(),
+                            std::memory_order_relaxed);
+        }
+      }
+
+      // タイムアウトしたものを積む
+      virtual void push_expired(entry &&e) {
+        push(std::move(e));
+      }
+
+     public:
+      // nice値の段数を指定して生成する
+      workque_fifo_internal___(nice_t levels = 64)
+       : fifo_(levels), level_count_(new std::atomic<size_t>[fifo_.levels()])
+      {
+        for (nice_t i = 0; i < fifo_.levels(); i++) {
+          level_count_[i].store(0, std::memory_order_relaxed);
+        }
+      }
+
+      virtual ~workque_fifo_internal___() = default;
+
+      // eventを登録する. 段数を超えるnice値は最も優先度の低い段へ積む.
+      void push(entry &&e) {
+        const nice_t nice = e.nice;
+        if (use_edf_) {
+          edf_.push(std::move(e));
+        } else {
+          fifo_.push(nice, std::move(e));
+        }
+        count_.fetch_add(1, std::memory_order_relaxed);
+        level_count_[fifo_.level(nice)].fetch_add(1, std::memory_order_relaxed);
+      }
+
+      using timer_handle = timer_wheel_internal___<entry>::handle;
+
+      // slack にキューの設定を使用する
+      static constexpr std::chrono::nanoseconds queue_slack() {
+        return std::chrono::nanoseconds(-1);
+      }
+
+      // 時間指定でeventを登録する. 期限から slack の間にタイムアウトする.
+      timer_handle push_for(std::chrono::nanoseconds ns, entry &&e,
+                            std::chrono::nanoseconds slack = queue_slack()) {
+        return push_at(std::chrono::steady_clock::now() +
+                         std::chrono::duration_cast<std::chrono::steady_clock::duration>(ns),
+                       std::move(e), slack);
+      }
+
+      // 時刻指定でeventを登録する
+      timer_handle push_at(std::chrono::steady_clock::time_point tp, entry &&e,
+                           std::chrono::nanoseconds slack = queue_slack()) {
+        timer_handle h = timer_wheel_.insert(
+          tp, std::move(e),
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            slack < std::chrono::nanoseconds::zero() ? timer_slack_ : slack));
+        update_next_timeo();
+        return h;
+      }
+
+      // タイマー待ちを取り消す
+      bool cancel_timer(timer_handle h) {
+        if (!timer_wheel_.cancel(h)) {
+          return false;
+        }
+        timer_count_.store(timer_wheel_.size(), std::memory_order_relaxed);
+        update_next_timeo();
+        return true;
+      }
+
+      // FIFOの先頭から抜く
+      bool pop(entry &e) {
+        // 一番優先度の高いものを取り出す
+        if (use_edf_ ? edf_.pop(e) : fifo_.pop(e)) {
+          count_.fetch_sub(1, std::memory_order_relaxed);
+          level_count_[fifo_.level(e.nice)].fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+        return false;
+      }
+
+      // 上限に達した際に捨てるものを取り出す.
+      // level_full の場合は nice の段の最も古いもの, それ以外は最も優先度の低い段の最も古いもの.
+      // earliest_deadline では全体で最も古いもの.
+      bool evict(nice_t nice, bool level_full, entry &e) {
+        bool popped;
+        if (use_edf_) {
+          popped = edf_.pop_oldest(e);
+        } else {
+          nice_t l = fifo_.level(nice);
+          popped = (level_full || fifo_.back_level(l)) && fifo_.pop_level(l, e);
+        }
+        if (popped) {
+          count_.fetch_sub(1, std::memory_order_relaxed);
+          level_count_[fifo_.level(e.nice)].fetch_sub(1, std::memory_order_relaxed);
+        }
+        return popped;
+      }
+
+      // FIFOの先頭にある最も優先度の高いnice値を取得
+      bool front_nice(nice_t &nice) {
+        if (use_edf_) {
+          const entry *e = edf_.front();
+          if (e) {
+            nice = fifo_.level(e->nice);
+          }
+          return e != nullptr;
+        }
+        return fifo_.front_level(nice);
+      }
+
+      // nice値の段毎の重みを設定する. 空の場合は厳密な優先順.
+      void set_weights(const std::vector<uint32_t> &weights) {
+        fifo_.set_weights(weights);
+      }
+
+      bool weighted() const {
+        return fifo_.weighted();
+      }
+
+      // nice値の段数
+      nice_t levels() const {
+        return fifo_.levels();
+      }
+
+      // FIFOに積まれている数
+      size_t size() const {
+        return count_.load(std::memory_order_relaxed);
+      }
+
+      // nice値の段毎にFIFOに積まれている数 (ロックなしで参照できる)
+      size_t level_size(nice_t l) const {
+        return level_count_[l].load(std::memory_order_relaxed);
+      }
+
+      // タイマー待ちの数 (ロックなしで参照できる)
+      size_t timer_size() const {
+        return timer_count_.load(std::memory_order_relaxed);
+      }
+
+      // タイマー待ちを行う時間を取得. タイマーがなければ time_point() を返す.
+      const std::chrono::steady_clock::time_point get_wait_time() {
+        return timer_wheel_.next_time();
+      }
+
+      // タイマー待ちのものをFIFOへ積み, 積んだ数を返す
+      size_t timeout() {
+        if (timer_wheel_.size() == 0) {
+          return 0;
+        }
+        // 現在時刻までにタイムアウトしたものをまとめてfifoへ入れる
+        size_t n = 0;
+        timer_wheel_.advance(std::chrono::steady_clock::now(),
+          [this, &n](entry &&e) {
+            push_expired(std::move(e));
+            n ++;
+          }
+        );
+        update_next_timeo();
+        return n;
+      }
+
+      // タイマーのtick幅, 段数を設定する. タイマー登録済みの場合は失敗する.
+      bool set_timer_wheel(std::chrono::nanoseconds tick, uint32_t levels) {
+        return timer_wheel_.reset(tick, levels);
+      }
+
+      // 登録時に指定しない場合のタイマーのslackを設定する
+      void set_timer_slack(std::chrono::nanoseconds slack) {
+        timer_slack_ = slack > std::chrono::nanoseconds::zero() ? slack : std::chrono::nanoseconds::zero();
+      }
+
+      // slack によって省略できた起床の回数
+      uint64_t timer_wakeups_saved() const {
+        return timer_wheel_.wakeups_saved();
+      }
+
+      // タイムアウトしたタイマーがあるか (ロックなしで参照できる)
+      bool timer_expired() const {
+        return timer_count_.load(std::memory_order_relaxed) &&
+               next_timeo_.load(std::memory_order_relaxed) <=
+                 std::chrono::steady_clock::now().time_since_epoch().count();
+      }
+
+      // FIFOをすべて破棄する
+      void clear() {
+        fifo_.clear();
+        edf_.clear();
+        timer_wheel_.clear();
+        count_.store(0, std::memory_order_relaxed);
+        timer_count_.store(0, std::memory_order_relaxed);
+        for (nice_t i = 0; i < fifo_.levels(); i++) {
+          level_count_[i].store(0, std::memory_order_relaxed);
+        }
+      }
+    };
+
+    // スピン待ち中にCPUへ譲る
+    inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      asm volatile("yield");
+#else
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+    }
+
+    // キャッシュラインに揃えて確保する.
+    // C++17 より前の new は alignof(std::max_align_t) を超える揃えを保証しないため, 自前で揃える.
+    struct cache_aligned_new___ {
+#if __cplusplus < 201703L
+      static constexpr size_t align = 64;
+
+      static void *operator new(size_t size) {
+        void *raw = ::operator new(size + align + sizeof(void*));
+        const uintptr_t p = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + align - 1) & ~uintptr_t(align - 1);
+        reinterpret_cast<void**>(p)[-1] = raw;
+        return reinterpret_cast<void*>(p);
+      }
+
+      static void operator delete(void *p) {
+        if (p) {
+          ::operator delete(static_cast<void**>(p)[-1]);
+        }
+      }
+#endif
+    };
+
+    // Chase-Lev方式の work-stealing deque
+    //
+    // 追加は所有スレッドのみが bottom 側から行い, 取り出しは任意のスレッドが
+    // top 側から CAS で行う. 所有スレッドも top 側から取り出すため,
+    // 1つのdequeの中では FIFO 順が保たれる.
+    // 要素は atomic に読み書きできる型 (ポインタ等) に限る.
+    template<class T>
+    class chase_lev_deque___ {
+     protected:
+      // リングバッファ. 拡張時は倍の大きさで作り直す.
+      struct array {
+        int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> buf;
+
+        array(int64_t cap) : mask(cap - 1), buf(new std::atomic<T>[cap]) {}
+
+        int64_t capacity() const {
+          return mask + 1;
+        }
+        T get(int64_t i) const {
+          return buf[i & mask].load(std::memory_order_relaxed);
+        }
+        void put(int64_t i, T v) {
+          buf[i & mask].store(v, std::memory_order_relaxed);
+        }
+      };
+
+      alignas(64) std::atomic<int64_t> top_{0};
+      alignas(64) std::atomic<int64_t> bottom_{0};
+      std::atomic<array*> array_{nullptr};
+
+      // 拡張前の配列は他スレッドが参照中の可能性があるため, 破棄まで保持する
+      std::vector<std::unique_ptr<array>> arrays_;
+
+     public:
+      chase_lev_deque___(int64_t cap = 64) {
+        arrays_.emplace_back(new array(cap));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+      }
+
+      chase_lev_deque___(const chase_lev_deque___&) = delete;
+      chase_lev_deque___& operator=(const chase_lev_deque___&) = delete;
+
+      // 末尾へ追加する. 所有スレッドからのみ呼び出せる.
+      void push(T v) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        array *a = array_.load(std::memory_order_relaxed);
+        if (b - t > a->capacity() - 1) {
+          // 満杯なので拡張する
+          array *na = new array(a->capacity() * 2);
+          for (int64_t i = t; i < b; i++) {
+            na->put(i, a->get(i));
+          }
+          arrays_.emplace_back(na);
+          array_.store(na, std::memory_order_release);
+          a = na;
+        }
+        a->put(b, v);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+
+      // 先頭から取り出す. 任意のスレッドから呼び出せる.
+      bool steal(T &v) {
+        for (;;) {
+          int64_t t = top_.load(std::memory_order_acquire);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          int64_t b = bottom_.load(std::memory_order_acquire);
+          if (t >= b) {
+            return false;
+          }
+          array *a = array_.load(std::memory_order_acquire);
+          T x = a->get(t);
+          if (top_.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            v = x;
+            return true;
+          }
+          // 他スレッドと競合したのでやり直す
+        }
+      }
+
+      bool empty() const {
+        return bottom_.load(std::memory_order_acquire) <= top_.load(std::memory_order_acquire);
+      }
+
+      // 積まれている数 (他スレッドが操作中の場合は概数)
+      size_t size() const {
+        const int64_t b = bottom_.load(std::memory_order_acquire);
+        const int64_t t = top_.load(std::memory_order_acquire);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+      }
+    };
+
+    // 固定長の MPMC リングバッファ (Vyukov方式)
+    //
+    // 各セルが持つ通番で, 書き込み済みか読み出し済みかを判定する.
+    // 追加, 取り出しとも位置を CAS で確保するのみで, ロックを取らない.
+    template<class T>
+    class mpmc_ring_internal___ : public cache_aligned_new___ {
+     protected:
+      struct cell {
+        std::atomic<size_t> seq;
+        T value;
+      };
+
+      std::unique_ptr<cell[]> cells_;
+      const size_t mask_;
+      alignas(64) std::atomic<size_t> enqueue_{0};
+      alignas(64) std::atomic<size_t> dequeue_{0};
+
+      static size_t round_up(size_t n) {
+        size_t cap = 2;
+        while (cap < n) {
+          cap <<= 1;
+        }
+        return cap;
+      }
+
+     public:
+      // 容量は2の冪乗に切り上げる
+      mpmc_ring_internal___(size_t capacity)
+       : cells_(new cell[round_up(capacity)]), mask_(round_up(capacity) - 1)
+      {
+        for (size_t i = 0; i <= mask_; i++) {
+          cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+      }
+
+      // 末尾に追加する. 満杯の場合は false を返し, v はそのまま残る.
+      bool try_push(T &v) {
+        size_t pos = enqueue_.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+          c = &cells_[pos & mask_];
+          const size_t seq = c->seq.load(std::memory_order_acquire);
+          const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+          if (dif == 0) {
+            if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+              break;
+            }
+          } else if (dif < 0) {
+            return false;
+          } else {
+            pos = enqueue_.load(std::memory_order_relaxed);
+          }
+        }
+        c->value = std::move(v);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+
+      // 先頭から取り出す. 空の場合は false.
+      bool try_pop(T &v) {
+        size_t pos = dequeue_.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+          c = &cells_[pos & mask_];
+          const size_t seq = c->seq.load(std::memory_order_acquire);
+          const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+          if (dif == 0) {
+            if (dequeue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+              break;
+            }
+          } else if (dif < 0) {
+            return false;
+          } else {
+            pos = dequeue_.load(std::memory_order_relaxed);
+          }
+        }
+        v = std::move(c->value);
+        c->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+      }
+
+      // 積まれている数 (他スレッドが操作中の場合は概数)
+      size_t size() const {
+        const size_t e = enqueue_.load(std::memory_order_acquire);
+        const size_t d = dequeue_.load(std::memory_order_acquire);
+        return e > d ? e - d : 0;
+      }
+
+      bool empty() const {
+        return size() == 0;
+      }
+
+      size_t capacity() const {
+        return mask_ + 1;
+      }
+    };
+
+    // スレッド毎に記録するヒストグラム. 書き込みは所有スレッドのみが行う.
+    class histogram_internal___ {
+     protected:
+      std::atomic<uint64_t> counts_[latency_histogram::buckets] = {};
+      std::atomic<uint64_t> count_{0};
+      std::atomic<uint64_t> sum_{0};
+      std::atomic<uint64_t> max_{0};
+
+      static void add(std::atomic<uint64_t> &a, uint64_t v) {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+      }
+
+     public:
+      void record(uint64_t ns) {
+        add(counts_[latency_histogram::bucket(ns)], 1);
+        add(count_, 1);
+        add(sum_, ns);
+        if (ns > max_.load(std::memory_order_relaxed)) {
+          max_.store(ns, std::memory_order_relaxed);
+        }
+      }
+
+      // 集計先へ足し込む
+      void merge_into(latency_histogram &h) const {
+        for (uint32_t i = 0; i < latency_histogram::buckets; i++) {
+          h.counts[i] += counts_[i].load(std::memory_order_relaxed);
+        }
+        h.count += count_.load(std::memory_order_relaxed);
+        h.sum_ns += sum_.load(std::memory_order_relaxed);
+        h.max_ns = std::max(h.max_ns, max_.load(std::memory_order_relaxed));
+      }
+    };
+
+    // スレッド毎の統計. 書き込みは所有スレッドのみが行い, 読み出しはロックを取らない.
+    struct thread_stats_internal___ {
+      std::atomic<bool> active{false};
+      std::atomic<uint64_t> executed{0};
+      std::atomic<uint64_t> busy_ns{0};
+      std::atomic<uint64_t> idle_ns{0};
+      histogram_internal___ queue_delay;
+      histogram_internal___ exec_time;
+
+      static void add(std::atomic<uint64_t> &a, uint64_t v) {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+      }
+    };
+
+    // ワーカースレッド毎の情報 (work-stealing時に使用)
+    struct worker_internal___ : public cache_aligned_new___ {
+      // nice値毎のローカルキュー数. これ以上のnice値は最後の帯域にまとめる.
+      static constexpr nice_t bands = 8;
+
+      // 所属するworkque
+      workque_internal___ *owner = nullptr;
+      // ワーカー番号
+      uint32_t index = 0;
+      // 所属するグループ (topology の groups の番号)
+      uint32_t group = 0;
+      // run()中のスレッドに割り当てられているか
+      std::atomic<bool> active{false};
+      // nice値の帯域毎のローカルキュー
+      chase_lev_deque___<event*> local[bands];
+      // ローカルキューへ積んだ際に, 待っているワーカーがおらず起こさなかった回数
+      std::atomic<uint64_t> wakeups_skipped{0};
+      // nice値の重み付き時, 巡回中の帯域とその帯域から取り出せる残りの数
+      nice_t cur_band = bands;
+      int64_t credit = 0;
+
+      static nice_t band(nice_t nice) {
+        return nice < bands ? nice : bands - 1;
+      }
+    };
+
+    // 処理のなくなったワーカーの代わりにI/O等の準備を待つもの (reactor)
+    //
+    // 待っているワーカーのうち1つが poll() で待ち, 準備のできた処理を受け取ってキューへ積む.
+    class poller_internal___ {
+     public:
+      virtual ~poller_internal___() = default;
+      // 準備のできた処理を out へ積む. timeout が負の場合は準備ができるか wakeup() されるまで待つ.
+      virtual void poll(std::chrono::nanoseconds timeout, std::vector<entry> &out) = 0;
+      // poll() で待っているスレッドを起こす
+      virtual void wakeup() = 0;
+    };
+
+    // 排他, condition_variableを使用して待ち合わせる
+    class workque_internal___ : protected workque_fifo_internal___{
+     protected:
+      // 登録できるワーカー数の上限 (work-stealing時)
+      static constexpr uint32_t max_workers = 256;
+
+      // 排他, 待ち合わせ用のmutex
+      std::mutex mtx_;
+
+      // 排他, 待ち合わせ用のcondition_variable
+      std::condition_variable cond_;
+
+      // メインループ終了要求
+      std::atomic<bool> is_quit_{false};
+
+      // eventのメモリプール
+      std::shared_ptr<event_pool_internal___> pool_ = std::make_shared<event_pool_internal___>();
+
+      // スケジューリング方式
+      const sched_mode mode_;
+
+      // ワーカー一覧. 登録後は破棄まで解放しない.
+      std::atomic<worker_internal___*> workers_[max_workers] = {};
+      // 登録済みワーカーの最大番号+1
+      std::atomic<uint32_t> nworkers_{0};
+      // ワーカーのグループ数
+      std::atomic<uint32_t> ngroups_{1};
+
+      // 待ちに入っているワーカー数 (mtx_ を保持して更新する)
+      std::atomic<uint32_t> parked_{0};
+      // 起こしたがまだ起きていないワーカー数 (mtx_ で保護)
+      uint32_t wakeup_pending_ = 0;
+      // タイマーの期限まで待つワーカー (リーダー) がいるか, その待ち時刻, 交代毎に進める番号.
+      // リーダー以外のワーカーは時間を指定せずに待つ. mtx_ で保護.
+      bool timer_leader_ = false;
+      std::chrono::steady_clock::time_point leader_deadline_;
+      uint64_t leader_gen_ = 0;
+
+      // I/O等の準備を待つもの. 待っているワーカーのうち1つが cond_ の代わりに poll() で待つ.
+      // poller_, polling_, poll_wakeup_ は mtx_ で保護する.
+      poller_internal___ *poller_ = nullptr;
+      std::atomic<bool> has_poller_{false};
+      // poll() 中のワーカーがいるか, そのワーカーが parked_ に数えられているか, 起床を要求済みか
+      bool polling_ = false;
+      bool polling_parked_ = false;
+      bool poll_wakeup_ = false;
+      // poll() で受け取った処理 (poll() 中のワーカーのみが使用する)
+      std::vector<entry> polled_;
+      // poller の登録解除時, poll() の終了を待ち合わせる
+      std::condition_variable poll_cond_;
+      // 処理中のワーカーが待たずに poll() する間隔 (取り出し回数)
+      static constexpr uint32_t poll_interval = 64;
+      // 待ちに入る前にスピンする時間 (ns)
+      std::atomic<int64_t> spin_ns_{20000};
+      // スピン時のバックオフの上限 (pause回数)
+      static constexpr uint32_t max_backoff = 1024;
+
+      // 待ち合わせの統計
+      std::atomic<uint64_t> stat_parks_{0};
+      std::atomic<uint64_t> stat_wakeups_{0};
+      std::atomic<uint64_t> stat_spin_hits_{0};
+      // mtx_ で保護
+      uint64_t stat_wakeups_skipped_ = 0;
+      // ロックを取らずに積んだ際に起こさなかった数
+      std::atomic<uint64_t> stat_wakeups_skipped_lf_{0};
+      // 期限を過ぎてから取り出した数, そのうち捨てた数
+      std::atomic<uint64_t> stat_deadline_missed_{0};
+      std::atomic<uint64_t> stat_deadline_dropped_{0};
+
+      // 積まれている数の上限 (mtx_ を保持して設定する)
+      capacity_config capacity_;
+      std::atomic<bool> bounded_{false};
+      // 上限を確認して予約した数, 予約したうち積み終えた (または積めなかった) 数. 増やすのみとし, CAS の ABA を避ける.
+      std::atomic<uint64_t> admit_reserved_{0};
+      std::atomic<uint64_t> admit_landed_{0};
+      // 空きを待っている登録スレッド数, 空きを待つためのcondition_variable
+      std::atomic<uint32_t> space_waiters_{0};
+      std::condition_variable space_cond_;
+      // 積まれている数の閾値と通知先. 上側の閾値に達してから下側の閾値を下回るまで above_ は true.
+      size_t high_watermark_ = 0;
+      size_t low_watermark_ = 0;
+      std::function<void(bool)> watermark_;
+      std::atomic<bool> watermarked_{false};
+      std::atomic<bool> above_{false};
+      // 閾値と比べているスレッドがあるか, 比べ直す必要があるか
+      std::atomic<bool> watermark_busy_{false};
+      std::atomic<bool> watermark_dirty_{false};
+      std::atomic<uint64_t> stat_rejected_{0};
+      std::atomic<uint64_t> stat_evicted_{0};
+      std::atomic<uint64_t> stat_caller_ran_{0};
+      std::atomic<uint64_t> stat_blocked_{0};
+
+      // lock_free_ring 時の共有キュー
+      static constexpr size_t default_ring_capacity = 4096;
+      std::unique_ptr<mpmc_ring_internal___<entry>> ring_;
+
+      // スレッド毎の統計. 登録後は破棄まで解放しない.
+      std::atomic<thread_stats_internal___*> stats_[max_workers] = {};
+      std::atomic<uint32_t> nstats_{0};
+      // 時間の統計を取るか
+      std::atomic<bool> stats_enabled_{false};
+
+      // ワーカー数の伸縮 (start(elastic_config) 時のみ有効)
+      std::atomic<bool> elastic_{false};
+      std::atomic<uint32_t> elastic_min_{0};
+      std::atomic<uint32_t> elastic_max_{0};
+      std::atomic<size_t> elastic_backlog_{0};
+      // steady_clock の刻み. 0 の場合は見ない.
+      std::atomic<int64_t> elastic_delay_{0};
+      std::atomic<int64_t> elastic_keepalive_ns_{0};
+      // 伸縮するスレッドの数, 追加中か
+      std::atomic<uint32_t> live_threads_{0};
+      std::atomic<bool> spawning_{false};
+      // スピン中のワーカー数
+      std::atomic<uint32_t> spinning_{0};
+      std::atomic<uint64_t> stat_threads_started_{0};
+      std::atomic<uint64_t> stat_threads_retired_{0};
+
+      // スレッド毎の状態. ヘッダのみで定義するため, 関数内の thread_local に置く.
+      struct thread_state {
+        // 実行中スレッドのワーカー情報
+        worker_internal___ *current = nullptr;
+        // 実行中スレッドがワーカーとして動いているworkque (動作方式, ワーカー数の上限に関わらず設定する)
+        const workque_internal___ *worker_owner = nullptr;
+        // 実行中スレッドの統計と, その所有者
+        thread_stats_internal___ *stats = nullptr;
+        const workque_internal___ *stats_owner = nullptr;
+        // 実行中スレッドが伸縮するスレッドであれば, その所有者. 終了する場合は retire を立てる.
+        const workque_internal___ *elastic_owner = nullptr;
+        bool retire = false;
+        // poll() するまでの取り出し回数
+        uint32_t poll_tick = 0;
+      };
+
+      static thread_state &tls() {
+        static thread_local thread_state st;
+        return st;
+      }
+
+      static int64_t now_count() {
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+      }
+
+      // 統計有効時, 伸縮で待ち時間を見る場合は積んだ時刻を記録する
+      void stamp(entry &e) {
+        if (stats_enabled_.load(std::memory_order_relaxed) ||
+            elastic_delay_.load(std::memory_order_relaxed)) {
+          e.enqueued = now_count();
+        }
+      }
+
+      // 実行中スレッドがこのworkqueのスレッドであれば, その統計
+      thread_stats_internal___ *local_stats() {
+        return tls().stats_owner == this ? tls().stats : nullptr;
+      }
+
+      // 呼び出しスレッドの統計を登録する
+      void attach_stats() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        const uint32_t n = nstats_.load(std::memory_order_relaxed);
+        thread_stats_internal___ *st = nullptr;
+        for (uint32_t i = 0; i < n; i++) {
+          thread_stats_internal___ *p = stats_[i].load(std::memory_order_relaxed);
+          if (!p->active.load()) {
+            st = p;
+            break;
+          }
+        }
+        if (st == nullptr) {
+          if (n >= max_workers) {
+            // 上限を超えた分は統計を取らない
+            return;
+          }
+          st = new thread_stats_internal___;
+          stats_[n].store(st, std::memory_order_release);
+          nstats_.store(n + 1, std::memory_order_release);
+        }
+        st->active.store(true);
+        tls().stats = st;
+        tls().stats_owner = this;
+      }
+
+      void detach_stats() {
+        thread_stats_internal___ *st = local_stats();
+        if (st) {
+          st->active.store(false);
+          tls().stats = nullptr;
+          tls().stats_owner = nullptr;
+        }
+      }
+
+      // スケジュールするものがなければ待つ
+      virtual bool pop_and_wait(entry &e) {
+        worker_internal___ *w = local_worker();
+        // 処理がなくなった時刻 (伸縮時, スレッドを終了するかの判定に使用する)
+        std::chrono::steady_clock::time_point idle_since;
+        // タイマーのリーダー, または poll() で待っていたか
+        bool led = false;
+        // 処理中のワーカーも時々待たずに poll() し, 準備のできたものを取り込む
+        if (has_poller_.load(std::memory_order_relaxed) && ++ tls().poll_tick % poll_interval == 0) {
+          std::unique_lock<std::mutex> lock(mtx_);
+          const size_t k = poll_io(lock, std::chrono::steady_clock::now());
+          lock.unlock();
+          notify(k);
+        }
+        for (;;) {
+          if (try_pop(w, e)) {
+            if (led) {
+              std::unique_lock<std::mutex> lock(mtx_);
+              const size_t k = handoff();
+              lock.unlock();
+              notify(k);
+            }
+            return true;
+          }
+
+          // しばらくスピンし, その間に処理が来れば待ちに入らない
+          if (spin(w)) {
+            continue;
+          }
+
+          std::unique_lock<std::mutex> lock(mtx_);
+          size_t k = expire_timers();
+          if (pop(e) || (ring_ && ring_->try_pop(e))) {
+            if (led) {
+              k += handoff();
+            }
+            lock.unlock();
+            notify(k);
+            return true;
+          }
+          if (k) {
+            lock.unlock();
+            notify(k);
+            continue;
+          }
+          if (is_quit_.load()) {
+            return false;
+          }
+          if (idle_since == std::chrono::steady_clock::time_point()) {
+            idle_since = std::chrono::steady_clock::now();
+          }
+          led = park(w, lock, idle_since);
+          if (tls().retire) {
+            k = led ? handoff() : 0;
+            lock.unlock();
+            notify(k);
+            return false;
+          }
+        }
+      }
+
+      // 実行中スレッドがこのworkqueのwork-stealingワーカーであれば, その情報
+      worker_internal___ *local_worker() {
+        worker_internal___ *w = tls().current;
+        if (mode_ != sched_mode::work_stealing || w == nullptr || w->owner != this) {
+          return nullptr;
+        }
+        return w;
+      }
+
+      // 取り出す (待たない)
+      bool try_pop(worker_internal___ *w, entry &e) {
+        if (w) {
+          return try_pop_stealing(w, e);
+        }
+        if (ring_ && ring_->try_pop(e)) {
+          return true;
+        }
+        if (size() || timer_expired()) {
+          std::unique_lock<std::mutex> lock(mtx_);
+          const size_t k = expire_timers();
+          const bool popped = pop(e) || (ring_ && ring_->try_pop(e));
+          lock.unlock();
+          notify(k);
+          return popped;
+        }
+        return false;
+      }
+
+      // タイムアウトしたものを積み, 呼び出し側が取り出す1つを除いた数まで待っているワーカーを起床予約する.
+      // mtx_ を保持した状態で呼び出し, mtx_ を離した後で返した数だけ notify() する.
+      size_t expire_timers() {
+        const size_t n = timeout();
+        return n > 1 ? reserve_wakeups(n - 1) : 0;
+      }
+
+      // タイマーのリーダー, または poll() で待っていたワーカーが処理を始める (または終了する) 前に呼び出す.
+      // 代わりに待つワーカーがいなければ, 待っているワーカーを1つ起こして交代する.
+      // mtx_ を保持した状態で呼び出し, mtx_ を離した後で返した数だけ notify() する.
+      size_t handoff() {
+        const bool timer = !timer_leader_ && timer_size();
+        const bool poll = poller_ && !polling_;
+        if (!(timer || poll) || idle_waiters() == 0) {
+          return 0;
+        }
+        return reserve_wakeups(1);
+      }
+
+      // cond_ で待っていて, まだ起床を予約していないワーカー数. mtx_ を保持した状態で呼び出す.
+      uint32_t idle_waiters() const {
+        const uint32_t waiting = parked_.load(std::memory_order_relaxed) - (polling_parked_ ? 1 : 0);
+        return waiting > wakeup_pending_ ? waiting - wakeup_pending_ : 0;
+      }
+
+      // poll() 中のワーカーを起こす. mtx_ を保持した状態で呼び出す.
+      bool wakeup_poller() {
+        if (!polling_ || poll_wakeup_) {
+          return false;
+        }
+        poll_wakeup_ = true;
+        poller_->wakeup();
+        return true;
+      }
+
+      // poll() して準備のできたものをキューへ積み, 呼び出し側が取り出す1つを除いた数まで起床予約する.
+      // timeo までに準備ができなければ戻る (time_point() の場合は無期限). 待ちに入ったワーカーが
+      // 呼び出す場合は parked を true とする. 他のワーカーが poll() 中であれば何もしない.
+      // mtx_ を保持した状態で呼び出し, poll() の間は離す.
+      size_t poll_io(std::unique_lock<std::mutex> &lock, std::chrono::steady_clock::time_point timeo,
+                     bool parked = false) {
+        if (!poller_ || polling_) {
+          return 0;
+        }
+        poller_internal___ *p = poller_;
+        polling_ = true;
+        polling_parked_ = parked;
+        poll_wakeup_ = false;
+        lock.unlock();
+        std::chrono::nanoseconds timeout(-1);
+        if (timeo != std::chrono::steady_clock::time_point()) {
+          timeout = std::max(std::chrono::nanoseconds::zero(),
+                             std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               timeo - std::chrono::steady_clock::now()));
+        }
+        p->poll(timeout, polled_);
+        lock.lock();
+        polling_ = false;
+        polling_parked_ = false;
+        poll_wakeup_ = false;
+        if (poller_ != p) {
+          // 登録解除を待っている
+          poll_cond_.notify_all();
+        }
+        const size_t n = polled_.size();
+        for (entry &e : polled_) {
+          stamp(e);
+          workque_fifo_internal___::push(std::move(e));
+        }
+        polled_.clear();
+        size_t k = n > 1 ? reserve_wakeups(n - 1) : 0;
+        if (!parked) {
+          // 処理中のワーカーが poll() している間に待ちに入ったワーカーがいれば, poll() で待ち直させる
+          k += handoff();
+        }
+        return k;
+      }
+
+      // 取り出せるものがあるか (ロックを取らずに確認する)
+      bool has_work(worker_internal___ *w) {
+        return size() || timer_expired() || (w && has_local_work()) || (ring_ && !ring_->empty());
+      }
+
+      // 待ちに入る前に, 指数バックオフしながら処理の到着を待つ.
+      // スピン中に処理が来れば true.
+      bool spin(worker_internal___ *w) {
+        const int64_t ns = spin_ns_.load(std::memory_order_relaxed);
+        if (ns <= 0) {
+          return false;
+        }
+        const std::chrono::steady_clock::time_point deadline =
+          std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+        bool found = false;
+        spinning_.fetch_add(1);
+        for (uint32_t backoff = 1;; backoff = backoff < max_backoff / 2 ? backoff * 2 : max_backoff) {
+          for (uint32_t i = 0; i < backoff; i++) {
+            cpu_relax();
+          }
+          if (has_work(w)) {
+            stat_spin_hits_.fetch_add(1, std::memory_order_relaxed);
+            found = true;
+            break;
+          }
+          if (is_quit_.load(std::memory_order_relaxed) ||
+              std::chrono::steady_clock::now() >= deadline) {
+            break;
+          }
+        }
+        spinning_.fetch_sub(1);
+        return found;
+      }
+
+      // 待ちに入る. mtx_ を保持した状態で呼び出し, タイマーのリーダーとして待っていた場合は true.
+      // 伸縮するスレッドが idle_since から keepalive の間処理がなければ retire を立てて戻る.
+      bool park(worker_internal___ *w, std::unique_lock<std::mutex> &lock,
+                std::chrono::steady_clock::time_point idle_since) {
+        bool led = false;
+        bool polled = false;
+        // 待ちに入る前に登録し, その後でもう一度ローカルキュー, リングを確認する.
+        // ロックを取らずに積む側は積んだ後に parked_ を確認するため, どちらかが必ず気づく.
+        parked_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!((w && has_local_work()) || (ring_ && !ring_->empty()))) {
+          stat_parks_.fetch_add(1, std::memory_order_relaxed);
+          std::chrono::steady_clock::time_point timeo = get_wait_time();
+
+          // タイマーの期限まで待つのはリーダーのみ. リーダーがいない, またはリーダーより
+          // 早い期限がある場合はリーダーになる (元のリーダーは期限に起きた後, 時間を指定せずに待ち直す).
+          uint64_t lead = 0;
+          if (timeo != std::chrono::steady_clock::time_point()) {
+            if (!timer_leader_ || timeo < leader_deadline_) {
+              timer_leader_ = true;
+              leader_deadline_ = timeo;
+              lead = ++ leader_gen_;
+            } else {
+              timeo = std::chrono::steady_clock::time_point();
+            }
+          }
+
+          const bool elastic = tls().elastic_owner == this;
+          const std::chrono::steady_clock::time_point idle_until = idle_since +
+            std::chrono::nanoseconds(elastic_keepalive_ns_.load(std::memory_order_relaxed));
+          if (elastic && (timeo == std::chrono::steady_clock::time_point() || idle_until < timeo)) {
+            timeo = idle_until;
+          }
+          if (poller_ && !polling_) {
+            // cond_ の代わりに poll() で待つ. poll() 中の起床は wakeup_pending_ に数えない.
+            notify(poll_io(lock, timeo, true));
+            polled = led = true;
+          } else if (timeo == std::chrono::steady_clock::time_point()) {
+            cond_.wait(lock);
+          } else {
+            cond_.wait_until(lock, timeo);
+          }
+          if (lead && lead == leader_gen_) {
+            timer_leader_ = false;
+            led = true;
+          }
+          if (elastic && std::chrono::steady_clock::now() >= idle_until &&
+              !is_quit_.load() && !has_work(w) && try_retire()) {
+            tls().retire = true;
+          }
+        }
+        parked_.fetch_sub(1);
+        if (!polled && wakeup_pending_) {
+          wakeup_pending_ --;
+        }
+        return led;
+      }
+
+      // 下限を超えていればスレッド数を1つ減らす.
+      // タイマー待ちが残っている間, poller がある間は最後の1つを残す.
+      bool try_retire() {
+        uint32_t n = live_threads_.load();
+        for (;;) {
+          if (n <= elastic_min_.load(std::memory_order_relaxed) ||
+              (n == 1 && (timer_size() || has_poller_.load(std::memory_order_relaxed)))) {
+            return false;
+          }
+          if (live_threads_.compare_exchange_weak(n, n - 1)) {
+            stat_threads_retired_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+        }
+      }
+
+      // 空いているワーカーがおらず, 積まれている数が閾値以上であればスレッドを追加する.
+      // スレッドが1つもない場合は数によらず追加する.
+      void check_backlog(worker_internal___ *w) {
+        if (!elastic_.load(std::memory_order_relaxed) ||
+            parked_.load() + spinning_.load() != 0) {
+          return;
+        }
+        size_t n = size();
+        if (ring_) {
+          n += ring_->size();
+        }
+        if (w) {
+          for (auto &local : w->local) {
+            n += local.size();
+          }
+        }
+        if (n >= elastic_backlog_.load(std::memory_order_relaxed) || live_threads_.load() == 0) {
+          grow();
+        }
+      }
+
+      // 登録から実行開始までの時間が閾値を超えていれば, 空いているワーカーがいない場合にスレッドを追加する
+      void check_delay(const entry &e, int64_t now) {
+        const int64_t limit = elastic_delay_.load(std::memory_order_relaxed);
+        if (limit == 0 || e.enqueued == 0 || !elastic_.load(std::memory_order_relaxed)) {
+          return;
+        }
+        if ((now ? now : now_count()) - e.enqueued > limit && parked_.load() + spinning_.load() == 0) {
+          grow();
+        }
+      }
+
+      // 上限に達していなければスレッドを1つ追加する. 同時に追加するのは1つまで.
+      void grow() {
+        if (is_quit_.load() || live_threads_.load() >= elastic_max_.load(std::memory_order_relaxed) ||
+            spawning_.exchange(true)) {
+          return;
+        }
+        // 追加したスレッドが動き出した時に spawning_ を戻す
+        uint32_t n = live_threads_.load();
+        for (;;) {
+          if (n >= elastic_max_.load(std::memory_order_relaxed)) {
+            spawning_.store(false);
+            return;
+          }
+          if (live_threads_.compare_exchange_weak(n, n + 1)) {
+            break;
+          }
+        }
+        if (spawn_worker()) {
+          stat_threads_started_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          live_threads_.fetch_sub(1);
+          spawning_.store(false);
+        }
+      }
+
+      // 伸縮するスレッドを生成する
+      virtual bool spawn_worker() {
+        return false;
+      }
+
+      // 伸縮の設定を反映する
+      void set_elastic(const elastic_config &cfg) {
+        const uint32_t max = cfg.max_threads ? cfg.max_threads :
+          std::max(1u, std::thread::hardware_concurrency());
+        elastic_max_.store(std::max(max, cfg.min_threads), std::memory_order_relaxed);
+        elastic_min_.store(cfg.min_threads, std::memory_order_relaxed);
+        elastic_backlog_.store(cfg.backlog, std::memory_order_relaxed);
+        elastic_delay_.store(
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(cfg.max_delay).count(),
+          std::memory_order_relaxed);
+        elastic_keepalive_ns_.store(cfg.keepalive.count(), std::memory_order_relaxed);
+        elastic_.store(true);
+      }
+
+      // 待っているワーカーがいれば起床を予約する. mtx_ を保持した状態で呼び出し,
+      // true が返れば mtx_ を離した後で cond_.notify_one() を呼び出す.
+      // poll() 中のワーカーしかいない場合はその場で起こし, false を返す.
+      bool reserve_wakeup() {
+        if (idle_waiters()) {
+          wakeup_pending_ ++;
+          stat_wakeups_.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+        if (wakeup_poller()) {
+          stat_wakeups_.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        stat_wakeups_skipped_ ++;
+        return false;
+      }
+
+      // 待っているワーカーを最大 n 個起床予約し, 予約した数を返す. mtx_ を保持した状態で呼び出し,
+      // mtx_ を離した後で予約した数だけ cond_.notify_one() を呼び出す.
+      // 足りない分は poll() 中のワーカーをその場で起こす.
+      size_t reserve_wakeups(size_t n) {
+        const size_t k = std::min<size_t>(n, idle_waiters());
+        wakeup_pending_ += static_cast<uint32_t>(k);
+        const size_t polled = (k < n && wakeup_poller()) ? 1 : 0;
+        stat_wakeups_.fetch_add(k + polled, std::memory_order_relaxed);
+        stat_wakeups_skipped_ += n - k - polled;
+        return k;
+      }
+
+      // work-stealing時の取り出し (待たない)
+      bool try_pop_stealing(worker_internal___ *w, entry &e) {
+        event *p = nullptr;
+
+        // ローカルキューで最も優先度の高い帯域
+        nice_t lb = worker_internal___::bands;
+        uint32_t mask = 0;
+        for (nice_t i = worker_internal___::bands; i-- > 0;) {
+          if (!w->local[i].empty()) {
+            lb = i;
+            mask |= 1u << i;
+          }
+        }
+        const bool fair = weighted();
+        if (fair && mask) {
+          lb = pick_band(w, mask);
+        }
+
+        // グローバルのFIFO(およびタイマー)に, より優先度の高いものがあればそちらを優先.
+        // 重み付きの場合は, グローバルの先頭の帯域も含めて巡回する.
+        if (size() || timer_expired()) {
+          std::unique_lock<std::mutex> lock(mtx_);
+          const size_t k = expire_timers();
+          nice_t nice;
+          bool popped = false;
+          if (front_nice(nice)) {
+            const nice_t gb = worker_internal___::band(nice);
+            if (fair) {
+              lb = pick_band(w, mask | 1u << gb);
+              popped = lb == gb && pop(e);
+            } else {
+              popped = gb <= lb && pop(e);
+            }
+          }
+          lock.unlock();
+          notify(k);
+          if (popped) {
+            if (fair) {
+              use_band(w, lb);
+            }
+            return true;
+          }
+        }
+
+        if (lb < worker_internal___::bands && w->local[lb].steal(p)) {
+          if (fair) {
+            use_band(w, lb);
+          }
+          e = take_local(p);
+          return true;
+        }
+
+        // 他のワーカーから盗む. 優先度の高い帯域から, 自身の次の番号より順に探す.
+        // グループが複数ある場合は, 同じグループから盗めなかった場合のみ他のグループを探す.
+        const uint32_t n = nworkers_.load(std::memory_order_acquire);
+        const int passes = ngroups_.load(std::memory_order_relaxed) > 1 ? 2 : 1;
+        for (int pass = 0; pass < passes; pass++) {
+          for (nice_t band = 0; band < worker_internal___::bands; band++) {
+            for (uint32_t i = 1; i <= n; i++) {
+              worker_internal___ *victim = workers_[(w->index + i) % n].load(std::memory_order_acquire);
+              if (victim == nullptr || (passes > 1 && (victim->group == w->group) != (pass == 0))) {
+                continue;
+              }
+              if (victim->local[band].steal(p)) {
+                e = take_local(p);
+                return true;
+              }
+            }
+          }
+        }
+        return false;
+      }
+
+      // nice値の重み付き時に, 次に取り出す帯域を選ぶ. mask は空でない帯域.
+      // 巡回中の帯域を重みの数だけ取り出した後, 次に優先度の低い空でない帯域へ移る.
+      static nice_t pick_band(const worker_internal___ *w, uint32_t mask) {
+        if (w->cur_band < worker_internal___::bands && (mask & (1u << w->cur_band)) && w->credit > 0) {
+          return w->cur_band;
+        }
+        const uint32_t next = w->cur_band + 1 < worker_internal___::bands ? mask & (~0u << (w->cur_band + 1)) : 0;
+        return __builtin_ctz(next ? next : mask);
+      }
+
+      // 帯域 band から1つ取り出したことを記録する
+      void use_band(worker_internal___ *w, nice_t band) {
+        if (band != w->cur_band || w->credit <= 0) {
+          w->cur_band = band;
+          w->credit = fifo_.weight(band);
+        }
+        w->credit --;
+      }
+
+      // ローカルキューから取り出したeventの参照を引き取る
+      static entry take_local(event *p) {
+        std::shared_ptr<event> ev = std::move(p->queued_ref_);
+        const uint64_t gen = p->local_gen_;
+        const int64_t enqueued = p->local_enqueued_;
+        p->in_local_.store(false, std::memory_order_release);
+        entry e(std::move(ev), gen);
+        e.enqueued = enqueued;
+        return e;
+      }
+
+      // いずれかのワーカーのローカルキューに積まれているか
+      bool has_local_work() {
+        const uint32_t n = nworkers_.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++) {
+          worker_internal___ *w = workers_[i].load(std::memory_order_acquire);
+          if (w == nullptr) {
+            continue;
+          }
+          for (auto &local : w->local) {
+            if (!local.empty()) {
+              return true;
+            }
+          }
+        }
+        return false;
+      }
+
+      // ローカルキューへ積んだ後, 待っているワーカーがいれば1つ起こす
+      // n 個積んだ場合は最大 n 個起こす. リングへ積んだ場合は w を nullptr とする.
+      void wakeup_parked(worker_internal___ *w, size_t n = 1) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked_.load() == 0) {
+          (w ? w->wakeups_skipped : stat_wakeups_skipped_lf_).fetch_add(n, std::memory_order_relaxed);
+          return;
+        }
+        size_t k;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          k = reserve_wakeups(n);
+        }
+        notify(k);
+      }
+
+      // 待っているワーカーを n 個起こす
+      void notify(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+          cond_.notify_one();
+        }
+      }
+
+      // 呼び出しスレッドをワーカーとして登録する
+      void attach_worker(uint32_t group = 0) {
+        tls().worker_owner = this;
+        if (mode_ != sched_mode::work_stealing) {
+          return;
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (group >= ngroups_.load(std::memory_order_relaxed)) {
+          ngroups_.store(group + 1, std::memory_order_relaxed);
+        }
+        // 同じグループの空いているワーカーを再利用する
+        const uint32_t n = nworkers_.load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < n; i++) {
+          worker_internal___ *w = workers_[i].load(std::memory_order_relaxed);
+          if (!w->active.load() && w->group == group) {
+            w->active.store(true);
+            tls().current = w;
+            return;
+          }
+        }
+        if (n >= max_workers) {
+          // 上限を超えた分はグローバルのFIFOのみを使用する
+          return;
+        }
+        worker_internal___ *w = new worker_internal___;
+        w->owner = this;
+        w->index = n;
+        w->group = group;
+        w->active.store(true);
+        workers_[n].store(w, std::memory_order_release);
+        nworkers_.store(n + 1, std::memory_order_release);
+        tls().current = w;
+      }
+
+      // ワーカー登録を解除する. ローカルキューに残ったものはグローバルのFIFOへ移す.
+      void detach_worker() {
+        if (tls().worker_owner == this) {
+          tls().worker_owner = nullptr;
+        }
+        worker_internal___ *w = tls().current;
+        if (w == nullptr || w->owner != this) {
+          return;
+        }
+        tls().current = nullptr;
+        std::unique_lock<std::mutex> lock(mtx_);
+        event *p = nullptr;
+        for (auto &local : w->local) {
+          while (local.steal(p)) {
+            workque_fifo_internal___::push(take_local(p));
+          }
+        }
+        w->active.store(false);
+        cond_.notify_all();
+      }
+
+     public:
+      workque_internal___(sched_mode mode = sched_mode::global_fifo, nice_t levels = 64)
+       : workque_fifo_internal___(levels), mode_(mode)
+      {
+        if (mode_ == sched_mode::lock_free_ring) {
+          ring_.reset(new mpmc_ring_internal___<entry>(default_ring_capacity));
+        }
+        use_edf_ = mode_ == sched_mode::earliest_deadline;
+      }
+
+      virtual ~workque_internal___() {
+        for (auto &w : workers_) {
+          worker_internal___ *p = w.load();
+          if (p) {
+            event *ev = nullptr;
+            for (auto &local : p->local) {
+              while (local.steal(ev)) {
+                take_local(ev);
+              }
+            }
+            delete p;
+          }
+        }
+        for (auto &st : stats_) {
+          delete st.load();
+        }
+      }
+
+      // 先頭を抜いて実行する
+      virtual void exec(void) {
+        entry e;
+        thread_stats_internal___ *st = local_stats();
+        if (!st) {
+          if (pop_and_wait(e)) {
+            release_space();
+            check_delay(e, 0);
+            if (!drop_late(e)) {
+              e();
+            }
+          }
+          return;
+        }
+
+        // 統計を取る. 時間は with_stats() 有効時のみ計測する.
+        const bool timed = stats_enabled_.load(std::memory_order_relaxed);
+        const int64_t t0 = timed ? now_count() : 0;
+        if (!pop_and_wait(e)) {
+          return;
+        }
+        release_space();
+        const int64_t t1 = timed ? now_count() : 0;
+        check_delay(e, t1);
+        if (drop_late(e) || !e()) {
+          return;
+        }
+        thread_stats_internal___::add(st->executed, 1);
+        if (timed) {
+          const int64_t t2 = now_count();
+          const auto to_ns = [](int64_t d) -> uint64_t {
+            return d > 0 ? std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::duration(d)).count() : 0;
+          };
+          thread_stats_internal___::add(st->idle_ns, to_ns(t1 - t0));
+          thread_stats_internal___::add(st->busy_ns, to_ns(t2 - t1));
+          if (e.enqueued) {
+            st->queue_delay.record(to_ns(t1 - e.enqueued));
+          }
+          st->exec_time.record(to_ns(t2 - t1));
+        }
+      }
+
+     protected:
+      // 期限を過ぎて取り出したものを数え, 捨てるものであれば捨てて true を返す
+      bool drop_late(entry &e) {
+        if (e.deadline == 0 || now_count() <= e.deadline) {
+          return false;
+        }
+        stat_deadline_missed_.fetch_add(1, std::memory_order_relaxed);
+        if (!e.drop_late) {
+          return false;
+        }
+        if (discard(e)) {
+          stat_deadline_dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+      }
+
+      // 実行せずに捨てる. eventは取消済み, 登録し直されていなければ待ち状態を解く.
+      // 取消済みのものは false.
+      static bool discard(entry &e) {
+        if (e.ev) {
+          if (!e.ev->claim(e.gen)) {
+            return false;
+          }
+          e.ev->finish(e.gen);
+        }
+        return true;
+      }
+
+      // 実行を待っている数 (グローバルのFIFO, リング)
+      size_t queued() const {
+        return size() + (ring_ ? ring_->size() : 0);
+      }
+
+      // nice の段が段毎の上限に達しているか. FIFOの段へは mtx_ を保持して積むため, mtx_ を保持していれば確かな値.
+      bool level_full(nice_t nice) const {
+        return capacity_.per_level && level_size(fifo_.level(nice)) >= capacity_.per_level;
+      }
+
+      // 全体の上限までに空きがあれば1つ予約する. 予約したものは積んだ後 (積めなかった場合も) land() する.
+      // 空きの確認と予約を1つの CAS で行うため, 同時に登録しても上限を超えない.
+      bool reserve_total() {
+        uint64_t reserved = admit_reserved_.load(std::memory_order_acquire);
+        for (;;) {
+          // 積み終えたものは queued() に数えられているため, 積んでいる途中のものだけを足す
+          const uint64_t landed = admit_landed_.load(std::memory_order_acquire);
+          const uint64_t pending = reserved > landed ? reserved - landed : 0;
+          if (capacity_.total && queued() + pending >= capacity_.total) {
+            return false;
+          }
+          if (admit_reserved_.compare_exchange_weak(reserved, reserved + 1, std::memory_order_acq_rel,
+                                                    std::memory_order_acquire)) {
+            return true;
+          }
+        }
+      }
+
+      // 予約したものを積み終えた
+      void land() {
+        admit_landed_.fetch_add(1, std::memory_order_acq_rel);
+      }
+
+      // nice の処理を積めるものとして予約する. 段毎の上限によるものかを full に返す. mtx_ を保持した状態で呼び出す.
+      bool reserve(nice_t nice, bool &full) {
+        full = level_full(nice);
+        return !full && reserve_total();
+      }
+
+      // 上限により登録せずに捨てる
+      void reject_entry(entry &e) {
+        stat_rejected_.fetch_add(1, std::memory_order_relaxed);
+        discard(e);
+      }
+
+      // 上限を適用してキューへ積む. 上限に達していれば policy に従い, 積まなかった場合は false.
+      bool enqueue_bounded(entry &e, overflow_policy policy, std::chrono::nanoseconds timeout) {
+        // リングへは全体の上限に対して予約してから積む (段毎の上限はFIFOの段で数える)
+        if (ring_ && !level_full(e.nice) && reserve_total()) {
+          const bool pushed = try_push_entry(e);
+          land();
+          if (pushed) {
+            check_watermark();
+            return true;
+          }
+        }
+        entry old;
+        bool evicted = false;
+        bool wake;
+        {
+          // 上限の確認と積むことを mtx_ を保持したまま行う
+          std::unique_lock<std::mutex> lock(mtx_);
+          bool full;
+          if (!reserve(e.nice, full)) {
+            if (policy == overflow_policy::block && timeout <= std::chrono::nanoseconds::zero() &&
+                tls().worker_owner == this) {
+              // ワーカー自身が空きを待つと, 実行するワーカーがいなくなることがある
+              policy = overflow_policy::caller_runs;
+            }
+            switch (policy) {
+            case overflow_policy::drop_oldest:
+              // 捨てて空いた分を他の登録に取られないよう, 捨てる前に予約する
+              admit_reserved_.fetch_add(1, std::memory_order_acq_rel);
+              evicted = evict(e.nice, full, old);
+              if (!evicted && !full && ring_) {
+                evicted = ring_->try_pop(old);
+              }
+              if (!evicted) {
+                // 捨てられるものがなければ (ローカルキューのみに積まれている等) 登録しない
+                land();
+                lock.unlock();
+                reject_entry(e);
+                return false;
+              }
+              break;
+            case overflow_policy::caller_runs:
+              lock.unlock();
+              stat_caller_ran_.fetch_add(1, std::memory_order_relaxed);
+              e();
+              return false;
+            case overflow_policy::block:
+              if (!wait_space(lock, e.nice, timeout)) {
+                lock.unlock();
+                reject_entry(e);
+                return false;
+              }
+              break;
+            case overflow_policy::reject:
+              lock.unlock();
+              reject_entry(e);
+              return false;
+            }
+          }
+          workque_fifo_internal___::push(std::move(e));
+          land();
+          wake = reserve_wakeup();
+        }
+
+        // 待っている物を1つスケジュール
+        if (wake) {
+          cond_.notify_one();
+        }
+        check_backlog(nullptr);
+        if (evicted) {
+          discard(old);
+          stat_evicted_.fetch_add(1, std::memory_order_relaxed);
+        }
+        check_watermark();
+        return true;
+      }
+
+      // 空きができるまで待ち, 予約する. lock は mtx_ を保持したものとし, 保持したまま返す.
+      // timeout を過ぎた場合, 終了要求があった場合は予約せずに false.
+      bool wait_space(std::unique_lock<std::mutex> &lock, nice_t nice, std::chrono::nanoseconds timeout) {
+        using clock = std::chrono::steady_clock;
+        stat_blocked_.fetch_add(1, std::memory_order_relaxed);
+        const clock::time_point until = timeout > std::chrono::nanoseconds::zero()
+          ? clock::now() + std::chrono::duration_cast<clock::duration>(timeout)
+          : clock::time_point::max();
+        bool ok = true;
+        bool full;
+        space_waiters_.fetch_add(1);
+        while (!reserve(nice, full)) {
+          const clock::time_point now = clock::now();
+          if (is_quit_.load() || now >= until) {
+            ok = false;
+            break;
+          }
+          // リングからの取り出しはロックを取らないため, 通知を取りこぼしても確かめ直す
+          space_cond_.wait_until(lock, std::min(until, now + std::chrono::milliseconds(1)));
+        }
+        space_waiters_.fetch_sub(1);
+        return ok;
+      }
+
+      // 取り出した後, 空きを待っている登録スレッドを起こし, 下側の閾値を下回れば通知する
+      void release_space() {
+        if (space_waiters_.load()) {
+          std::unique_lock<std::mutex> lock(mtx_);
+          space_cond_.notify_all();
+        }
+        if (watermarked_.load(std::memory_order_relaxed) && queued() <= low_watermark_) {
+          update_watermark();
+        }
+      }
+
+      // 積んだ後, 上側の閾値に達していれば通知する
+      void check_watermark() {
+        if (watermarked_.load(std::memory_order_relaxed) && queued() >= high_watermark_) {
+          update_watermark();
+        }
+      }
+
+      // 積まれている数を閾値と比べ直し, 状態が変われば通知する.
+      // 比べて通知するのは1スレッドずつとし, 通知が上下交互に並ぶようにする. 他のスレッドが比べている間は
+      // watermark_dirty_ を立てて任せ, 比べているスレッドが立っていれば比べ直す (通知から登録した場合も同様).
+      void update_watermark() {
+        watermark_dirty_.store(true);
+        while (watermark_dirty_.load() && !watermark_busy_.exchange(true)) {
+          while (watermark_dirty_.exchange(false)) {
+            const size_t n = queued();
+            const bool above = above_.load(std::memory_order_relaxed);
+            if (above ? n <= low_watermark_ : n >= high_watermark_) {
+              above_.store(!above, std::memory_order_relaxed);
+              watermark_(!above);
+            }
+          }
+          watermark_busy_.store(false);
+        }
+      }
+
+      // タイムアウトしたものはリングがあればリングへ積む
+      void push_expired(entry &&e) override {
+        stamp(e);
+        if (!(ring_ && ring_->try_push(e))) {
+          workque_fifo_internal___::push(std::move(e));
+        }
+      }
+
+      // リングへ積む. 満杯の場合は false.
+      bool try_push_entry(entry &e) {
+        stamp(e);
+        if (!ring_->try_push(e)) {
+          return false;
+        }
+        wakeup_parked(nullptr);
+        check_backlog(nullptr);
+        return true;
+      }
+
+      // キューへ積む
+      void push_entry(entry &&e) {
+        push_entry(std::move(e), capacity_.policy, capacity_.block_timeout);
+      }
+
+      // キューへ積む. 上限に達している場合は policy に従い, 積まなかった場合は false.
+      bool push_entry(entry &&e, overflow_policy policy, std::chrono::nanoseconds timeout) {
+        return enqueue(e, bounded_.load(std::memory_order_relaxed), policy, timeout);
+      }
+
+      // 上限を適用せずにキューへ積む
+      void push_entry_unbounded(entry &&e) {
+        enqueue(e, false, overflow_policy::block, {});
+      }
+
+      // キューへ積む. bounded であれば上限を適用する.
+      bool enqueue(entry &e, bool bounded, overflow_policy policy, std::chrono::nanoseconds timeout) {
+        stamp(e);
+        worker_internal___ *w = local_worker();
+        // 期限付きのものはローカルキューでは期限を保持できないため, グローバルへ積む.
+        // ローカルキューは上限の対象に数えないため, 上限を適用する場合もグローバルへ積む.
+        if (w && !bounded && e.deadline == 0 && push_local(w, e)) {
+          wakeup_parked(w);
+          check_backlog(w);
+          return true;
+        }
+        if (bounded) {
+          return enqueue_bounded(e, policy, timeout);
+        }
+        if (!(ring_ && try_push_entry(e))) {
+          bool wake;
+          {
+            std::unique_lock<std::mutex> lock(mtx_);
+            workque_fifo_internal___::push(std::move(e));
+            wake = reserve_wakeup();
+          }
+
+          // 待っている物を1つスケジュール
+          if (wake) {
+            cond_.notify_one();
+          }
+          check_backlog(nullptr);
+        }
+        check_watermark();
+        return true;
+      }
+
+      // リングへ積む. 上限に達している場合, 満杯の場合は false.
+      bool try_push_ring(entry &e) {
+        if (bounded_.load(std::memory_order_relaxed)) {
+          if (level_full(e.nice) || !reserve_total()) {
+            reject_entry(e);
+            return false;
+          }
+          const bool pushed = try_push_entry(e);
+          land();
+          if (!pushed) {
+            return false;
+          }
+        } else if (!try_push_entry(e)) {
+          return false;
+        }
+        check_watermark();
+        return true;
+      }
+
+      // 積まれている数の上限を設定する. mtx_ を保持した状態で呼び出す.
+      void set_capacity(const capacity_config &config) {
+        capacity_ = config;
+        bounded_.store(config.total || config.per_level);
+      }
+
+      // 積まれている数の閾値を設定する. mtx_ を保持した状態で呼び出す.
+      void set_watermarks(size_t high, size_t low, std::function<void(bool)> &&on_change) {
+        high_watermark_ = high;
+        low_watermark_ = std::min(low, high);
+        watermark_ = std::move(on_change);
+        above_.store(false);
+        watermarked_.store(high && watermark_);
+      }
+
+      // ワーカー自身のローカルキューへ積む.
+      // 取消済みのものがローカルキューに残っている場合は積まずに false を返す.
+      bool push_local(worker_internal___ *w, entry &e) {
+        if (e.ev && e.ev->in_local_.load(std::memory_order_acquire)) {
+          return false;
+        }
+        if (!e.ev) {
+          e.ev = make_event(e.nice, std::move(e.func));
+          e.ev->mark_pending(e.gen);
+        }
+        event *p = e.ev.get();
+        p->local_gen_ = e.gen;
+        p->local_enqueued_ = e.enqueued;
+        p->queued_ref_ = std::move(e.ev);
+        p->in_local_.store(true, std::memory_order_relaxed);
+        w->local[worker_internal___::band(e.nice)].push(p);
+        return true;
+      }
+
+      // タイマーへ積む. mtx_ を保持した状態で呼び出す.
+      void push_timer(std::chrono::nanoseconds ns, entry &&e, std::chrono::nanoseconds slack = queue_slack()) {
+        push_timer_at(std::chrono::steady_clock::now() +
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(ns),
+                      std::move(e), slack);
+      }
+
+      void push_timer_at(std::chrono::steady_clock::time_point tp, entry &&e,
+                         std::chrono::nanoseconds slack = queue_slack()) {
+        event *p = e.ev.get();
+        const uint64_t gen = e.gen;
+        const timer_handle h = workque_fifo_internal___::push_at(tp, std::move(e), slack);
+        if (p) {
+          // 取消用にハンドルを覚えておく
+          p->timer_index_ = h.index;
+          p->timer_gen_ = h.gen;
+          p->timer_ev_gen_ = gen;
+        }
+      }
+
+      // 時間指定でキューへ積む
+      void push_entry_for(std::chrono::nanoseconds ns, entry &&e, std::chrono::nanoseconds slack = queue_slack()) {
+        push_entry_at(std::chrono::steady_clock::now() +
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(ns),
+                      std::move(e), slack);
+      }
+
+      // 時刻指定でキューへ積む.
+      // 停止された周期実行のeventは積まずに取り消す (停止とすれ違った再登録を mtx_ で直列化する).
+      void push_entry_at(std::chrono::steady_clock::time_point tp, entry &&e,
+                         std::chrono::nanoseconds slack = queue_slack()) {
+        bool wake = false;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          if (e.ev && e.ev->periodic_.load(std::memory_order_relaxed) == event::periodic_stopped) {
+            e.ev->mark_cancel();
+            return;
+          }
+          const std::chrono::steady_clock::time_point prev = get_wait_time();
+          push_timer_at(tp, std::move(e), slack);
+
+          // 待っているワーカーの待ち時間より早くなった場合のみ起こして待ち直させる
+          if (prev == std::chrono::steady_clock::time_point() || get_wait_time() < prev) {
+            wake = reserve_wakeup();
+          }
+        }
+        if (wake) {
+          cond_.notify_one();
+        }
+        check_backlog(nullptr);
+      }
 
-    event& set_nice(nice_t nice) {
-      nice_ = nice;
-      return *this;
-    }
+      static void set_deadline(entry &e, std::chrono::steady_clock::time_point deadline, deadline_miss miss) {
+        e.deadline = std::max<int64_t>(deadline.time_since_epoch().count(), 1);
+        e.drop_late = miss == deadline_miss::drop;
+      }
 
-    event& set_function(std::function<void(void)> func) {
-      func_ = func;
-      return *this;
-    }
+      // 周期実行のeventを次の期限 tp に登録する.
+      // 実行中に呼ばれた場合, 実行の終了後も待ち状態のまま残る.
+      void push_periodic(const std::shared_ptr<event> &ev, std::chrono::steady_clock::time_point tp,
+                         std::chrono::nanoseconds slack) {
+        uint64_t gen;
+        if (ev->mark_pending(gen)) {
+          push_entry_at(tp, entry(ev, gen), slack);
+        }
+      }
 
-    // nice値を取得
-    nice_t get_nice() {
-      return nice_;
-    }
+      // 一括登録の1要素をentryにする. 実行待ちのeventは空のentryになる.
+      // eventは自身のnice値で積む.
+      static entry make_bulk_entry(nice_t, const std::shared_ptr<event> &ev) {
+        uint64_t gen;
+        if (!ev || !ev->mark_pending(gen)) {
+          return entry();
+        }
+        return entry(ev, gen);
+      }
 
-    // 登録された処理を実行
-    void operator()() {
-      if (func_) {
-        func_();
+      // 要素毎のnice値を指定したeventは, eventのnice値をそれに変更して積む
+      static entry make_bulk_entry(nice_t, const std::pair<nice_t, std::shared_ptr<event>> &item) {
+        uint64_t gen;
+        if (!item.second || !item.second->mark_pending(gen)) {
+          return entry();
+        }
+        item.second->set_nice(item.first);
+        return entry(item.second, gen);
       }
-    }
-  };
 
-  namespace __internal__::workque {
-    using event = sharaku::workque::event;
+      static entry make_bulk_entry(nice_t nice, std::pair<nice_t, std::shared_ptr<event>> &&item) {
+        return make_bulk_entry(nice, static_cast<const std::pair<nice_t, std::shared_ptr<event>>&>(item));
+      }
 
-    // FIFOの管理を行うクラス
-    class workque_fifo_internal___ {
-     protected:
-      std::vector< std::deque<std::shared_ptr<event>> > fifo_;
-      std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<event>> timer_list_;
+      template<class F>
+      static entry make_bulk_entry(nice_t, const std::pair<nice_t, F> &item) {
+        return make_bulk_entry(item.first, item.second);
+      }
 
-     public:
-      // eventを登録する
-      void push(std::shared_ptr<event> ev) {
-        if (fifo_.size() < ev->get_nice() + 1) {
-          fifo_.resize(ev->get_nice() + 1);
-        }
-        fifo_[ev->get_nice()].push_back(ev);
+      template<class F>
+      static entry make_bulk_entry(nice_t, std::pair<nice_t, F> &&item) {
+        return make_bulk_entry(item.first, std::move(item.second));
       }
 
-      // 時間指定でeventを登録する
-      void push_for(std::chrono::nanoseconds ms, std::shared_ptr<event> ev) {
-        std::chrono::steady_clock::time_point tp = std::chrono::steady_clock::now() + ms;
-        timer_list_.insert(std::make_pair(tp, ev));
+      template<class F, typename = typename std::enable_if<
+        is_invocable___<typename std::decay<F>::type&>::value>::type>
+      static entry make_bulk_entry(nice_t nice, F &&func) {
+        return entry(nice, task(std::forward<F>(func)));
       }
 
-      // FIFOの先頭から抜く
-      std::shared_ptr<event> pop() {
-        for (auto &fifo : fifo_) {
-          if (fifo.size()) {
-            // 一番優先度の高いものを取り出す
-            std::shared_ptr<event> ev = fifo.front();
-            fifo.pop_front();
-            return ev;
+      // 一括でキューへ積む. ロックは1度だけ取り, 積んだ数まで待っているワーカーを起こす.
+      template<class It>
+      size_t push_entry_bulk(nice_t nice, It first, It last) {
+        size_t n = 0;
+        if (bounded_.load(std::memory_order_relaxed)) {
+          // 上限がある場合は1つずつ積む
+          for (It it = first; it != last; ++it) {
+            entry e = make_bulk_entry(nice, *it);
+            if (e && push_entry(std::move(e), capacity_.policy, capacity_.block_timeout)) {
+              n ++;
+            }
+          }
+          return n;
+        }
+        worker_internal___ *w = local_worker();
+        if (w) {
+          // ワーカー内からの登録は自身のローカルキューへ積む
+          size_t rest = 0;
+          for (It it = first; it != last; ++it) {
+            entry e = make_bulk_entry(nice, *it);
+            if (!e) {
+              continue;
+            }
+            stamp(e);
+            if (push_local(w, e)) {
+              n ++;
+            } else {
+              std::unique_lock<std::mutex> lock(mtx_);
+              workque_fifo_internal___::push(std::move(e));
+              rest ++;
+            }
+          }
+          if (n + rest) {
+            wakeup_parked(w, n + rest);
+            check_backlog(w);
+          }
+          return n + rest;
+        }
+
+        if (ring_) {
+          // リングへはロックを取らずに積み, 満杯の分のみFIFOへ積む
+          for (It it = first; it != last; ++it) {
+            entry e = make_bulk_entry(nice, *it);
+            if (!e) {
+              continue;
+            }
+            stamp(e);
+            if (!ring_->try_push(e)) {
+              std::unique_lock<std::mutex> lock(mtx_);
+              workque_fifo_internal___::push(std::move(e));
+            }
+            n ++;
+          }
+          if (n) {
+            wakeup_parked(nullptr, n);
+            check_backlog(nullptr);
+            check_watermark();
+          }
+          return n;
+        }
+
+        size_t k;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          for (It it = first; it != last; ++it) {
+            entry e = make_bulk_entry(nice, *it);
+            if (e) {
+              stamp(e);
+              workque_fifo_internal___::push(std::move(e));
+              n ++;
+            }
           }
+          k = reserve_wakeups(n);
+        }
+        notify(k);
+        if (n) {
+          check_backlog(nullptr);
+          check_watermark();
         }
-        return std::shared_ptr<event>(nullptr);
+        return n;
       }
 
-      // イベントをキューから抜く
-      bool erase(std::shared_ptr<event> &ev) {
-        // nice値のfifoに登録する
-        for (auto &fifo : fifo_) {
-          for (auto it = fifo.begin(); it != fifo.end(); it ++) {
-            if (*it == ev) {
-              fifo.erase(it);
-              return true;
+      // 一括で時間指定でキューへ積む
+      template<class It>
+      size_t push_entry_bulk_for(std::chrono::nanoseconds ns, nice_t nice, It first, It last) {
+        size_t n = 0;
+        bool wake = false;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          const std::chrono::steady_clock::time_point prev = get_wait_time();
+          for (It it = first; it != last; ++it) {
+            entry e = make_bulk_entry(nice, *it);
+            if (e) {
+              push_timer(ns, std::move(e));
+              n ++;
             }
           }
+          if (n && (prev == std::chrono::steady_clock::time_point() || get_wait_time() < prev)) {
+            wake = reserve_wakeup();
+          }
         }
-        return false;
+        if (wake) {
+          cond_.notify_one();
+        }
+        if (n) {
+          check_backlog(nullptr);
+        }
+        return n;
       }
 
-      // タイマー待ちを行う時間を取得
-      const std::chrono::steady_clock::time_point get_wait_time() {
-        if (timer_list_.size()) {
-          return (timer_list_.begin()->first);
-        } else {
-          while(1);
-          return std::chrono::steady_clock::time_point();
-        }
-      }
-
-      // タイマー待ちのものをFIFOへ積む
-      void timeout() {
-        std::chrono::steady_clock::time_point tp_now = std::chrono::steady_clock::now();
-        // リストをループし, 現在時刻よりもタイムアウト時間が前のものに対して
-        // リストから抜いてfifoへ入れる
-        for (auto it = timer_list_.begin(); it != timer_list_.end();) {
-          std::chrono::steady_clock::time_point tp = it->first;
-          if (tp <= tp_now) {
-            std::shared_ptr<event> ev = it->second;
-            it = timer_list_.erase(it);
-            push(ev);
+      // 期限を過ぎていれば expired を, そうでなければ func を実行する
+      template<class F, class G>
+      struct deadline_call___ {
+        int64_t due;
+        F func;
+        G expired;
+
+        void operator()() {
+          if (now_count() > due) {
+            expired();
           } else {
-            // 以降は検索対象がない.
-            break;
+            func();
+          }
+        }
+      };
+
+      // push_every() で登録する処理. 実行後, 次の期限で自身のeventを登録し直す.
+      template<class F>
+      struct periodic_call___ {
+        workque_internal___ *wq;
+        F func;
+        std::weak_ptr<event> self;
+        std::chrono::steady_clock::time_point due;
+        std::chrono::steady_clock::duration interval;
+        missed_tick policy;
+        std::chrono::nanoseconds slack;
+
+        void operator()() {
+          func();
+          std::shared_ptr<event> ev = self.lock();
+          if (!ev) {
+            return;
+          }
+          due += interval;
+          const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+          if (due <= now && policy != missed_tick::catch_up) {
+            // 過ぎた期限のうち最後のものへ進める
+            due += interval * ((now - due) / interval);
+            if (policy == missed_tick::skip) {
+              due += interval;
+            }
           }
+          wq->push_periodic(ev, due, slack);
         }
+      };
+
+      // 登録のみを行う関数オブジェクトか (取消用のハンドルを返さない)
+      template<class F>
+      using if_fire_and_forget = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, std::shared_ptr<event>>::value &&
+        !std::is_same<typename std::decay<F>::type, std::function<void(void)>>::value &&
+        is_invocable___<typename std::decay<F>::type&>::value>::type;
+
+     public:
+      // プールからeventを確保する
+      template<class F>
+      std::shared_ptr<event> make_event(nice_t nice, F &&func) {
+        return std::allocate_shared<event>(pool_allocator___<event>(pool_), nice, std::forward<F>(func));
       }
 
-      // FIFOをすべて破棄する
-      void clear() {
-        fifo_.clear();
-        timer_list_.clear();
+      std::shared_ptr<event> make_event(nice_t nice) {
+        return std::allocate_shared<event>(pool_allocator___<event>(pool_), nice);
       }
-    };
 
-    // 排他, condition_variableを使用して待ち合わせる
-    class workque_internal___ : protected workque_fifo_internal___{
-     protected:
+      // eventのメモリプールの統計を取得する
+      pool_stats get_pool_stats() const {
+        return pool_->get_stats();
+      }
 
-      // 排他, 待ち合わせ用のmutex
-      std::mutex mtx_;
+      // eventを登録する. 既に実行を待っているeventは重ねて登録しない.
+      std::shared_ptr<event> push(std::shared_ptr<event> ev) {
+        uint64_t gen;
+        if (ev->mark_pending(gen)) {
+          push_entry(entry(ev, gen));
+        }
+        return ev;
+      }
 
-      // 排他, 待ち合わせ用のcondition_variable
-      std::condition_variable cond_;
+      // 指定時間後に実行する. slack を指定すると, 期限から slack の間で他のタイマーと
+      // まとめて実行する (省略時はキューの設定).
+      std::shared_ptr<event> push_for(std::chrono::nanoseconds ns, std::shared_ptr<event> ev,
+                                      std::chrono::nanoseconds slack = queue_slack()) {
+        uint64_t gen;
+        if (ev->mark_pending(gen)) {
+          push_entry_for(ns, entry(ev, gen), slack);
+        }
+        return ev;
+      }
 
-      // スケジュールするものがなければ待つ
-      virtual std::shared_ptr<event> pop_and_wait(void) {
-        for (;;) {
-          timeout();
+      std::shared_ptr<event> push(nice_t&& nice, std::function<void(void)> &&func) {
+        return workque_internal___::push(make_event(nice, std::move(func)));
+      }
 
-          std::unique_lock<std::mutex> lock(mtx_);
-          std::shared_ptr<event> ev = pop();
-          if (ev == nullptr) {
-            const std::chrono::steady_clock::time_point timeo = get_wait_time();
-            if (timeo == std::chrono::steady_clock::time_point()) {
-              cond_.wait(lock);
-            } else {
-              cond_.wait_until(lock, timeo);
-            }
-          } else {
-            return ev;
-          }
+      std::shared_ptr<event> push_for(std::chrono::nanoseconds &&ns, nice_t&& nice, std::function<void(void)> &&func) {
+        return workque_internal___::push_for(ns, make_event(nice, std::move(func)));
+      }
+
+      std::shared_ptr<event> push(std::function<void(void)> &&func) {
+        return workque_internal___::push(make_event(0, std::move(func)));
+      }
+
+      std::shared_ptr<event> push_for(std::chrono::nanoseconds &&ns, std::function<void(void)> &&func) {
+        return workque_internal___::push_for(ns, make_event(0, std::move(func)));
+      }
+
+      // 取消用のハンドルが不要な登録.
+      // 関数オブジェクトは task に直接保持し, 小さなものではメモリ確保を行わない.
+      template<class F, typename = if_fire_and_forget<F>>
+      void push(nice_t nice, F &&func) {
+        push_entry(entry(nice, task(std::forward<F>(func))));
+      }
+
+      template<class F, typename = if_fire_and_forget<F>>
+      void push(F &&func) {
+        push_entry(entry(0, task(std::forward<F>(func))));
+      }
+
+      // 内部の継続 (strandの実行, 後続ノード, コルーチンの再開等) を積む.
+      // 捨てると待っている側が永久に進まなくなるため, 積まれている数の上限を適用しない.
+      template<class F, typename = if_fire_and_forget<F>>
+      void push_continuation(nice_t nice, F &&func) {
+        push_entry_unbounded(entry(nice, task(std::forward<F>(func))));
+      }
+
+      std::shared_ptr<event> push_continuation(std::shared_ptr<event> ev) {
+        uint64_t gen;
+        if (ev->mark_pending(gen)) {
+          push_entry_unbounded(entry(ev, gen));
         }
-        return std::shared_ptr<event>(nullptr);
+        return ev;
       }
 
-    public:
-      // 先頭を抜いて実行する
-      virtual void exec(void) {
-        std::shared_ptr<event> ev = pop_and_wait();
-        (*ev)();
+      // 期限 deadline までに実行する処理を登録する.
+      // earliest_deadline では期限の早いものから実行し, 他の方式では実行順に影響しない.
+      // 期限を過ぎてから取り出した場合, miss が drop であれば実行せずに捨てる.
+      template<class F, typename = if_fire_and_forget<F>>
+      void push(std::chrono::steady_clock::time_point deadline, nice_t nice, F &&func,
+                deadline_miss miss = deadline_miss::run) {
+        entry e(nice, task(std::forward<F>(func)));
+        set_deadline(e, deadline, miss);
+        push_entry(std::move(e));
       }
 
-      std::shared_ptr<event> push(std::shared_ptr<event> ev) {
-        std::unique_lock<std::mutex> lock(mtx_);
-        workque_fifo_internal___::push(ev);
+      // 期限を過ぎてから取り出した場合は, func の代わりに expired を実行する
+      template<class F, class G, typename = if_fire_and_forget<F>, typename = if_fire_and_forget<G>>
+      void push(std::chrono::steady_clock::time_point deadline, nice_t nice, F &&func, G &&expired) {
+        const int64_t due = deadline.time_since_epoch().count();
+        push(deadline, nice, deadline_call___<typename std::decay<F>::type, typename std::decay<G>::type>{
+          due, std::forward<F>(func), std::forward<G>(expired)});
+      }
 
-        // 待っている物を1つスケジュール
-        cond_.notify_one();
+      std::shared_ptr<event> push(std::chrono::steady_clock::time_point deadline, std::shared_ptr<event> ev,
+                                  deadline_miss miss = deadline_miss::run) {
+        uint64_t gen;
+        if (ev->mark_pending(gen)) {
+          entry e(ev, gen);
+          set_deadline(e, deadline, miss);
+          push_entry(std::move(e));
+        }
         return ev;
       }
 
-      std::shared_ptr<event> push_for(std::chrono::milliseconds ms, std::shared_ptr<event> ev) {
-        std::unique_lock<std::mutex> lock(mtx_);
-        workque_fifo_internal___::push_for(ms, ev);
+      template<class F, typename = if_fire_and_forget<F>>
+      void push_for(std::chrono::nanoseconds ns, nice_t nice, F &&func,
+                    std::chrono::nanoseconds slack = queue_slack()) {
+        push_entry_for(ns, entry(nice, task(std::forward<F>(func))), slack);
+      }
+
+      template<class F, typename = if_fire_and_forget<F>>
+      void push_for(std::chrono::nanoseconds ns, F &&func) {
+        push_entry_for(ns, entry(0, task(std::forward<F>(func))));
+      }
 
-        // 待っている物を1つスケジュール. 空振りしてもよい.
-        cond_.notify_one();
+      // 周期 period で繰り返し実行する. 最初の実行は first 後.
+      // 各回の期限は最初の期限に周期を足した絶対時刻とし, 実行の遅れを次の周期へ持ち越さない.
+      // 処理が遅れて次の期限を過ぎていた場合は policy に従う.
+      // 1つのeventを再登録し続けるため, 周期毎のメモリ確保はない. cancel() で停止する.
+      template<class F>
+      std::shared_ptr<event> push_every(std::chrono::nanoseconds first, std::chrono::nanoseconds period,
+                                        nice_t nice, F &&func,
+                                        missed_tick policy = missed_tick::coalesce,
+                                        std::chrono::nanoseconds slack = queue_slack()) {
+        using clock = std::chrono::steady_clock;
+        const clock::duration interval =
+          std::max(std::chrono::duration_cast<clock::duration>(period), clock::duration(1));
+        const clock::time_point start = clock::now() + std::chrono::duration_cast<clock::duration>(first);
+        std::shared_ptr<event> ev = make_event(nice);
+        ev->set_function(periodic_call___<typename std::decay<F>::type>{
+          this, std::forward<F>(func), std::weak_ptr<event>(ev), start, interval, policy, slack});
+        ev->periodic_.store(event::periodic_active, std::memory_order_relaxed);
+        push_periodic(ev, start, slack);
         return ev;
       }
 
-      std::shared_ptr<event> push(nice_t&& nice, std::function<void(void)> &&func) {
-        std::shared_ptr<event> ev = std::shared_ptr<event>(new event{nice, func});
-        return workque_internal___::push(ev);
+      template<class F>
+      std::shared_ptr<event> push_every(std::chrono::nanoseconds period, nice_t nice, F &&func,
+                                        missed_tick policy = missed_tick::coalesce) {
+        return push_every(period, period, nice, std::forward<F>(func), policy);
       }
 
-      std::shared_ptr<event> push_for(std::chrono::milliseconds &&ms, nice_t&& nice, std::function<void(void)> &&func) {
-        std::shared_ptr<event> ev = std::shared_ptr<event>(new event{nice, func});
-        return workque_internal___::push_for(ms, ev);
+      template<class F>
+      std::shared_ptr<event> push_every(std::chrono::nanoseconds period, F &&func) {
+        return push_every(period, period, 0, std::forward<F>(func));
       }
 
-      std::shared_ptr<event> push(std::function<void(void)> &&func) {
-        std::shared_ptr<event> ev = std::shared_ptr<event>(new event{0, func});
-        return workque_internal___::push(ev);
+      // 満杯, 上限に達している場合は登録せずに false を返す.
+      // 上限を設定していない場合, lock_free_ring 以外では常に登録する.
+      template<class F, typename = if_fire_and_forget<F>>
+      bool try_push(nice_t nice, F &&func) {
+        entry e(nice, task(std::forward<F>(func)));
+        if (!ring_) {
+          return push_entry(std::move(e), overflow_policy::reject, {});
+        }
+        return try_push_ring(e);
       }
 
-      std::shared_ptr<event> push_for(std::chrono::milliseconds &&ms, std::function<void(void)> &&func) {
-        std::shared_ptr<event> ev = std::shared_ptr<event>(new event{0, func});
-        return workque_internal___::push_for(ms, ev);
+      template<class F, typename = if_fire_and_forget<F>>
+      bool try_push(F &&func) {
+        return try_push(0, std::forward<F>(func));
       }
 
-      void cancel(std::shared_ptr<event>& ev) {
+      // eventを登録する. 満杯の場合, 既に実行を待っている場合は false.
+      bool try_push(std::shared_ptr<event> ev) {
+        uint64_t gen;
+        if (!ev->mark_pending(gen)) {
+          return false;
+        }
+        entry e(ev, gen);
+        if (!ring_) {
+          return push_entry(std::move(e), overflow_policy::reject, {});
+        }
+        if (!try_push_ring(e)) {
+          ev->mark_cancel();
+          return false;
+        }
+        return true;
+      }
+
+      // 上限に達している場合は timeout まで空きを待ち, 空かなければ登録せずに false を返す
+      template<class F, typename = if_fire_and_forget<F>>
+      bool try_push_for(std::chrono::nanoseconds timeout, nice_t nice, F &&func) {
+        return push_entry(entry(nice, task(std::forward<F>(func))), overflow_policy::block,
+                          std::max(timeout, std::chrono::nanoseconds(1)));
+      }
+
+      bool try_push_for(std::chrono::nanoseconds timeout, std::shared_ptr<event> ev) {
+        uint64_t gen;
+        if (!ev->mark_pending(gen)) {
+          return false;
+        }
+        return push_entry(entry(ev, gen), overflow_policy::block,
+                          std::max(timeout, std::chrono::nanoseconds(1)));
+      }
+
+      // リングの容量を設定する. lock_free_ring 以外, またはリングに積まれている場合は失敗する.
+      bool set_ring_capacity(size_t capacity) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!ring_ || !ring_->empty()) {
+          return false;
+        }
+        ring_.reset(new mpmc_ring_internal___<entry>(capacity));
+        return true;
+      }
+
+      // 範囲の関数オブジェクト, eventを一括で登録し, 登録した数を返す.
+      // 要素を std::pair<nice_t, F> とすると要素毎のnice値を指定できる (eventの場合はeventのnice値を変更する).
+      // eventの要素は nice ではなくevent自身のnice値で積む.
+      // 要素はコピーされるため, ムーブする場合は std::make_move_iterator を使用する.
+      template<class It>
+      size_t push_bulk(nice_t nice, It first, It last) {
+        return push_entry_bulk(nice, first, last);
+      }
+
+      template<class It>
+      size_t push_bulk(It first, It last) {
+        return push_entry_bulk(0, first, last);
+      }
+
+      template<class R>
+      size_t push_bulk(nice_t nice, R &&range) {
+        return push_entry_bulk(nice, std::begin(range), std::end(range));
+      }
+
+      template<class It>
+      size_t push_bulk_for(std::chrono::nanoseconds ns, nice_t nice, It first, It last) {
+        return push_entry_bulk_for(ns, nice, first, last);
+      }
+
+      template<class R>
+      size_t push_bulk_for(std::chrono::nanoseconds ns, nice_t nice, R &&range) {
+        return push_entry_bulk_for(ns, nice, std::begin(range), std::end(range));
+      }
+
+      // 実行待ちのeventを取り消す.
+      // キューに残ったものは取り出した時に捨てるため, キューの長さによらず一定時間で終わる.
+      // 実行を止められた場合は true, 既に実行中, 実行済みの場合は false.
+      // 周期実行のeventは実行中であっても以降の周期を止め, 初回の停止で true を返す.
+      bool cancel(std::shared_ptr<event>& ev) {
+        if (!ev) {
+          return false;
+        }
+        uint32_t periodic = event::periodic_active;
+        const bool stopped = ev->periodic_.compare_exchange_strong(periodic, event::periodic_stopped);
+        if (!ev->mark_cancel() && !stopped) {
+          return false;
+        }
+        // タイマー待ちの場合はその場で解放する.
+        // ロックを取るまでに登録し直されていれば, そのタイマーは残す.
+        // 停止した周期実行は, ロックを取るまでに再登録されていても取り消す.
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (stopped) {
+          ev->mark_cancel();
+        }
+        if (ev->timer_index_ != timer_handle().index &&
+            (stopped || ev->state_.load(std::memory_order_acquire) != ev->timer_ev_gen_)) {
+          timer_handle h;
+          h.index = ev->timer_index_;
+          h.gen = ev->timer_gen_;
+          ev->timer_index_ = timer_handle().index;
+          cancel_timer(h);
+        }
+        return true;
+      }
+
+      // 実行時間, 待ち時間の統計を取るかを設定する
+      void set_stats(bool enable) {
+        stats_enabled_.store(enable, std::memory_order_relaxed);
+      }
+
+      // 統計を取得する. ロックは取らないため, 各値は同時刻のものとは限らない.
+      sched_stats snapshot() const {
+        sched_stats st;
+        st.depth.resize(levels());
+        for (nice_t i = 0; i < levels(); i++) {
+          st.depth[i] = level_size(i);
+        }
+        st.timers = timer_size();
+        if (ring_) {
+          st.ring_depth = ring_->size();
+        }
+        const uint32_t nw = nworkers_.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < nw; i++) {
+          worker_internal___ *w = workers_[i].load(std::memory_order_acquire);
+          if (w) {
+            for (auto &local : w->local) {
+              st.local_depth += local.size();
+            }
+          }
+        }
+        const uint32_t n = nstats_.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++) {
+          const thread_stats_internal___ *p = stats_[i].load(std::memory_order_acquire);
+          worker_stats ws;
+          ws.active = p->active.load(std::memory_order_relaxed);
+          ws.executed = p->executed.load(std::memory_order_relaxed);
+          ws.busy_ns = p->busy_ns.load(std::memory_order_relaxed);
+          ws.idle_ns = p->idle_ns.load(std::memory_order_relaxed);
+          st.executed += ws.executed;
+          st.workers.push_back(ws);
+          p->queue_delay.merge_into(st.queue_delay);
+          p->exec_time.merge_into(st.exec_time);
+        }
+        st.threads = live_threads_.load(std::memory_order_relaxed);
+        st.threads_started = stat_threads_started_.load(std::memory_order_relaxed);
+        st.threads_retired = stat_threads_retired_.load(std::memory_order_relaxed);
+        st.deadline_missed = stat_deadline_missed_.load(std::memory_order_relaxed);
+        st.deadline_dropped = stat_deadline_dropped_.load(std::memory_order_relaxed);
+        st.rejected = stat_rejected_.load(std::memory_order_relaxed);
+        st.evicted = stat_evicted_.load(std::memory_order_relaxed);
+        st.caller_ran = stat_caller_ran_.load(std::memory_order_relaxed);
+        st.blocked = stat_blocked_.load(std::memory_order_relaxed);
+        return st;
+      }
+
+      // 待ちに入る前にスピンする時間を設定する. 0 の場合はスピンしない.
+      void set_spin(std::chrono::nanoseconds spin) {
+        spin_ns_.store(spin.count(), std::memory_order_relaxed);
+      }
+
+      // 処理を待っているワーカー数の目安 (ロックを取らないため, 厳密ではない).
+      // 処理を分割して登録するかの判断に使用する.
+      uint32_t idle_workers() const {
+        return parked_.load(std::memory_order_relaxed) + spinning_.load(std::memory_order_relaxed);
+      }
+
+      // 待ち合わせの統計を取得する
+      wakeup_stats get_wakeup_stats() {
+        wakeup_stats st;
+        st.parks = stat_parks_.load(std::memory_order_relaxed);
+        st.wakeups = stat_wakeups_.load(std::memory_order_relaxed);
+        st.spin_hits = stat_spin_hits_.load(std::memory_order_relaxed);
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          st.wakeups_skipped = stat_wakeups_skipped_;
+          st.timer_wakeups_saved = timer_wakeups_saved();
+        }
+        st.wakeups_skipped += stat_wakeups_skipped_lf_.load(std::memory_order_relaxed);
+        const uint32_t n = nworkers_.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++) {
+          worker_internal___ *w = workers_[i].load(std::memory_order_acquire);
+          if (w) {
+            st.wakeups_skipped += w->wakeups_skipped.load(std::memory_order_relaxed);
+          }
+        }
+        return st;
+      }
+
+      // 待っているワーカーの1つが poll() で待つようにする. poller は detach_poller() まで破棄しないこと.
+      void attach_poller(poller_internal___ *p) {
+        bool wake;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          poller_ = p;
+          has_poller_.store(true, std::memory_order_relaxed);
+          // 待っているワーカーを1つ起こし, poll() で待ち直させる
+          wake = reserve_wakeup();
+        }
+        if (wake) {
+          cond_.notify_one();
+        }
+      }
+
+      // poll() 中のワーカーが戻るまで待って登録を解除する
+      void detach_poller(poller_internal___ *p) {
         std::unique_lock<std::mutex> lock(mtx_);
-        workque_fifo_internal___::erase(ev);
+        if (poller_ != p) {
+          return;
+        }
+        poller_ = nullptr;
+        has_poller_.store(false, std::memory_order_relaxed);
+        while (polling_) {
+          p->wakeup();
+          poll_cond_.wait(lock);
+        }
       }
 
       void quit() {
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          is_quit_.store(true);
+          wakeup_poller();
+          space_cond_.notify_all();
+        }
         // 待っている物をすべてスケジュール
         // これにより, wait()がすべてスケジュールされる
         cond_.notify_all();
       }
     };
-  }
+  } }
+
+  class reactor;
 
   // workque処理 （優先度, スレッド数指定可能）
   class workque : protected __internal__::workque::workque_internal___ {
+    friend class reactor;
+
    private:
+    // threads_, retired_ を保護する
+    std::mutex threads_mtx_;
     std::vector<std::thread> threads_;
-    std::atomic<bool> is_quit_{false};
+    // 終了した伸縮するスレッド. 次に追加する時, wait() で join する.
+    std::vector<std::thread::id> retired_;
 
    public:
+    // スケジューリング方式, nice値の段数を指定して生成する.
+    // 段数を超えるnice値のイベントは最も優先度の低い段で実行される.
+    workque(sched_mode mode = sched_mode::global_fifo, nice_t levels = 64)
+     : __internal__::workque::workque_internal___(mode, levels)
+    {}
+
     using __internal__::workque::workque_internal___::push;
     using __internal__::workque::workque_internal___::push_for;
+    using __internal__::workque::workque_internal___::push_every;
+    using __internal__::workque::workque_internal___::try_push;
+    using __internal__::workque::workque_internal___::try_push_for;
+    using __internal__::workque::workque_internal___::push_continuation;
+    using __internal__::workque::workque_internal___::push_bulk;
+    using __internal__::workque::workque_internal___::push_bulk_for;
     using __internal__::workque::workque_internal___::cancel;
+    using __internal__::workque::workque_internal___::get_wakeup_stats;
+    using __internal__::workque::workque_internal___::idle_workers;
+    using __internal__::workque::workque_internal___::make_event;
+    using __internal__::workque::workque_internal___::get_pool_stats;
+    using __internal__::workque::workque_internal___::snapshot;
+
+    // タイマーのtick幅, 段数を設定する. タイマーを登録する前に呼び出すこと.
+    workque& with_timer_wheel(std::chrono::nanoseconds tick, uint32_t levels = 4) {
+      std::unique_lock<std::mutex> lock(mtx_);
+      set_timer_wheel(tick, levels);
+      return *this;
+    }
+
+    // 登録時に指定しない場合のタイマーのslackを設定する.
+    // 期限から slack の間にタイムアウトするタイマーをまとめ, 1回の起床で処理する.
+    workque& with_timer_slack(std::chrono::nanoseconds slack) {
+      std::unique_lock<std::mutex> lock(mtx_);
+      set_timer_slack(slack);
+      return *this;
+    }
+
+    // nice値の段毎の重みを設定する. 足りない段は最後の重みを使用する.
+    // 空でない段を優先度順に巡回し, 1巡毎に各段から重みの数だけ取り出すため,
+    // 優先度の高い処理が続いても低い段が重みに比例した割合で実行される.
+    // work_stealing の場合は各ワーカーがローカルキューの帯域とグローバルのFIFOを同様に巡回する.
+    // 空の場合は厳密な優先順 (既定) に戻す. lock_free_ring の場合は影響しない.
+    // 処理を登録する前に呼び出すこと.
+    workque& with_nice_weights(const std::vector<uint32_t> &weights) {
+      std::unique_lock<std::mutex> lock(mtx_);
+      set_weights(weights);
+      return *this;
+    }
+
+    // 実行を待っている数の上限と, 上限に達した場合の扱いを設定する.
+    // 処理を登録する前に呼び出すこと.
+    workque& with_capacity(const capacity_config &config) {
+      std::unique_lock<std::mutex> lock(mtx_);
+      set_capacity(config);
+      return *this;
+    }
+
+    // 実行を待っている数が high に達した時に on_change(true) を, low 以下へ戻った時に
+    // on_change(false) を呼び出す. 登録側はこれを見て上限に達する前に登録を控えられる.
+    // 登録, 取り出しを行ったスレッドで呼び出すため, on_change の中で空きを待たないこと.
+    workque& with_watermarks(size_t high, size_t low, std::function<void(bool)> on_change) {
+      std::unique_lock<std::mutex> lock(mtx_);
+      set_watermarks(high, low, std::move(on_change));
+      return *this;
+    }
+
+    // 登録から実行開始までの時間, 実行時間, ワーカーの稼働時間の統計を取るかを設定する.
+    // 有効にすると登録, 実行毎に時刻を取得する. 件数, キューの長さは常に取得できる.
+    workque& with_stats(bool enable = true) {
+      set_stats(enable);
+      return *this;
+    }
+
+    // lock_free_ring 時のリングの容量を設定する. 処理を登録する前に呼び出すこと.
+    workque& with_ring_capacity(size_t capacity) {
+      set_ring_capacity(capacity);
+      return *this;
+    }
+
+    // 処理がなくなったワーカーが待ちに入る前にスピンする時間を設定する.
+    // 長くすると起床の遅延が減る代わりにCPUを消費する. 0 の場合はスピンしない.
+    workque& with_spin(std::chrono::nanoseconds spin) {
+      set_spin(spin);
+      return *this;
+    }
+
+   protected:
+    // 呼び出しスレッドを指定したCPUへ固定する. 空の場合, 固定できない環境では何もしない.
+    static bool set_affinity(const std::vector<int> &cpus) {
+#if defined(__linux__)
+      if (cpus.empty()) {
+        return false;
+      }
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+          CPU_SET(cpu, &set);
+        }
+      }
+      return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+      (void)cpus;
+      return false;
+#endif
+    }
+
+    // quit()されるまで実行する
+    void loop(uint32_t group = 0) {
+      attach_stats();
+      attach_worker(group);
+      for (; is_quit_.load() == false && !tls().retire;) {
+        __internal__::workque::workque_internal___::exec();
+      }
+      detach_worker();
+      detach_stats();
+    }
+
+    // 伸縮するスレッドの本体. 処理がなくなり終了する場合は retired_ へ登録する.
+    void elastic_loop(bool grown) {
+      tls().elastic_owner = this;
+      tls().retire = false;
+      if (grown) {
+        spawning_.store(false);
+      }
+      loop();
+      tls().elastic_owner = nullptr;
+      if (!tls().retire) {
+        live_threads_.fetch_sub(1);
+        return;
+      }
+      tls().retire = false;
+      std::unique_lock<std::mutex> lock(threads_mtx_);
+      retired_.push_back(std::this_thread::get_id());
+    }
+
+    // 終了したスレッドを join する. threads_mtx_ を保持した状態で呼び出す.
+    void reap() {
+      for (const std::thread::id &id : retired_) {
+        auto it = std::find_if(threads_.begin(), threads_.end(),
+                               [&id](const std::thread &t) { return t.get_id() == id; });
+        if (it != threads_.end()) {
+          it->join();
+          threads_.erase(it);
+        }
+      }
+      retired_.clear();
+    }
+
+    bool spawn_worker() override {
+      std::unique_lock<std::mutex> lock(threads_mtx_);
+      if (is_quit_.load()) {
+        return false;
+      }
+      reap();
+      threads_.emplace_back(
+        std::thread([this]() {elastic_loop(true);})
+      );
+      return true;
+    }
 
+   public:
     // メインループ
     void run() {
       is_quit_.store(false);
-      for (; is_quit_.load() == false;) {
-        __internal__::workque::workque_internal___::exec();
-      }
+      loop();
     }
     void operator()(void) { run(); }
 
     // スレッド生成
     void start(uint32_t threads = 1) {
+      // 生成したスレッドが動き出す前に quit() されても終了できるよう, ここで戻す
+      is_quit_.store(false);
+      elastic_.store(false);
       // 指定数分threadを生成
+      std::unique_lock<std::mutex> lock(threads_mtx_);
       for (uint32_t i = 0; i < threads; i++) {
         threads_.emplace_back(
-          std::thread([this]() {run();})
+          std::thread([this]() {loop();})
+        );
+      }
+    }
+
+    // 負荷に応じてスレッド数を増減する. まず min_threads 分のスレッドを生成する.
+    void start(const elastic_config &cfg) {
+      is_quit_.store(false);
+      set_elastic(cfg);
+      std::unique_lock<std::mutex> lock(threads_mtx_);
+      for (uint32_t i = 0; i < cfg.min_threads; i++) {
+        live_threads_.fetch_add(1);
+        threads_.emplace_back(
+          std::thread([this]() {elastic_loop(false);})
         );
       }
     }
 
+    // 配置を指定してスレッド生成.
+    // グループ毎に指定数のスレッドを生成し, グループのCPUへ固定する (Linuxのみ).
+    void start(const topology &topo) {
+      is_quit_.store(false);
+      elastic_.store(false);
+      std::unique_lock<std::mutex> lock(threads_mtx_);
+      for (uint32_t g = 0; g < topo.groups.size(); g++) {
+        const worker_group &group = topo.groups[g];
+        uint32_t n = group.threads ? group.threads : static_cast<uint32_t>(group.cpus.size());
+        if (n == 0) {
+          n = 1;
+        }
+        const std::vector<int> cpus = group.cpus;
+        for (uint32_t i = 0; i < n; i++) {
+          threads_.emplace_back(
+            std::thread([this, g, cpus]() {
+              set_affinity(cpus);
+              loop(g);
+            })
+          );
+        }
+      }
+    }
+
     // 全メインループ破棄
     void quit() {
-      is_quit_.store(true);
       __internal__::workque::workque_internal___::quit();
     }
 
     // スレッド終了まで待つ
     void wait() {
-      for (auto &thread : threads_) {
-        thread.join();
+      // 伸縮するスレッドを追加しながら join しないよう, 取り出してから join する
+      for (;;) {
+        std::vector<std::thread> threads;
+        {
+          std::unique_lock<std::mutex> lock(threads_mtx_);
+          threads.swap(threads_);
+        }
+        if (threads.empty()) {
+          break;
+        }
+        for (auto &thread : threads) {
+          thread.join();
+        }
       }
-      threads_.clear();
+      std::unique_lock<std::mutex> lock(threads_mtx_);
+      retired_.clear();
     }
 
     // スレッド破棄
@@ -0,0 +1,485 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef LIBSHARAKU_WORKQ_FUTURE_HPP
+#define LIBSHARAKU_WORKQ_FUTURE_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <new>
+#include <utility>
+#include <exception>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <workq++.hpp>
+
+namespace sharaku {
+namespace workque {
+
+  template<class T>
+  class future;
+
+  namespace __internal__ {
+    // 結果の保持 (void は値を持たない)
+    template<class T>
+    class future_value___ {
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type buf_;
+      bool has_ = false;
+
+     public:
+      future_value___() {}
+      future_value___(const future_value___&) = delete;
+      future_value___& operator=(const future_value___&) = delete;
+
+      ~future_value___() {
+        if (has_) {
+          get().~T();
+        }
+      }
+
+      template<class U>
+      void emplace(U &&v) {
+        new (&buf_) T(std::forward<U>(v));
+        has_ = true;
+      }
+
+      const T &get() const {
+        return *reinterpret_cast<const T*>(&buf_);
+      }
+
+     private:
+      T &get() {
+        return *reinterpret_cast<T*>(&buf_);
+      }
+    };
+
+    template<>
+    class future_value___<void> {
+     public:
+      void get() const {}
+    };
+
+    // get() の戻り値
+    template<class T>
+    struct future_ref___ {
+      using type = const T&;
+    };
+
+    template<>
+    struct future_ref___<void> {
+      using type = void;
+    };
+
+    // 引数なしで呼び出した関数の戻り値
+    template<class F>
+    struct future_result___ {
+      using type = decltype(std::declval<F&>()());
+    };
+
+    // then() に渡す関数の戻り値
+    template<class F, class T>
+    struct then_result___ {
+      using type = decltype(std::declval<F&>()(std::declval<const T&>()));
+    };
+
+    template<class F>
+    struct then_result___<F, void> {
+      using type = decltype(std::declval<F&>()());
+    };
+
+    // future の共有状態
+    //
+    // 実行するeventを内部に持ち, eventと共有状態を1回の確保で済ませる.
+    // workqueへは自身を指す (別名の) shared_ptr<event> を登録する.
+    // 完了時に後続の処理 (then, when_all, when_any) を呼び出す. 後続はworkqueへ登録するか,
+    // 数を数えるだけなので, 完了させたワーカーを止めない.
+    template<class T>
+    class future_state_internal___
+      : public std::enable_shared_from_this<future_state_internal___<T>> {
+     public:
+      sharaku::workque::workque *wq_;
+      event ev_;
+
+      future_state_internal___(sharaku::workque::workque *wq, nice_t nice)
+       : wq_(wq), ev_(nice)
+      {}
+
+      std::shared_ptr<event> get_event() {
+        return std::shared_ptr<event>(this->shared_from_this(), &ev_);
+      }
+
+      // event を workque へ登録する. workque がない場合はその場で実行する.
+      void schedule() {
+        if (wq_) {
+          wq_->push_continuation(get_event());
+        } else {
+          ev_();
+        }
+      }
+
+      // func を実行して結果を設定する
+      template<class F, class... A>
+      void run(F &func, A&&... args) {
+        try {
+          invoke(std::is_void<T>(), func, std::forward<A>(args)...);
+        } catch (...) {
+          set_exception(std::current_exception());
+        }
+      }
+
+      template<class U>
+      void set_value(U &&v) {
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          value_.emplace(std::forward<U>(v));
+        }
+        complete();
+      }
+
+      void set_value() {
+        complete();
+      }
+
+      void set_exception(std::exception_ptr ex) {
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          ex_ = ex;
+        }
+        complete();
+      }
+
+      // 完了後に cont を呼び出す. 完了済みならその場で呼び出す.
+      void add_continuation(task &&cont) {
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          if (!done_) {
+            conts_.push_back(std::move(cont));
+            return;
+          }
+        }
+        cont();
+      }
+
+      bool ready() const {
+        std::unique_lock<std::mutex> lock(mtx_);
+        return done_;
+      }
+
+      void wait() const {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cond_.wait(lock, [this]() { return done_; });
+      }
+
+      // 完了後に呼び出す
+      const std::exception_ptr &exception() const {
+        return ex_;
+      }
+
+      typename future_ref___<T>::type value() const {
+        return value_.get();
+      }
+
+     protected:
+      mutable std::mutex mtx_;
+      mutable std::condition_variable cond_;
+      bool done_ = false;
+      future_value___<T> value_;
+      std::exception_ptr ex_;
+      std::vector<task> conts_;
+
+      template<class F, class... A>
+      void invoke(std::true_type, F &func, A&&... args) {
+        func(std::forward<A>(args)...);
+        set_value();
+      }
+
+      template<class F, class... A>
+      void invoke(std::false_type, F &func, A&&... args) {
+        set_value(func(std::forward<A>(args)...));
+      }
+
+      void complete() {
+        std::vector<task> conts;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          done_ = true;
+          conts.swap(conts_);
+        }
+        cond_.notify_all();
+        for (task &c : conts) {
+          c();
+        }
+      }
+    };
+
+    // push_future() で登録する処理
+    template<class R, class F>
+    struct future_call___ {
+      future_state_internal___<R> *st;
+      F func;
+
+      void operator()() {
+        st->run(func);
+      }
+    };
+
+    // then() で登録する処理. 元の処理の結果で func を実行する.
+    template<class T, class R, class F>
+    struct then_run___ {
+      future_state_internal___<R> *next;
+      std::shared_ptr<future_state_internal___<T>> src;
+      F func;
+
+      void operator()() {
+        call(std::is_void<T>());
+      }
+
+      void call(std::true_type) {
+        next->run(func);
+      }
+
+      void call(std::false_type) {
+        next->run(func, src->value());
+      }
+    };
+
+    // 元の処理の完了時に呼び出し, then() の処理を登録する.
+    // 例外で完了した場合は func を呼び出さずに例外を伝える.
+    template<class T, class R, class F>
+    struct then_call___ {
+      std::shared_ptr<future_state_internal___<R>> next;
+      future_state_internal___<T> *src;
+      F func;
+
+      void operator()() {
+        if (src->exception()) {
+          next->set_exception(src->exception());
+          return;
+        }
+        // 完了した側を参照するのはここから. 完了前に後続から参照すると循環する.
+        next->ev_.set_function(then_run___<T, R, F>{next.get(), src->shared_from_this(), std::move(func)});
+        next->schedule();
+      }
+    };
+
+    // when_all() の待ち合わせ
+    template<class T>
+    struct when_all_context___ {
+      using R = typename std::conditional<std::is_void<T>::value, void, std::vector<T>>::type;
+
+      std::shared_ptr<future_state_internal___<R>> dst;
+      // 完了したものを保持する (完了前に保持すると循環する)
+      std::vector<std::shared_ptr<future_state_internal___<T>>> srcs;
+      std::atomic<size_t> left;
+
+      when_all_context___(std::shared_ptr<future_state_internal___<R>> d, size_t n)
+       : dst(std::move(d)), srcs(n), left(n)
+      {}
+
+      void finish() {
+        for (auto &s : srcs) {
+          if (s->exception()) {
+            dst->set_exception(s->exception());
+            return;
+          }
+        }
+        set(std::is_void<T>());
+      }
+
+      void set(std::true_type) {
+        dst->set_value();
+      }
+
+      void set(std::false_type) {
+        std::vector<T> values;
+        values.reserve(srcs.size());
+        for (auto &s : srcs) {
+          values.push_back(s->value());
+        }
+        dst->set_value(std::move(values));
+      }
+    };
+
+    // when_any() の待ち合わせ
+    struct when_any_context___ {
+      std::shared_ptr<future_state_internal___<size_t>> dst;
+      std::atomic<bool> fired{false};
+
+      explicit when_any_context___(std::shared_ptr<future_state_internal___<size_t>> d)
+       : dst(std::move(d))
+      {}
+    };
+
+    struct future_access___ {
+      template<class T>
+      static const std::shared_ptr<future_state_internal___<T>> &state(const future<T> &f) {
+        return f.st_;
+      }
+
+      template<class T>
+      static future<T> make(std::shared_ptr<future_state_internal___<T>> st) {
+        return future<T>(std::move(st));
+      }
+    };
+  }
+
+  // workqueで実行した処理の結果
+  //
+  // 共有状態を参照するため, コピーしたものは同じ結果を指す.
+  // get(), wait() は完了まで待つため, workqueのワーカーからは then() で後続を登録すること.
+  template<class T>
+  class future {
+    friend struct __internal__::future_access___;
+    using state = __internal__::future_state_internal___<T>;
+
+    std::shared_ptr<state> st_;
+
+    explicit future(std::shared_ptr<state> st) : st_(std::move(st)) {}
+
+   public:
+    future() {}
+
+    bool valid() const {
+      return st_ != nullptr;
+    }
+
+    // 完了しているか
+    bool ready() const {
+      return st_->ready();
+    }
+
+    // 完了を待つ
+    void wait() const {
+      st_->wait();
+    }
+
+    // 完了を待って結果を返す. 処理が例外を投げた場合は, その例外を投げる.
+    typename __internal__::future_ref___<T>::type get() const {
+      st_->wait();
+      if (st_->exception()) {
+        std::rethrow_exception(st_->exception());
+      }
+      return st_->value();
+    }
+
+    // 完了後に func(結果) を nice で実行する (void の場合は func()).
+    // 完了した時点でworkqueへ登録するため, 待っているワーカーは生じない.
+    // 処理が例外を投げた場合, func は呼び出さずに例外を返す future を完了させる.
+    template<class F>
+    future<typename __internal__::then_result___<typename std::decay<F>::type, T>::type>
+    then(nice_t nice, F &&func) const {
+      using FD = typename std::decay<F>::type;
+      using R = typename __internal__::then_result___<FD, T>::type;
+      std::shared_ptr<__internal__::future_state_internal___<R>> next =
+        std::make_shared<__internal__::future_state_internal___<R>>(st_->wq_, nice);
+      st_->add_continuation(__internal__::then_call___<T, R, FD>{next, st_.get(), std::forward<F>(func)});
+      return __internal__::future_access___::make<R>(std::move(next));
+    }
+
+    template<class F>
+    future<typename __internal__::then_result___<typename std::decay<F>::type, T>::type>
+    then(F &&func) const {
+      return then(0, std::forward<F>(func));
+    }
+  };
+
+  // func を nice で実行し, その結果の future を返す.
+  // eventと結果の共有状態は1回の確保で済ませる.
+  template<class F>
+  future<typename __internal__::future_result___<typename std::decay<F>::type>::type>
+  push_future(workque *wq, nice_t nice, F &&func) {
+    using FD = typename std::decay<F>::type;
+    using R = typename __internal__::future_result___<FD>::type;
+    std::shared_ptr<__internal__::future_state_internal___<R>> st =
+      std::make_shared<__internal__::future_state_internal___<R>>(wq, nice);
+    st->ev_.set_function(__internal__::future_call___<R, FD>{st.get(), std::forward<F>(func)});
+    st->schedule();
+    return __internal__::future_access___::make<R>(std::move(st));
+  }
+
+  template<class F>
+  future<typename __internal__::future_result___<typename std::decay<F>::type>::type>
+  push_future(workque *wq, F &&func) {
+    return push_future(wq, 0, std::forward<F>(func));
+  }
+
+  // すべての future が完了すると完了する. 結果は順に並べたもの (void の場合は値なし).
+  // 例外で完了したものがあれば, 最初のものの例外で完了する.
+  template<class T>
+  future<typename __internal__::when_all_context___<T>::R>
+  when_all(const std::vector<future<T>> &futures) {
+    using context = __internal__::when_all_context___<T>;
+    using R = typename context::R;
+    using src_state = __internal__::future_state_internal___<T>;
+    using access = __internal__::future_access___;
+
+    workque *wq = futures.empty() ? nullptr : access::state(futures[0])->wq_;
+    std::shared_ptr<__internal__::future_state_internal___<R>> dst =
+      std::make_shared<__internal__::future_state_internal___<R>>(wq, 0);
+    std::shared_ptr<context> ctx = std::make_shared<context>(dst, futures.size());
+    if (futures.empty()) {
+      ctx->finish();
+      return access::make<R>(std::move(dst));
+    }
+    for (size_t i = 0; i < futures.size(); i++) {
+      src_state *src = access::state(futures[i]).get();
+      src->add_continuation([ctx, src, i]() {
+        ctx->srcs[i] = src->shared_from_this();
+        if (ctx->left.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          ctx->finish();
+        }
+      });
+    }
+    return access::make<R>(std::move(dst));
+  }
+
+  // いずれかの future が完了すると, その位置で完了する (例外で完了した場合も同じ).
+  // 空の場合は完了しない.
+  template<class T>
+  future<size_t> when_any(const std::vector<future<T>> &futures) {
+    using context = __internal__::when_any_context___;
+    using access = __internal__::future_access___;
+
+    workque *wq = futures.empty() ? nullptr : access::state(futures[0])->wq_;
+    std::shared_ptr<__internal__::future_state_internal___<size_t>> dst =
+      std::make_shared<__internal__::future_state_internal___<size_t>>(wq, 0);
+    std::shared_ptr<context> ctx = std::make_shared<context>(dst);
+    for (size_t i = 0; i < futures.size(); i++) {
+      access::state(futures[i])->add_continuation([ctx, i]() {
+        if (!ctx->fired.exchange(true, std::memory_order_acq_rel)) {
+          ctx->dst->set_value(i);
+        }
+      });
+    }
+    return access::make<size_t>(std::move(dst));
+  }
+
+}
+}
+
+#endif // LIBSHARAKU_WORKQ_FUTURE_HPP
@@ -27,60 +27,136 @@
 #ifndef LIBSHARAKU_WORKQ_INTERVALTIMER_HPP
 #define LIBSHARAKU_WORKQ_INTERVALTIMER_HPP
 
+#include <condition_variable>
 #include <vector>
+#include <mutex>
 #include <workq++.hpp>
-#include <co-routine.hpp>
 
 namespace sharaku {
 namespace workque {
 
-  class intervaltimer : protected sharaku::workque::coroutine {
-    std::vector<std::function<void(void)>> func_lists_;
-    std::chrono::milliseconds interval_;
+  // 登録した処理を一定間隔で実行する.
+  // workque::push_every() で期限を絶対時刻で決めるため, 実行の遅れは累積しない.
+  // stop() (破棄を含む) は実行中の回が終わるまで待つ. 登録した処理の中から呼び出した場合は待たない.
+  class intervaltimer {
+    // 実行待ちの回から参照するため, intervaltimerとは別に確保する
+    struct state {
+      std::mutex mtx;
+      std::condition_variable cond;
+      std::vector<std::function<void(void)>> func_lists;
+      // start(), stop() の度に進め, 取り消した登録の回を実行しない. mtx で保護.
+      uint64_t gen = 0;
+      // 実行中の回の数. mtx で保護.
+      int running = 0;
+
+      // このスレッドで実行中のstate
+      static const state *&current() {
+        static thread_local const state *s = nullptr;
+        return s;
+      }
+
+      // 例外で抜けた場合も実行の終了を記録する
+      struct running_guard {
+        state *s;
+        const state *prev;
+        ~running_guard() {
+          current() = prev;
+          std::unique_lock<std::mutex> lock(s->mtx);
+          s->running--;
+          s->cond.notify_all();
+        }
+      };
+
+      void exec(uint64_t g) {
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          if (g != gen) {
+            return;
+          }
+          running++;
+        }
+        running_guard guard{this, current()};
+        current() = this;
+        for (auto &func : func_lists) {
+          func();
+        }
+      }
+    };
+
+    // start() で登録する処理
+    struct tick {
+      std::shared_ptr<state> s;
+      uint64_t gen;
+      void operator()() {
+        s->exec(gen);
+      }
+    };
+
+    workque *wq_;
+    nice_t nice_;
+    std::chrono::milliseconds interval_{0};
+    missed_tick policy_ = missed_tick::coalesce;
+    std::shared_ptr<state> state_;
+    // state::mtx で保護する
+    std::shared_ptr<event> ev_;
 
    public:
     intervaltimer(workque *wq, nice_t nice = 0)
-    : sharaku::workque::coroutine {wq, nice}
+    : wq_(wq), nice_(nice), state_(std::make_shared<state>())
     {
     }
 
+    ~intervaltimer() {
+      stop();
+    }
+
     intervaltimer& with_interval(std::chrono::milliseconds interval) {
       interval_ = interval;
       return *this;
     }
 
+    // 処理が遅れ, 次の期限を過ぎていた場合の扱いを設定する
+    intervaltimer& with_policy(missed_tick policy) {
+      policy_ = policy;
+      return *this;
+    }
+
     intervaltimer& push(std::function<void(void)> func) {
-      func_lists_.push_back(func);
+      state_->func_lists.push_back(func);
       return *this;
     }
 
+    // ms 後に最初の実行を行い, 以降 interval 毎に実行する
     void start(std::chrono::milliseconds ms = std::chrono::milliseconds(0)) {
-      push_for(
-        ms,
-        [this]() -> sharaku::workque::coroutine::result {
-          exec();
-          return sharaku::workque::coroutine::result::next;
-        }
-      );
-      push_for(
-        interval_,
-        [this]() -> sharaku::workque::coroutine::result {
-          exec();
-          return sharaku::workque::coroutine::result::retry;
-        }
-      );
-
-      sharaku::workque::coroutine::start();
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      if (ev_) {
+        wq_->cancel(ev_);
+      }
+      const uint64_t g = ++state_->gen;
+      ev_ = wq_->push_every(ms, interval_, nice_, tick{state_, g}, policy_);
     }
 
-    using sharaku::workque::coroutine::stop;
-    using sharaku::workque::coroutine::suspend;
-    using sharaku::workque::coroutine::resume;
-   protected:
-    void exec() {
-      for (auto &func : func_lists_) {
-        func();
+    // 停止する. 実行中の回があれば終わるまで待つ.
+    void stop() {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      state_->gen++;
+      if (ev_) {
+        wq_->cancel(ev_);
+        ev_.reset();
       }
+      // 登録した処理の中から呼び出した場合は, その回の終了を待たない
+      const int self = state::current() == state_.get() ? 1 : 0;
+      state_->cond.wait(lock, [this, self]() { return state_->running <= self; });
+    }
+
+    // 一時停止する
+    void suspend() {
+      stop();
+    }
+
+    // 一時停止から再開する. 次の実行は interval 後.
+    void resume() {
+      start(interval_);
     }
   };
 
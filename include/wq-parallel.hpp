@@ -0,0 +1,308 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef LIBSHARAKU_WORKQ_PARALLEL_HPP
+#define LIBSHARAKU_WORKQ_PARALLEL_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <workq++.hpp>
+
+namespace sharaku {
+namespace workque {
+  namespace __internal__ { namespace workque {
+    // parallel_for, parallel_reduce の共有状態
+    //
+    // 範囲は grain 個ずつ実行し, その合間に空いているワーカーがいれば残りの後半を切り出して登録する.
+    // 空いているワーカーがいない間は分割しないため, 分割の細かさは負荷に合わせて決まる.
+    // 切り出した範囲は ranges_ に積み, workqueへは取り出し役の処理だけを登録する.
+    // 呼び出し元も ranges_ から取り出して実行し, 他のワーカーが実行中の範囲が残る場合のみ待つ.
+    // body が例外を投げた場合は残りの範囲を実行せず, 実行中の範囲が終わってから呼び出し元で最初の例外を投げ直す.
+    class parallel_internal___ : public std::enable_shared_from_this<parallel_internal___> {
+     public:
+      using range = std::pair<size_t, size_t>;
+
+      parallel_internal___(sharaku::workque::workque *wq, nice_t nice, size_t grain,
+                           std::function<void(size_t, size_t)> body)
+       : wq_(wq), nice_(nice), grain_(grain ? grain : 1), body_(std::move(body))
+      {}
+
+      // [begin, end) を呼び出し元で実行し, 切り出した範囲がすべて終わるまで手伝う
+      void run(size_t begin, size_t end) {
+        exec(begin, end);
+        for (;;) {
+          if (help()) {
+            continue;
+          }
+          std::unique_lock<std::mutex> lock(mtx_);
+          if (outstanding_ == 0) {
+            if (error_) {
+              std::rethrow_exception(error_);
+            }
+            return;
+          }
+          if (ranges_.empty()) {
+            waiting_ ++;
+            cond_.wait(lock, [this]() { return outstanding_ == 0 || !ranges_.empty(); });
+            waiting_ --;
+          }
+        }
+      }
+
+     protected:
+      sharaku::workque::workque *wq_;
+      nice_t nice_;
+      size_t grain_;
+      std::function<void(size_t, size_t)> body_;
+
+      // ranges_, outstanding_, waiting_, error_ を保護する
+      std::mutex mtx_;
+      std::condition_variable cond_;
+      // 切り出して, まだ誰も取り出していない範囲 (後に切り出したものから取り出す)
+      std::vector<range> ranges_;
+      // ranges_ の数 (ロックを取らずに参照する)
+      std::atomic<size_t> offered_{0};
+      // 切り出した範囲のうち, 終わっていない数
+      size_t outstanding_ = 0;
+      uint32_t waiting_ = 0;
+      // body が最初に投げた例外. failed_ はロックを取らずに参照する.
+      std::exception_ptr error_;
+      std::atomic<bool> failed_{false};
+
+      // [begin, end) を実行する. body の例外は記録して戻り, 以降は実行しない.
+      void exec(size_t begin, size_t end) {
+        while (begin < end && !failed_.load(std::memory_order_relaxed)) {
+          const size_t stop = end - begin > grain_ ? begin + grain_ : end;
+          // 切り出した範囲より空いているワーカーが多ければ, 残りの後半を渡す
+          if (end - stop >= 2 * grain_ &&
+              wq_->idle_workers() > offered_.load(std::memory_order_relaxed)) {
+            const size_t mid = stop + (end - stop) / 2;
+            offer(mid, end);
+            end = mid;
+          }
+          try {
+            body_(begin, stop);
+          } catch (...) {
+            fail(std::current_exception());
+            return;
+          }
+          begin = stop;
+        }
+      }
+
+      // 最初の例外を記録し, まだ誰も取り出していない範囲を捨てる
+      void fail(std::exception_ptr e) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!error_) {
+          error_ = e;
+        }
+        failed_.store(true, std::memory_order_relaxed);
+        outstanding_ -= ranges_.size();
+        ranges_.clear();
+        offered_.store(0, std::memory_order_relaxed);
+        if (waiting_) {
+          cond_.notify_all();
+        }
+      }
+
+      // 範囲を切り出して他のワーカーへ渡す. 例外を記録した後は渡さない.
+      void offer(size_t begin, size_t end) {
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          if (error_) {
+            return;
+          }
+          ranges_.emplace_back(begin, end);
+          offered_.store(ranges_.size(), std::memory_order_relaxed);
+          outstanding_ ++;
+          if (waiting_) {
+            cond_.notify_all();
+          }
+        }
+        std::shared_ptr<parallel_internal___> self = shared_from_this();
+        wq_->push_continuation(nice_, [self]() { self->help(); });
+      }
+
+      // 切り出された範囲を1つ取り出して実行する. 範囲が残っていなければ false を返す.
+      bool help() {
+        range r;
+        {
+          std::unique_lock<std::mutex> lock(mtx_);
+          if (ranges_.empty()) {
+            return false;
+          }
+          r = ranges_.back();
+          ranges_.pop_back();
+          offered_.store(ranges_.size(), std::memory_order_relaxed);
+        }
+        exec(r.first, r.second);
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (-- outstanding_ == 0 && waiting_) {
+          cond_.notify_all();
+        }
+        return true;
+      }
+    };
+
+    // body(begin, end) の形式か
+    template<class F, class = void>
+    struct is_range_body___ : std::false_type {};
+    template<class F>
+    struct is_range_body___<F, decltype(void(std::declval<F&>()(size_t(), size_t())))> : std::true_type {};
+
+    // body を範囲を受け取る形式にする
+    template<class F>
+    std::function<void(size_t, size_t)> range_body(F &body, std::true_type) {
+      return [&body](size_t b, size_t e) { body(b, e); };
+    }
+
+    template<class F>
+    std::function<void(size_t, size_t)> range_body(F &body, std::false_type) {
+      return [&body](size_t b, size_t e) {
+        for (size_t i = b; i < e; i++) {
+          body(i);
+        }
+      };
+    }
+
+    // parallel_reduce の途中結果の番号 (スレッド毎の参照先を見分ける)
+    inline uint64_t next_partials_id___() {
+      static std::atomic<uint64_t> id{0};
+      return id.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // parallel_reduce の途中結果. スレッド毎に別のキャッシュラインへ置く.
+    // 各スレッドは最後に使った途中結果を thread_local に覚え, 範囲毎の検索とロックを省く.
+    template<class T>
+    class partials_internal___ {
+      struct alignas(64) slot : public cache_aligned_new___ {
+        T value;
+        std::thread::id owner;
+        slot(const T &v, std::thread::id id) : value(v), owner(id) {}
+      };
+
+      // スレッドが最後に参照した途中結果
+      struct cache {
+        uint64_t id = 0;
+        slot *s = nullptr;
+      };
+
+      static cache &tls() {
+        static thread_local cache c;
+        return c;
+      }
+
+      const T identity_;
+      const uint64_t id_;
+      // slots_ を保護する
+      std::mutex mtx_;
+      std::vector<std::unique_ptr<slot>> slots_;
+
+      // 呼び出したスレッドの途中結果を探し, なければ追加する
+      slot *find() {
+        const std::thread::id id = std::this_thread::get_id();
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (std::unique_ptr<slot> &s : slots_) {
+          if (s->owner == id) {
+            return s.get();
+          }
+        }
+        slots_.emplace_back(new slot(identity_, id));
+        return slots_.back().get();
+      }
+
+     public:
+      explicit partials_internal___(const T &identity)
+       : identity_(identity), id_(next_partials_id___())
+      {}
+
+      // 呼び出したスレッドの途中結果
+      T& local() {
+        cache &c = tls();
+        if (c.id != id_) {
+          c.s = find();
+          c.id = id_;
+        }
+        return c.s->value;
+      }
+
+      // すべて終わった後に呼び出す
+      template<class R>
+      T combine(R &reduce) {
+        T result = identity_;
+        for (std::unique_ptr<slot> &s : slots_) {
+          result = reduce(std::move(result), s->value);
+        }
+        return result;
+      }
+    };
+
+  } }
+
+  // [first, last) の各要素に body を実行する. body は body(i) または body(begin, end) の形式.
+  // 呼び出し元のスレッドも実行に加わり, すべて終わってから戻る.
+  // grain は一度に実行する最小の要素数で, 空いているワーカーがいる場合のみそれ以上に分割する.
+  // body が例外を投げた場合は残りを実行せず, 実行中のものが終わってから最初の例外を投げ直す.
+  // workqueのワーカーから呼び出してもよい.
+  template<class F>
+  void parallel_for(workque *wq, size_t first, size_t last, F &&body,
+                    size_t grain = 1, nice_t nice = 0) {
+    if (first >= last) {
+      return;
+    }
+    auto st = std::make_shared<__internal__::workque::parallel_internal___>(wq, nice, grain,
+      __internal__::workque::range_body(body, __internal__::workque::is_range_body___<F>()));
+    st->run(first, last);
+  }
+
+  // [first, last) を body(begin, end, acc) で集計し, 途中結果を reduce(a, b) でまとめて返す.
+  // 途中結果はスレッド毎に持つため, reduce は結合法則, 交換法則を満たすこと.
+  // identity は reduce の単位元 (加算なら 0).
+  template<class T, class F, class R>
+  T parallel_reduce(workque *wq, size_t first, size_t last, T identity, F &&body, R &&reduce,
+                    size_t grain = 1, nice_t nice = 0) {
+    if (first >= last) {
+      return identity;
+    }
+    __internal__::workque::partials_internal___<T> partials(identity);
+    auto st = std::make_shared<__internal__::workque::parallel_internal___>(wq, nice, grain,
+      [&partials, &body](size_t b, size_t e) { body(b, e, partials.local()); });
+    st->run(first, last);
+    return partials.combine(reduce);
+  }
+
+}
+}
+
+#endif // LIBSHARAKU_WORKQ_PARALLEL_HPP
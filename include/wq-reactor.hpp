@@ -0,0 +1,342 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef LIBSHARAKU_WORKQ_REACTOR_HPP
+#define LIBSHARAKU_WORKQ_REACTOR_HPP
+
+#if !defined(__linux__)
+#error "wq-reactor.hpp requires Linux (epoll, eventfd)"
+#endif
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <workq++.hpp>
+
+namespace sharaku {
+namespace workque {
+
+  // ファイルディスクリプタの準備 (epoll) をworkqueの処理として実行する
+  //
+  // 専用のスレッドは持たず, 処理のなくなったワーカーのうち1つが condition_variable の代わりに
+  // epoll_pwait2() (使えない環境では epoll_wait()) で待つ. 処理が登録された場合は eventfd で起こす.
+  // 準備のできたfdのコールバックは直接workqueのキューへ積まれる. 処理中のワーカーも一定間隔で待たずに確認する.
+  //
+  // 同じfdのコールバックは重ねて実行しない (EPOLLONESHOT で登録し, コールバックの終了後に再登録する).
+  // remove(), 破棄は実行中のコールバックの終了を待つ (そのコールバックの中から呼び出した場合は待たない).
+  class reactor {
+   public:
+    // 準備ができた際に呼び出す関数. 引数は epoll の events (EPOLLIN 等).
+    using callback = std::function<void(uint32_t)>;
+
+   protected:
+    struct handler {
+      int fd;
+      uint32_t events;
+      // fdの再利用と区別する番号
+      uint32_t gen;
+      nice_t nice;
+      callback func;
+      // 準備を待っているか (コールバックの実行待ち, 実行中は false). state::mtx で保護.
+      bool armed = false;
+      // 登録解除済み. 実行待ちのコールバックは実行しない.
+      std::atomic<bool> removed{false};
+      // コールバックを実行中か. state::mtx で保護.
+      bool running = false;
+    };
+
+    // 実行待ちのコールバックから参照するため, reactorとは別に確保する
+    struct state : __internal__::workque::poller_internal___, std::enable_shared_from_this<state> {
+      // eventfd を表す epoll_event::data
+      static constexpr uint64_t wakeup_key = UINT64_MAX;
+      // 1回の epoll_wait() で受け取る数
+      static constexpr int max_events = 64;
+
+      int epfd = -1;
+      int efd = -1;
+      std::mutex mtx;
+      // コールバックの終了を通知する
+      std::condition_variable cond;
+      std::unordered_map<int, std::shared_ptr<handler>> handlers;
+      // 実行中のコールバックの数. mtx で保護.
+      size_t running = 0;
+      uint32_t gen = 0;
+      // poll() は同時に1つのワーカーのみが呼び出す
+      epoll_event events[max_events];
+      // epoll_pwait2() が使えるか. 使えないカーネルでは ENOSYS を受け取った時点で epoll_wait() に切り替える.
+      bool pwait2 = true;
+
+      state() {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd >= 0 && efd >= 0) {
+          epoll_event ev = {};
+          ev.events = EPOLLIN;
+          ev.data.u64 = wakeup_key;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+        }
+      }
+
+      ~state() override {
+        if (efd >= 0) {
+          close(efd);
+        }
+        if (epfd >= 0) {
+          close(epfd);
+        }
+      }
+
+      static uint64_t key(const handler &h) {
+        return (static_cast<uint64_t>(h.gen) << 32) | static_cast<uint32_t>(h.fd);
+      }
+
+      // 1回分の準備を待つよう登録する. mtx を保持した状態で呼び出す.
+      bool arm(handler &h, int op) {
+        epoll_event ev = {};
+        ev.events = h.events | EPOLLONESHOT;
+        ev.data.u64 = key(h);
+        h.armed = epoll_ctl(epfd, op, h.fd, &ev) == 0;
+        return h.armed;
+      }
+
+      // このスレッドで実行中のコールバックと, その reactor
+      struct running_callback {
+        const state *s;
+        const handler *h;
+      };
+
+      static running_callback &current() {
+        static thread_local running_callback c = {nullptr, nullptr};
+        return c;
+      }
+
+      // コールバックの終了後 (例外で抜けた場合も), 終了を通知し, 登録が残っていれば再度待つ
+      struct run_guard {
+        state *s;
+        std::shared_ptr<handler> h;
+        running_callback prev;
+        ~run_guard() {
+          current() = prev;
+          std::unique_lock<std::mutex> lock(s->mtx);
+          h->running = false;
+          s->running--;
+          s->cond.notify_all();
+          auto it = s->handlers.find(h->fd);
+          if (it != s->handlers.end() && it->second == h) {
+            s->arm(*h, EPOLL_CTL_MOD);
+          }
+        }
+      };
+
+      // 準備のできたfdのコールバックを実行する
+      void run(const std::shared_ptr<handler> &h, uint32_t ev) {
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          if (h->removed.load(std::memory_order_relaxed)) {
+            return;
+          }
+          h->running = true;
+          running++;
+        }
+        run_guard guard{this, h, current()};
+        current().s = this;
+        current().h = h.get();
+        h->func(ev);
+      }
+
+      // h のコールバックが終わるまで待つ. mtx を保持した状態で呼び出す.
+      void wait_idle(std::unique_lock<std::mutex> &lock, const std::shared_ptr<handler> &h) {
+        if (current().h != h.get()) {
+          cond.wait(lock, [&h]() { return !h->running; });
+        }
+      }
+
+      // 準備を待つ. 待っているワーカーはタイマーのリーダーを兼ねるため, timeout はナノ秒の精度で待つ.
+      int wait(std::chrono::nanoseconds timeout) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+        if (pwait2) {
+          timespec ts;
+          timespec *pts = nullptr;
+          if (timeout >= std::chrono::nanoseconds::zero()) {
+            ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+            ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+            pts = &ts;
+          }
+          const int n = epoll_pwait2(epfd, events, max_events, pts, nullptr);
+          if (n >= 0 || errno != ENOSYS) {
+            return n;
+          }
+          pwait2 = false;
+        }
+#endif
+        int ms = -1;
+        if (timeout >= std::chrono::nanoseconds::zero()) {
+          // 早く戻らないよう切り上げる
+          const int64_t c = (timeout.count() + 999999) / 1000000;
+          ms = c > INT_MAX ? INT_MAX : static_cast<int>(c);
+        }
+        return epoll_wait(epfd, events, max_events, ms);
+      }
+
+      void poll(std::chrono::nanoseconds timeout, std::vector<__internal__::workque::entry> &out) override {
+        const int n = wait(timeout);
+        if (n <= 0) {
+          return;
+        }
+        const std::shared_ptr<state> s = shared_from_this();
+        std::unique_lock<std::mutex> lock(mtx);
+        for (int i = 0; i < n; i++) {
+          const uint64_t k = events[i].data.u64;
+          if (k == wakeup_key) {
+            uint64_t v;
+            (void)!read(efd, &v, sizeof(v));
+            continue;
+          }
+          auto it = handlers.find(static_cast<int>(static_cast<uint32_t>(k)));
+          if (it == handlers.end() || key(*it->second) != k) {
+            continue;
+          }
+          it->second->armed = false;
+          const uint32_t ev = events[i].events;
+          const std::shared_ptr<handler> h = it->second;
+          out.emplace_back(h->nice, task(
+            [s, h, ev]() { s->run(h, ev); }));
+        }
+      }
+
+      void wakeup() override {
+        const uint64_t one = 1;
+        (void)!write(efd, &one, sizeof(one));
+      }
+    };
+
+    workque *wq_;
+    std::shared_ptr<state> state_;
+
+   public:
+    reactor(workque *wq)
+     : wq_(wq), state_(std::make_shared<state>())
+    {
+      if (valid()) {
+        wq_->attach_poller(state_.get());
+      }
+    }
+
+    // 登録を解除する. 実行中のコールバックは終わるまで待つ.
+    ~reactor() {
+      if (valid()) {
+        wq_->detach_poller(state_.get());
+      }
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      for (auto &it : state_->handlers) {
+        it.second->removed.store(true, std::memory_order_release);
+      }
+      state_->handlers.clear();
+      // コールバックの中から破棄した場合は, そのコールバックの終了を待たない
+      const size_t self = state::current().s == state_.get() ? 1 : 0;
+      state_->cond.wait(lock, [this, self]() { return state_->running <= self; });
+    }
+
+    reactor(const reactor&) = delete;
+    reactor& operator=(const reactor&) = delete;
+
+    // epoll, eventfd を作成できたか
+    bool valid() const {
+      return state_->epfd >= 0 && state_->efd >= 0;
+    }
+
+    // fdを登録する. events (EPOLLIN, EPOLLOUT 等) の準備ができる毎に func(events) を nice で実行する.
+    // 登録済みのfd, 登録できないfdの場合は false.
+    bool add(int fd, uint32_t events, nice_t nice, callback func) {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      if (!valid() || state_->handlers.count(fd)) {
+        return false;
+      }
+      std::shared_ptr<handler> h = std::make_shared<handler>();
+      h->fd = fd;
+      h->events = events;
+      h->gen = ++ state_->gen;
+      h->nice = nice;
+      h->func = std::move(func);
+      if (!state_->arm(*h, EPOLL_CTL_ADD)) {
+        return false;
+      }
+      state_->handlers.emplace(fd, std::move(h));
+      return true;
+    }
+
+    bool add(int fd, uint32_t events, callback func) {
+      return add(fd, events, 0, std::move(func));
+    }
+
+    // 待つ準備を変更する. コールバックの実行待ち, 実行中の場合は, その終了後から反映する.
+    bool modify(int fd, uint32_t events) {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      auto it = state_->handlers.find(fd);
+      if (it == state_->handlers.end()) {
+        return false;
+      }
+      it->second->events = events;
+      return !it->second->armed || state_->arm(*it->second, EPOLL_CTL_MOD);
+    }
+
+    // 登録を解除する. 実行待ちのコールバックは実行せず, 実行中のコールバックは終わるまで待つ
+    // (そのコールバックの中から呼び出した場合は待たない). fd を閉じる前に呼び出すこと.
+    bool remove(int fd) {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      auto it = state_->handlers.find(fd);
+      if (it == state_->handlers.end()) {
+        return false;
+      }
+      const std::shared_ptr<handler> h = it->second;
+      h->removed.store(true, std::memory_order_release);
+      epoll_ctl(state_->epfd, EPOLL_CTL_DEL, fd, nullptr);
+      state_->handlers.erase(it);
+      state_->wait_idle(lock, h);
+      return true;
+    }
+
+    // 登録しているfdの数
+    size_t size() const {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      return state_->handlers.size();
+    }
+  };
+
+}
+}
+
+#endif // LIBSHARAKU_WORKQ_REACTOR_HPP
@@ -0,0 +1,169 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef LIBSHARAKU_WORKQ_STRAND_HPP
+#define LIBSHARAKU_WORKQ_STRAND_HPP
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <workq++.hpp>
+
+namespace sharaku {
+namespace workque {
+
+  // 登録した処理を登録順に1つずつ実行する (同じstrandの処理は重ならない)
+  //
+  // 専用のスレッドは持たず, 処理がある間だけworkqueへ1つ登録して実行する.
+  // 異なるstrandの処理は並列に実行される. 処理のないstrandはworkqueのキューを使用しない.
+  class strand {
+   protected:
+    // 登録された処理 (MPSCキューの要素)
+    struct node {
+      std::atomic<node*> next{nullptr};
+      task func;
+    };
+
+    // workqueへ登録した処理から参照するため, strandとは別に確保する
+    struct state : std::enable_shared_from_this<state> {
+      workque *wq;
+      nice_t nice;
+      // 1回の実行で処理する数の上限. 超えた分はworkqueへ登録し直して他の処理に譲る.
+      size_t batch = 64;
+      // 登録側は head へ繋ぎ, 実行側は tail から取り出す. tail は実行済みの要素 (番兵).
+      std::atomic<node*> head;
+      node *tail;
+      // 未実行の数. 0 から増やした登録側がworkqueへ登録する.
+      std::atomic<size_t> count{0};
+
+      state(workque *w, nice_t n) : wq(w), nice(n) {
+        tail = new node;
+        head.store(tail, std::memory_order_relaxed);
+      }
+
+      ~state() {
+        while (tail) {
+          node *next = tail->next.load(std::memory_order_relaxed);
+          delete tail;
+          tail = next;
+        }
+      }
+
+      void push(task &&func) {
+        node *n = new node;
+        n->func = std::move(func);
+        node *prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+        if (count.fetch_add(1, std::memory_order_acq_rel) == 0) {
+          schedule();
+        }
+      }
+
+      void schedule() {
+        std::shared_ptr<state> s = shared_from_this();
+        wq->push_continuation(nice, [s]() { s->drain(); });
+      }
+
+      // 実行中のstrand
+      static const state *&current() {
+        static thread_local const state *s = nullptr;
+        return s;
+      }
+
+      // drain() の終わりに実行中のstrandを戻し, 取り出した分を減らす.
+      // 処理が例外を投げた場合も残りを実行できるよう, 残っていれば登録し直す.
+      struct drain_guard {
+        state *s;
+        const state *prev;
+        size_t done;
+        ~drain_guard() {
+          current() = prev;
+          if (s->count.fetch_sub(done, std::memory_order_acq_rel) != done) {
+            s->schedule();
+          }
+        }
+      };
+
+      // 積まれている分 (最大 batch 個) を順に実行する
+      void drain() {
+        const size_t n = std::min(count.load(std::memory_order_acquire), batch);
+        drain_guard guard{this, current(), 0};
+        current() = this;
+        for (size_t i = 0; i < n; i++) {
+          // 登録側が繋ぎ終わるまで待つ (head を入れ替えてから next を書くまでの間のみ)
+          node *next;
+          while ((next = tail->next.load(std::memory_order_acquire)) == nullptr) {
+            std::this_thread::yield();
+          }
+          delete tail;
+          tail = next;
+          task func = std::move(next->func);
+          guard.done ++;
+          if (func) {
+            func();
+          }
+        }
+      }
+    };
+
+    std::shared_ptr<state> state_;
+
+   public:
+    strand(workque *wq, nice_t nice = 0)
+     : state_(std::make_shared<state>(wq, nice))
+    {}
+
+    strand(const strand&) = delete;
+    strand& operator=(const strand&) = delete;
+
+    // 1回の実行で処理する数の上限を設定する. 処理を登録する前に呼び出すこと.
+    strand& with_batch(size_t batch) {
+      state_->batch = batch ? batch : 1;
+      return *this;
+    }
+
+    // 処理を登録する. strandを破棄しても, 登録済みの処理は実行される.
+    template<class F>
+    strand& push(F &&func) {
+      state_->push(task(std::forward<F>(func)));
+      return *this;
+    }
+
+    // 未完了の数 (実行中のものを含む)
+    size_t size() const {
+      return state_->count.load(std::memory_order_relaxed);
+    }
+
+    // 呼び出しスレッドでこのstrandの処理を実行中か
+    bool running_in_this_thread() const {
+      return state::current() == state_.get();
+    }
+  };
+
+}
+}
+
+#endif // LIBSHARAKU_WORKQ_STRAND_HPP
@@ -0,0 +1,260 @@
+/* --
+ *
+ * MIT License
+ * 
+ * Copyright (c) 2023 Abe Takafumi
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef LIBSHARAKU_WORKQ_TASKGRAPH_HPP
+#define LIBSHARAKU_WORKQ_TASKGRAPH_HPP
+
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <initializer_list>
+#include <workq++.hpp>
+
+namespace sharaku {
+namespace workque {
+
+  // 依存関係を持つ処理のグラフ (DAG)
+  //
+  // 処理は追加済みの処理を前提 (predecessor) として指定して追加するため, 循環は生じない.
+  // 各処理は残りの前提の数を持ち, 前提がすべて終わった処理から順にworkqueへ登録する.
+  // 実行開始時にクリティカルパス (最も長い経路) 上の処理を求め, それ以外より優先して実行する.
+  // 処理が例外を投げた場合も終わったものとして後続を進め, 最初の例外を wait() で投げ直す.
+  // 実行の途中で処理を追加しないこと. 終了後は同じグラフを再度実行できる.
+  class taskgraph {
+   public:
+    using node_id = size_t;
+    // 追加できなかった処理の番号
+    static constexpr node_id npos = SIZE_MAX;
+
+   protected:
+    struct node {
+      std::function<void(void)> func;
+      // この処理を前提とする処理
+      std::vector<node_id> succ;
+      // 前提の数, 実行中の残りの前提の数
+      uint32_t ndeps = 0;
+      std::atomic<uint32_t> remaining{0};
+      // 処理の重さ (クリティカルパスの計算に使用する)
+      uint64_t cost = 1;
+      // 実行するnice値
+      nice_t nice = 0;
+    };
+
+    // workqueへ登録した処理から参照するため, taskgraphとは別に確保する
+    struct state {
+      workque *wq;
+      nice_t nice;
+      std::deque<node> nodes;
+      // 未完了の数
+      std::atomic<size_t> left{0};
+      // running, done, error を保護する
+      std::mutex mtx;
+      std::condition_variable cond;
+      bool running = false;
+      std::function<void(void)> done;
+      // 処理が最初に投げた例外
+      std::exception_ptr error;
+
+      state(workque *w, nice_t n) : wq(w), nice(n) {}
+
+      static void schedule(const std::shared_ptr<state> &st, node_id id) {
+        st->wq->push_continuation(st->nodes[id].nice, [st, id]() { st->exec(st, id); });
+      }
+
+      // 処理を実行し, 前提がすべて終わった後続の処理を登録する
+      void exec(const std::shared_ptr<state> &self, node_id id) {
+        node &n = nodes[id];
+        if (n.func) {
+          try {
+            n.func();
+          } catch (...) {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (!error) {
+              error = std::current_exception();
+            }
+          }
+        }
+        for (node_id s : n.succ) {
+          if (nodes[s].remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            schedule(self, s);
+          }
+        }
+        if (left.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          finish();
+        }
+      }
+
+      void finish() {
+        std::function<void(void)> cb;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cb = std::move(done);
+        }
+        if (cb) {
+          cb();
+        }
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          running = false;
+        }
+        cond.notify_all();
+      }
+
+      // クリティカルパス上の処理は nice, それ以外は nice + 1 で実行する.
+      // 番号順に前提が並ぶため, 番号順がそのままトポロジカル順になる.
+      void prioritize() {
+        const size_t n = nodes.size();
+        // 処理の開始までの最長経路 (top), 処理から終わりまでの最長経路 (rank)
+        std::vector<uint64_t> top(n, 0);
+        std::vector<uint64_t> rank(n, 0);
+        for (size_t i = 0; i < n; i++) {
+          for (node_id s : nodes[i].succ) {
+            top[s] = std::max(top[s], top[i] + nodes[i].cost);
+          }
+        }
+        uint64_t longest = 0;
+        for (size_t i = n; i-- > 0;) {
+          uint64_t r = 0;
+          for (node_id s : nodes[i].succ) {
+            r = std::max(r, rank[s]);
+          }
+          rank[i] = r + nodes[i].cost;
+          longest = std::max(longest, top[i] + rank[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+          nodes[i].nice = top[i] + rank[i] == longest ? nice : nice + 1;
+        }
+      }
+    };
+
+    std::shared_ptr<state> state_;
+
+   public:
+    taskgraph(workque *wq, nice_t nice = 0)
+     : state_(std::make_shared<state>(wq, nice))
+    {}
+
+    taskgraph(const taskgraph&) = delete;
+    taskgraph& operator=(const taskgraph&) = delete;
+
+    // 処理を追加し, その番号を返す. deps の処理がすべて終わった後に実行する.
+    // cost は処理の重さの目安で, クリティカルパスを求めるのに使用する.
+    // 追加済みの処理のみ前提にできる. deps に追加されていない番号があれば, 追加せずに npos を返す.
+    template<class F>
+    node_id add(F &&func, const std::vector<node_id> &deps = {}, uint64_t cost = 1) {
+      const node_id id = state_->nodes.size();
+      for (node_id d : deps) {
+        if (d >= id) {
+          return npos;
+        }
+      }
+      state_->nodes.emplace_back();
+      node &n = state_->nodes.back();
+      n.func = std::forward<F>(func);
+      n.cost = cost;
+      for (node_id d : deps) {
+        state_->nodes[d].succ.push_back(id);
+        n.ndeps ++;
+      }
+      return id;
+    }
+
+    template<class F>
+    node_id add(F &&func, std::initializer_list<node_id> deps, uint64_t cost = 1) {
+      return add(std::forward<F>(func), std::vector<node_id>(deps), cost);
+    }
+
+    // 実行を開始する. すべて終わると done を呼び出す.
+    // 実行中の場合は何もせずに false を返す.
+    bool run(std::function<void(void)> done = nullptr) {
+      state &st = *state_;
+      {
+        std::unique_lock<std::mutex> lock(st.mtx);
+        if (st.running) {
+          return false;
+        }
+        st.running = true;
+        st.done = std::move(done);
+        st.error = nullptr;
+      }
+      if (st.nodes.empty()) {
+        st.finish();
+        return true;
+      }
+      st.prioritize();
+      st.left.store(st.nodes.size(), std::memory_order_relaxed);
+      for (node &n : st.nodes) {
+        n.remaining.store(n.ndeps, std::memory_order_relaxed);
+      }
+      for (node_id i = 0; i < st.nodes.size(); i++) {
+        if (st.nodes[i].ndeps == 0) {
+          state::schedule(state_, i);
+        }
+      }
+      return true;
+    }
+
+    // 実行が終わるまで待つ. workqueのワーカーから呼び出す場合, 他に実行するワーカーが必要.
+    // 処理が例外を投げていれば, 最初の例外を投げ直す.
+    void wait() {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      state_->cond.wait(lock, [this]() { return !state_->running; });
+      if (state_->error) {
+        std::rethrow_exception(state_->error);
+      }
+    }
+
+    // 直前の実行で処理が最初に投げた例外. なければ nullptr.
+    std::exception_ptr error() const {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      return state_->error;
+    }
+
+    // 実行中か
+    bool running() const {
+      std::unique_lock<std::mutex> lock(state_->mtx);
+      return state_->running;
+    }
+
+    // 処理の数
+    size_t size() const {
+      return state_->nodes.size();
+    }
+
+    // 処理を実行するnice値 (run() 後. クリティカルパス上の処理は nice, それ以外は nice + 1)
+    nice_t get_nice(node_id id) const {
+      return state_->nodes[id].nice;
+    }
+  };
+
+}
+}
+
+#endif // LIBSHARAKU_WORKQ_TASKGRAPH_HPP
@@ -0,0 +1,137 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include "../include/workq++.hpp"
+#include "../include/co-await.hpp"
+
+namespace co = sharaku::workque::co;
+
+static co::task<int> add_later(sharaku::workque::workque &wq, int a, int b)
+{
+	co_await co::sleep_for(wq, std::chrono::milliseconds(1));
+	co_return a + b;
+}
+
+static co::task<int> throw_later(sharaku::workque::workque &wq)
+{
+	co_await co::schedule(wq);
+	throw std::runtime_error("error");
+	co_return 0;
+}
+
+TEST(test_worqpp_co_await, when_all)
+{
+	RecordProperty("Test",
+		"Await schedule, sleep_for, nested tasks and when_all on sharaku::workque::workque."
+	);
+	RecordProperty("Expected",
+		"- The nested task result is returned by co_await.\n"
+		"- when_all returns the results in the order of the tasks.\n"
+		"- An exception thrown in a task is rethrown by co_await."
+	);
+
+	for (auto mode : {sharaku::workque::sched_mode::global_fifo, sharaku::workque::sched_mode::work_stealing}) {
+		sharaku::workque::workque wq(mode);
+		std::atomic<bool> done{false};
+		int sum = 0;
+		std::vector<int> results;
+		bool thrown = false;
+
+		auto main_task = [&]() -> co::task<void> {
+			co_await co::schedule(wq, 1);
+			sum = co_await add_later(wq, 1, 2);
+
+			std::vector<co::task<int>> tasks;
+			for (int i = 0; i < 100; i++) {
+				tasks.push_back(add_later(wq, i, i));
+			}
+			results = co_await co::when_all(wq, std::move(tasks));
+
+			try {
+				co_await throw_later(wq);
+			} catch (const std::runtime_error &) {
+				thrown = true;
+			}
+			done = true;
+		};
+
+		wq.start(4);
+		co::spawn(wq, main_task());
+		while (!done.load()) {
+			std::this_thread::yield();
+		}
+		wq.stop();
+
+		EXPECT_EQ(3, sum);
+		ASSERT_EQ(100u, results.size());
+		for (int i = 0; i < 100; i++) {
+			EXPECT_EQ(i * 2, results[i]);
+		}
+		EXPECT_TRUE(thrown);
+	}
+}
+
+static co::task<void> count_later(sharaku::workque::workque &wq, std::atomic<int> &count)
+{
+	co_await co::sleep_for(wq, std::chrono::milliseconds(1));
+	count++;
+}
+
+static co::task<void> throw_void_later(sharaku::workque::workque &wq)
+{
+	co_await co::schedule(wq);
+	throw std::logic_error("error");
+}
+
+TEST(test_worqpp_co_await, when_all_exception)
+{
+	RecordProperty("Test",
+		"Run when_all over tasks where one child throws, for both task<int> and task<void>."
+	);
+	RecordProperty("Expected",
+		"- The process does not terminate: when_all rethrows the child's exception to the awaiting coroutine.\n"
+		"- when_all rethrows only after every other child has finished."
+	);
+
+	sharaku::workque::workque wq;
+	std::atomic<bool> done{false};
+	std::atomic<int> count{0};
+	int finished_void = -1;
+	bool thrown_int = false;
+	bool thrown_void = false;
+
+	auto main_task = [&]() -> co::task<void> {
+		std::vector<co::task<int>> tasks;
+		for (int i = 0; i < 10; i++) {
+			tasks.push_back(i == 3 ? throw_later(wq) : add_later(wq, i, i));
+		}
+		try {
+			co_await co::when_all(wq, std::move(tasks));
+		} catch (const std::runtime_error &) {
+			thrown_int = true;
+		}
+
+		std::vector<co::task<void>> vtasks;
+		for (int i = 0; i < 10; i++) {
+			vtasks.push_back(i == 5 ? throw_void_later(wq) : count_later(wq, count));
+		}
+		try {
+			co_await co::when_all(wq, std::move(vtasks));
+		} catch (const std::logic_error &) {
+			thrown_void = true;
+			finished_void = count.load();
+		}
+		done = true;
+	};
+
+	wq.start(4);
+	co::spawn(wq, main_task());
+	while (!done.load()) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_TRUE(thrown_int);
+	EXPECT_TRUE(thrown_void);
+	EXPECT_EQ(9, finished_void);
+}
@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "../include/workq++.hpp"
+#include "../include/co-routine.hpp"
+
+TEST(test_worqpp_coroutine, sequence)
+{
+	RecordProperty("Test",
+		"Run a sharaku::workque::coroutine made of functions, a delayed function, a sub coroutine, a switch and a loop, built as C++11."
+	);
+	RecordProperty("Expected",
+		"- The steps run in order, retry repeats a step and the loop runs its body the given number of times.\n"
+		"- The switch runs only the branch selected by the switch function."
+	);
+
+	sharaku::workque::workque wq;
+	std::mutex mtx;
+	std::vector<int> order;
+	std::atomic<bool> done{false};
+	auto record = [&mtx, &order](int v) {
+		std::lock_guard<std::mutex> lock(mtx);
+		order.push_back(v);
+	};
+	int retries = 0;
+
+	sharaku::workque::coroutine sub(&wq);
+	sub.push([&record]() {
+		record(2);
+		return sharaku::workque::coroutine::result::next;
+	});
+
+	sharaku::workque::coroutine_switch<int> sw(&wq);
+	sw.switch_function([]() { return 1; })
+	  .then(0, [&record]() { record(-1); return sharaku::workque::coroutine::result::next; })
+	  .then(1, [&record]() { record(3); return sharaku::workque::coroutine::result::next; });
+
+	sharaku::workque::coroutine_loop loop(&wq);
+	loop.with_counter(3);
+	loop.push([&record]() {
+		record(4);
+		return sharaku::workque::coroutine::result::next;
+	});
+
+	sharaku::workque::coroutine co(&wq);
+	co.push([&record, &retries]() {
+		if (retries++ < 2) {
+			return sharaku::workque::coroutine::result::retry;
+		}
+		record(1);
+		return sharaku::workque::coroutine::result::next;
+	  })
+	  .push(&sub)
+	  .push(&sw)
+	  .push(&loop)
+	  .push_for(std::chrono::milliseconds(5), [&record, &done]() {
+		record(5);
+		done = true;
+		return sharaku::workque::coroutine::result::next;
+	  });
+
+	wq.start(2);
+	co.start();
+	const auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!done.load() && std::chrono::steady_clock::now() < limit) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	wq.stop();
+
+	EXPECT_TRUE(done.load());
+	EXPECT_EQ(3, retries);
+	std::lock_guard<std::mutex> lock(mtx);
+	EXPECT_EQ((std::vector<int>{1, 2, 3, 4, 4, 4, 5}), order);
+}
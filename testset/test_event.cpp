@@ -4,22 +4,31 @@
 TEST(test_worqpp_event, event)
 {
 	RecordProperty("Test",
-		"Create libsharaku::workque::event."
+		"Create sharaku::workque::event."
 	);
 	RecordProperty("Expected",
-		"- The nice value specified in the constructor can be obtained by casting nice_t\n"
-		"- When executing operator(), the callback specified in the constructor is called with the specified arguments."
+		"- The nice value specified in the constructor can be obtained by get_nice()\n"
+		"- When executing operator(), the callback specified in the constructor is called.\n"
+		"- set_nice() and set_function() replace the nice value and the callback."
 	);
 
 	int called = 0;
 	int arg1 = 0;
 	std::function<void(int)> func = [&called, &arg1](int a){ called++; arg1 = a;};
-	libsharaku::workque::event ev (libsharaku::workque::nice_t(13), func, 97);
-	libsharaku::workque::nice_t nice = libsharaku::workque::nice_t(ev);
+	sharaku::workque::event ev(sharaku::workque::nice_t(13), [&func]() { func(97); });
+	sharaku::workque::nice_t nice = ev.get_nice();
 
 	ev();
 
-	EXPECT_EQ(13, nice);
+	EXPECT_EQ(13u, nice);
 	EXPECT_EQ(1, called);
 	EXPECT_EQ(97, arg1);
+	EXPECT_FALSE(ev.is_pending());
+
+	ev.set_nice(5).set_function([&func]() { func(11); });
+	ev();
+
+	EXPECT_EQ(5u, ev.get_nice());
+	EXPECT_EQ(2, called);
+	EXPECT_EQ(11, arg1);
 }
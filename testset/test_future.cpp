@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include "../include/workq++.hpp"
+#include "../include/wq-future.hpp"
+
+TEST(test_worqpp_future, then)
+{
+	RecordProperty("Test",
+		"Chain continuations with sharaku::workque::future::then on futures returned by push_future, including a throwing stage and a void stage."
+	);
+	RecordProperty("Expected",
+		"- Each continuation receives the previous result and get() returns the final value.\n"
+		"- An exception thrown by a stage skips the following continuations and is rethrown by get().\n"
+		"- A continuation added after completion still runs."
+	);
+
+	sharaku::workque::workque wq;
+	wq.start(2);
+
+	auto f = sharaku::workque::push_future(&wq, []() { return 20; })
+		.then([](int v) { return v + 1; })
+		.then(3, [](int v) { return std::to_string(v * 2); });
+	EXPECT_EQ("42", f.get());
+	EXPECT_TRUE(f.ready());
+
+	std::atomic<int> called{0};
+	auto g = sharaku::workque::push_future(&wq, []() -> int { throw std::runtime_error("stage"); })
+		.then([&called](int v) { called++; return v; });
+	EXPECT_THROW(g.get(), std::runtime_error);
+	EXPECT_EQ(0, called.load());
+
+	auto v = sharaku::workque::push_future(&wq, [&called]() { called++; });
+	v.wait();
+	auto late = v.then([&called]() { called++; return 7; });
+	EXPECT_EQ(7, late.get());
+	EXPECT_EQ(2, called.load());
+	wq.stop();
+}
+
+TEST(test_worqpp_future, when_all_any)
+{
+	RecordProperty("Test",
+		"Combine futures with sharaku::workque::when_all and sharaku::workque::when_any on a multi-threaded sharaku::workque::workque."
+	);
+	RecordProperty("Expected",
+		"- when_all returns the results in order, and the first exception if any input failed.\n"
+		"- when_any returns the position of an input that has completed.\n"
+		"- when_all of an empty vector is ready immediately."
+	);
+
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::work_stealing);
+	wq.start(4);
+
+	std::vector<sharaku::workque::future<int>> fs;
+	for (int i = 0; i < 100; i++) {
+		fs.push_back(sharaku::workque::push_future(&wq, [i]() { return i * i; }));
+	}
+	auto all = sharaku::workque::when_all(fs);
+	const std::vector<int> &r = all.get();
+	ASSERT_EQ(100u, r.size());
+	for (int i = 0; i < 100; i++) {
+		EXPECT_EQ(i * i, r[i]);
+	}
+
+	fs.push_back(sharaku::workque::push_future(&wq, []() -> int { throw std::logic_error("x"); }));
+	EXPECT_THROW(sharaku::workque::when_all(fs).get(), std::logic_error);
+
+	std::atomic<bool> release{false};
+	std::vector<sharaku::workque::future<void>> vs;
+	vs.push_back(sharaku::workque::push_future(&wq, [&release]() {
+		while (!release) {
+			std::this_thread::yield();
+		}
+	}));
+	vs.push_back(sharaku::workque::push_future(&wq, []() {}));
+	EXPECT_EQ(1u, sharaku::workque::when_any(vs).get());
+	release = true;
+	sharaku::workque::when_all(vs).get();
+
+	EXPECT_TRUE(sharaku::workque::when_all(std::vector<sharaku::workque::future<void>>()).ready());
+	wq.stop();
+}
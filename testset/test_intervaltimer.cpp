@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <memory>
+#include "../include/workq++.hpp"
+#include "../include/wq-intervatimer.hpp"
+
+TEST(test_worqpp_intervaltimer, interval)
+{
+	RecordProperty("Test",
+		"Run sharaku::workque::intervaltimer with two functions, then stop(), resume() and stop() it again."
+	);
+	RecordProperty("Expected",
+		"- Every registered function runs on each tick.\n"
+		"- No tick runs after stop() returns, and resume() starts the ticks again."
+	);
+
+	sharaku::workque::workque wq;
+	wq.start(2);
+	std::atomic<int> a{0};
+	std::atomic<int> b{0};
+	sharaku::workque::intervaltimer timer(&wq);
+	timer.with_interval(std::chrono::milliseconds(2))
+	     .push([&a]() { a++; })
+	     .push([&b]() { b++; });
+	timer.start();
+	while (b.load() < 5) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	timer.stop();
+	const int stopped = a.load();
+	EXPECT_EQ(stopped, b.load());
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(stopped, a.load());
+
+	timer.resume();
+	while (a.load() < stopped + 3) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	timer.stop();
+	wq.stop();
+}
+
+TEST(test_worqpp_intervaltimer, stop_waits_for_tick)
+{
+	RecordProperty("Test",
+		"Destroy a sharaku::workque::intervaltimer while its tick is running, and stop one from inside its own tick."
+	);
+	RecordProperty("Expected",
+		"- The destructor returns only after the running tick has finished.\n"
+		"- stop() called from inside the tick returns without waiting for that tick."
+	);
+
+	sharaku::workque::workque wq;
+	wq.start(2);
+	{
+		std::atomic<bool> running{false};
+		std::atomic<bool> finished{false};
+		std::unique_ptr<sharaku::workque::intervaltimer> timer(new sharaku::workque::intervaltimer(&wq));
+		timer->with_interval(std::chrono::milliseconds(1)).push([&running, &finished]() {
+			if (running.exchange(true)) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(30));
+			finished = true;
+		});
+		timer->start();
+		while (!running.load()) {
+			std::this_thread::yield();
+		}
+		timer.reset();
+		EXPECT_TRUE(finished.load());
+	}
+	{
+		std::atomic<int> called{0};
+		sharaku::workque::intervaltimer timer(&wq);
+		timer.with_interval(std::chrono::milliseconds(1)).push([&called, &timer]() {
+			called++;
+			timer.stop();
+		});
+		timer.start();
+		while (called.load() < 1) {
+			std::this_thread::yield();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		EXPECT_EQ(1, called.load());
+	}
+	wq.stop();
+}
@@ -0,0 +1,145 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include "../include/workq++.hpp"
+#include "../include/wq-parallel.hpp"
+
+TEST(test_worqpp_parallel, parallel_for)
+{
+	RecordProperty("Test",
+		"Run sharaku::workque::parallel_for over a large range on a workque with no workers, and on multi-threaded workques in each scheduling mode, including a nested call from a worker."
+	);
+	RecordProperty("Expected",
+		"- Every index is visited exactly once.\n"
+		"- Without workers, the calling thread runs the whole range and returns.\n"
+		"- A nested parallel_for called from a worker completes."
+	);
+
+	const size_t n = 100000;
+	{
+		sharaku::workque::workque wq;
+		std::vector<int> hit(n, 0);
+		sharaku::workque::parallel_for(&wq, 0, n, [&hit](size_t i) { hit[i]++; });
+		EXPECT_EQ(n, (size_t)std::count(hit.begin(), hit.end(), 1));
+	}
+
+	for (auto mode : {sharaku::workque::sched_mode::global_fifo,
+	                  sharaku::workque::sched_mode::work_stealing}) {
+		sharaku::workque::workque wq(mode);
+		wq.start(4);
+		std::vector<std::atomic<int>> hit(n);
+		sharaku::workque::parallel_for(&wq, 0, n, [&hit](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++) {
+				hit[i]++;
+			}
+		}, 64);
+		size_t once = 0;
+		for (auto &h : hit) {
+			once += h.load() == 1;
+		}
+		EXPECT_EQ(n, once);
+
+		std::atomic<size_t> total{0};
+		std::atomic<bool> done{false};
+		wq.push([&]() {
+			sharaku::workque::parallel_for(&wq, 0, 64, [&](size_t) {
+				sharaku::workque::parallel_for(&wq, 0, 100, [&](size_t) { total++; });
+			});
+			done = true;
+		});
+		for (int i = 0; i < 5000 && !done; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		EXPECT_TRUE(done.load());
+		EXPECT_EQ(6400u, total.load());
+		wq.stop();
+	}
+}
+
+TEST(test_worqpp_parallel, parallel_reduce)
+{
+	RecordProperty("Test",
+		"Sum a range with sharaku::workque::parallel_reduce on a multi-threaded sharaku::workque::workque, and on an empty range."
+	);
+	RecordProperty("Expected",
+		"- The result equals the sequential sum.\n"
+		"- An empty range returns the identity."
+	);
+
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::work_stealing);
+	wq.start(4);
+	const size_t n = 1000000;
+	uint64_t sum = sharaku::workque::parallel_reduce(&wq, 1, n + 1, uint64_t(0),
+		[](size_t b, size_t e, uint64_t &acc) {
+			for (size_t i = b; i < e; i++) {
+				acc += i;
+			}
+		},
+		[](uint64_t a, uint64_t b) { return a + b; }, 256);
+	EXPECT_EQ(uint64_t(n) * (n + 1) / 2, sum);
+
+	EXPECT_EQ(7, sharaku::workque::parallel_reduce(&wq, 5, 5, 7,
+		[](size_t, size_t, int &acc) { acc = 0; },
+		[](int a, int b) { return a + b; }));
+	wq.stop();
+}
+
+TEST(test_worqpp_parallel, exception)
+{
+	RecordProperty("Test",
+		"Throw from the body of sharaku::workque::parallel_for on the calling thread, and on a worker that took a range split off by the caller."
+	);
+	RecordProperty("Expected",
+		"- The exception is rethrown from parallel_for on the caller once every running range has finished.\n"
+		"- The rest of the range is not run after the exception.\n"
+		"- The workque keeps running events afterwards."
+	);
+
+	{
+		sharaku::workque::workque wq;
+		size_t visited = 0;
+		EXPECT_THROW(sharaku::workque::parallel_for(&wq, 0, 1000, [&visited](size_t i) {
+			if (i == 10) {
+				throw std::runtime_error("caller");
+			}
+			visited++;
+		}), std::runtime_error);
+		EXPECT_EQ(10u, visited);
+	}
+	{
+		sharaku::workque::workque wq;
+		wq.start(2);
+		while (wq.idle_workers() == 0) {
+			std::this_thread::yield();
+		}
+		const std::thread::id caller = std::this_thread::get_id();
+		std::atomic<bool> thrown{false};
+		std::string what;
+		try {
+			sharaku::workque::parallel_for(&wq, 0, 1000, [&](size_t b, size_t) {
+				if (std::this_thread::get_id() != caller) {
+					thrown = true;
+					throw std::runtime_error("worker");
+				}
+				// 最初の範囲の実行中に後半をワーカーへ渡しているため, ワーカーが投げるまで待つ
+				for (int i = 0; b == 0 && i < 5000 && !thrown; i++) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			}, 10);
+		} catch (const std::runtime_error &e) {
+			what = e.what();
+		}
+		EXPECT_EQ("worker", what);
+
+		std::atomic<bool> done{false};
+		wq.push([&done]() { done = true; });
+		while (!done.load()) {
+			std::this_thread::yield();
+		}
+		wq.stop();
+	}
+}
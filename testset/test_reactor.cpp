@@ -0,0 +1,239 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../include/workq++.hpp"
+#include "../include/wq-reactor.hpp"
+
+TEST(test_worqpp_reactor, pipe)
+{
+	RecordProperty("Test",
+		"Register the read end of a pipe with sharaku::workque::reactor and write to it from another thread."
+	);
+	RecordProperty("Expected",
+		"- The callback runs on a worker with EPOLLIN for every write.\n"
+		"- The callback of one fd never overlaps with itself.\n"
+		"- After remove() the callback is no longer called."
+	);
+
+	int fds[2];
+	ASSERT_EQ(0, pipe(fds));
+
+	sharaku::workque::workque wq;
+	wq.start(2);
+	sharaku::workque::reactor r(&wq);
+	ASSERT_TRUE(r.valid());
+
+	std::atomic<int> bytes{0};
+	std::atomic<int> running{0};
+	std::atomic<int> overlapped{0};
+	ASSERT_TRUE(r.add(fds[0], EPOLLIN, [&](uint32_t ev) {
+		if (running.fetch_add(1) != 0) {
+			overlapped++;
+		}
+		EXPECT_TRUE(ev & EPOLLIN);
+		char buf[64];
+		const ssize_t n = read(fds[0], buf, sizeof(buf));
+		if (n > 0) {
+			bytes += static_cast<int>(n);
+		}
+		running.fetch_sub(1);
+	}));
+	EXPECT_FALSE(r.add(fds[0], EPOLLIN, [](uint32_t) {}));
+	EXPECT_EQ(1u, r.size());
+
+	const int n = 100;
+	for (int i = 0; i < n; i++) {
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		if (i % 10 == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (bytes.load() < n && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::yield();
+	}
+	EXPECT_EQ(n, bytes.load());
+	EXPECT_EQ(0, overlapped.load());
+
+	EXPECT_TRUE(r.remove(fds[0]));
+	EXPECT_FALSE(r.remove(fds[0]));
+	ASSERT_EQ(1, write(fds[1], "x", 1));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(n, bytes.load());
+
+	wq.stop();
+	close(fds[0]);
+	close(fds[1]);
+}
+
+TEST(test_worqpp_reactor, socketpair)
+{
+	RecordProperty("Test",
+		"Echo messages over a socketpair with sharaku::workque::reactor on a single-threaded sharaku::workque::workque run()."
+	);
+	RecordProperty("Expected",
+		"- The worker waits in epoll_wait while there are no events and is woken by readiness.\n"
+		"- Events pushed from another thread wake the worker waiting in epoll_wait.\n"
+		"- Timers still fire while the worker waits in epoll_wait."
+	);
+
+	int sv[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+	sharaku::workque::workque wq;
+	sharaku::workque::reactor r(&wq);
+	std::string received;
+	std::atomic<bool> pushed{false};
+	bool timer = false;
+
+	// 相手側: 受け取ったものをそのまま返す
+	r.add(sv[1], EPOLLIN, 1, [&](uint32_t) {
+		char buf[64];
+		const ssize_t n = read(sv[1], buf, sizeof(buf));
+		if (n > 0) {
+			(void)!write(sv[1], buf, n);
+		}
+	});
+	r.add(sv[0], EPOLLIN, [&](uint32_t) {
+		char buf[64];
+		const ssize_t n = read(sv[0], buf, sizeof(buf));
+		if (n > 0) {
+			received.append(buf, n);
+		}
+		if (received == "ping") {
+			wq.quit();
+		}
+	});
+	wq.push_for(std::chrono::milliseconds(5), 0, [&]() { timer = true; });
+
+	std::thread th([&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		wq.push(0, [&]() {
+			pushed = true;
+			(void)!write(sv[0], "ping", 4);
+		});
+	});
+	wq.run();
+	th.join();
+
+	EXPECT_TRUE(timer);
+	EXPECT_TRUE(pushed.load());
+	EXPECT_EQ("ping", received);
+	r.remove(sv[0]);
+	r.remove(sv[1]);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+TEST(test_worqpp_reactor, remove_waits)
+{
+	RecordProperty("Test",
+		"Call sharaku::workque::reactor::remove() while the fd's callback is running, and from inside a callback."
+	);
+	RecordProperty("Expected",
+		"- remove() returns only after the running callback has finished.\n"
+		"- remove() called from inside the callback returns without waiting for it.\n"
+		"- Destroying the reactor waits for a running callback as well."
+	);
+
+	int fds[2];
+	ASSERT_EQ(0, pipe(fds));
+
+	sharaku::workque::workque wq;
+	wq.start(2);
+	{
+		sharaku::workque::reactor r(&wq);
+		ASSERT_TRUE(r.valid());
+
+		std::atomic<bool> running{false};
+		std::atomic<bool> finished{false};
+		ASSERT_TRUE(r.add(fds[0], EPOLLIN, [&](uint32_t) {
+			running = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(30));
+			finished = true;
+		}));
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		while (!running.load()) {
+			std::this_thread::yield();
+		}
+		EXPECT_TRUE(r.remove(fds[0]));
+		EXPECT_TRUE(finished.load());
+
+		char buf[8];
+		ASSERT_EQ(1, read(fds[0], buf, sizeof(buf)));
+		std::atomic<int> called{0};
+		ASSERT_TRUE(r.add(fds[0], EPOLLIN, [&](uint32_t) {
+			called++;
+			EXPECT_TRUE(r.remove(fds[0]));
+		}));
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		while (called.load() < 1) {
+			std::this_thread::yield();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		EXPECT_EQ(1, called.load());
+		EXPECT_EQ(0u, r.size());
+		ASSERT_EQ(1, read(fds[0], buf, sizeof(buf)));
+	}
+	{
+		std::atomic<bool> running{false};
+		std::atomic<bool> finished{false};
+		{
+			sharaku::workque::reactor r(&wq);
+			ASSERT_TRUE(r.add(fds[0], EPOLLIN, [&](uint32_t) {
+				running = true;
+				std::this_thread::sleep_for(std::chrono::milliseconds(30));
+				finished = true;
+			}));
+			ASSERT_EQ(1, write(fds[1], "x", 1));
+			while (!running.load()) {
+				std::this_thread::yield();
+			}
+		}
+		EXPECT_TRUE(finished.load());
+	}
+
+	wq.stop();
+	close(fds[0]);
+	close(fds[1]);
+}
+
+TEST(test_worqpp_reactor, timer_precision)
+{
+	RecordProperty("Test",
+		"Push 300us timers one by one to a sharaku::workque::workque with a 50us timer wheel whose only worker waits in the reactor."
+	);
+	RecordProperty("Expected",
+		"- The worker waiting in epoll keeps sub-millisecond timer precision (the wait is not rounded up to whole milliseconds)."
+	);
+
+	sharaku::workque::workque wq;
+	wq.with_spin(std::chrono::nanoseconds(0)).with_timer_wheel(std::chrono::microseconds(50));
+	wq.start(1);
+	sharaku::workque::reactor r(&wq);
+	ASSERT_TRUE(r.valid());
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+	const int n = 21;
+	std::vector<int64_t> late;
+	for (int i = 0; i < n; i++) {
+		std::atomic<int64_t> l{-1};
+		const auto delay = std::chrono::microseconds(300);
+		const auto due = std::chrono::steady_clock::now() + delay;
+		wq.push_for(delay, 0, [&l, due]() {
+			l = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - due).count();
+		});
+		while (l.load() < 0) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		late.push_back(l.load());
+	}
+	wq.stop();
+
+	// 1ms単位に切り上げて待つと, 遅れは700us程度になる
+	std::sort(late.begin(), late.end());
+	EXPECT_LT(late[n / 2], 500);
+}
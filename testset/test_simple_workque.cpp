@@ -0,0 +1,27 @@
+#include <gtest/gtest.h>
+#include "../include/workq++.hpp"
+
+TEST(test_worqpp_simple_workque, run)
+{
+	RecordProperty("Test",
+		"Run sharaku::workque::workque on the calling thread with run() and stop it from an event."
+	);
+	RecordProperty("Expected",
+		"- Events are executed in nice order, then in push order.\n"
+		"- A delayed event is executed after the others, and quit() from it returns from run()."
+	);
+
+	sharaku::workque::workque wq;
+	std::vector<int> order;
+
+	wq.push_for(std::chrono::milliseconds(10), 0, [&wq, &order]() {
+		order.push_back(4);
+		wq.quit();
+	});
+	wq.push(1, [&order]() { order.push_back(3); });
+	wq.push(0, [&order]() { order.push_back(1); });
+	wq.push(0, [&order]() { order.push_back(2); });
+	wq.run();
+
+	EXPECT_EQ((std::vector<int>{1, 2, 3, 4}), order);
+}
@@ -0,0 +1,155 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+#include "../include/workq++.hpp"
+#include "../include/wq-strand.hpp"
+
+TEST(test_worqpp_strand, order)
+{
+	RecordProperty("Test",
+		"Push events to several sharaku::workque::strand objects on a multi-threaded sharaku::workque::workque."
+	);
+	RecordProperty("Expected",
+		"- Events of each strand are executed in push order.\n"
+		"- Events of the same strand never overlap.\n"
+		"- running_in_this_thread() is true only inside the strand's events."
+	);
+
+	sharaku::workque::workque wq;
+	wq.start(4);
+
+	const int nstrands = 8;
+	const int n = 500;
+	std::vector<std::unique_ptr<sharaku::workque::strand>> strands;
+	std::vector<std::vector<int>> order(nstrands);
+	std::vector<std::atomic<int>> running(nstrands);
+	std::atomic<int> overlapped{0};
+	std::atomic<int> outside{0};
+	std::atomic<int> called{0};
+	for (int s = 0; s < nstrands; s++) {
+		running[s].store(0);
+		strands.emplace_back(new sharaku::workque::strand(&wq));
+		strands.back()->with_batch(16);
+	}
+
+	for (int i = 0; i < n; i++) {
+		for (int s = 0; s < nstrands; s++) {
+			sharaku::workque::strand *st = strands[s].get();
+			st->push([&, s, i, st]() {
+				if (running[s].fetch_add(1) != 0) {
+					overlapped++;
+				}
+				if (!st->running_in_this_thread()) {
+					outside++;
+				}
+				order[s].push_back(i);
+				running[s].fetch_sub(1);
+				called++;
+			});
+		}
+	}
+	EXPECT_FALSE(strands[0]->running_in_this_thread());
+	while (called.load() < n * nstrands) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ(0, overlapped.load());
+	EXPECT_EQ(0, outside.load());
+	for (int s = 0; s < nstrands; s++) {
+		ASSERT_EQ(static_cast<size_t>(n), order[s].size());
+		for (int i = 0; i < n; i++) {
+			EXPECT_EQ(i, order[s][i]);
+		}
+		EXPECT_EQ(0u, strands[s]->size());
+	}
+}
+
+TEST(test_worqpp_strand, destroy)
+{
+	RecordProperty("Test",
+		"Destroy a sharaku::workque::strand while its events are still queued."
+	);
+	RecordProperty("Expected",
+		"- Queued events are executed after the strand is destroyed."
+	);
+
+	sharaku::workque::workque wq;
+	std::vector<int> order;
+	{
+		sharaku::workque::strand st(&wq);
+		for (int i = 0; i < 10; i++) {
+			st.push([&order, i]() { order.push_back(i); });
+		}
+		EXPECT_EQ(10u, st.size());
+	}
+	wq.push(1, [&wq]() { wq.quit(); });
+	wq.run();
+
+	EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}), order);
+}
+
+TEST(test_worqpp_strand, exception)
+{
+	RecordProperty("Test",
+		"Run a sharaku::workque::strand whose event throws, on a single-threaded sharaku::workque::workque run()."
+	);
+	RecordProperty("Expected",
+		"- The exception propagates out of run().\n"
+		"- The strand stays usable: the events after the throwing one, and events pushed later, are executed."
+	);
+
+	sharaku::workque::workque wq;
+	sharaku::workque::strand st(&wq);
+	std::vector<int> order;
+	st.push([&order]() { order.push_back(0); });
+	st.push([]() { throw std::runtime_error("strand"); });
+	st.push([&order]() { order.push_back(1); });
+	st.push([&wq]() { wq.quit(); });
+	EXPECT_THROW(wq.run(), std::runtime_error);
+	EXPECT_FALSE(st.running_in_this_thread());
+	wq.run();
+	EXPECT_EQ(0u, st.size());
+
+	st.push([&order]() { order.push_back(2); });
+	st.push([&wq]() { wq.quit(); });
+	wq.run();
+
+	EXPECT_EQ((std::vector<int>{0, 1, 2}), order);
+}
+
+TEST(test_worqpp_strand, capacity)
+{
+	RecordProperty("Test",
+		"Push events to a sharaku::workque::strand while its sharaku::workque::workque is full under a capacity of 1 with overflow_policy::reject."
+	);
+	RecordProperty("Expected",
+		"- Ordinary push() is rejected, but the strand's own scheduling is not subject to the capacity.\n"
+		"- Every event pushed to the strand is executed, also after the strand has been drained once."
+	);
+
+	sharaku::workque::workque wq;
+	sharaku::workque::capacity_config cfg;
+	cfg.total = 1;
+	cfg.policy = sharaku::workque::overflow_policy::reject;
+	wq.with_capacity(cfg);
+
+	std::vector<int> order;
+	sharaku::workque::strand st(&wq);
+	for (int round = 0; round < 2; round++) {
+		std::atomic<int> rejected{0};
+		wq.push(0, []() {});
+		wq.push(0, [&rejected]() { rejected++; });
+		for (int i = 0; i < 3; i++) {
+			st.push([&order, round, i]() { order.push_back(round * 10 + i); });
+		}
+		st.push([&wq]() { wq.quit(); });
+		wq.run();
+		EXPECT_EQ(0, rejected.load());
+		EXPECT_EQ(0u, st.size());
+	}
+
+	EXPECT_EQ((std::vector<int>{0, 1, 2, 10, 11, 12}), order);
+	EXPECT_EQ(2u, wq.snapshot().rejected);
+}
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+#include "../include/workq++.hpp"
+
+// ムーブのみ可能な関数オブジェクト (C++11 のラムダはムーブでキャプチャできない)
+struct add_owned {
+	int *out;
+	std::unique_ptr<int> p;
+	void operator()() { *out += *p; }
+};
+
+struct push_owned {
+	std::vector<int> *out;
+	std::unique_ptr<int> p;
+	void operator()() { out->push_back(*p); }
+};
+
+TEST(test_worqpp_task, task)
+{
+	RecordProperty("Test",
+		"Create sharaku::workque::task from small and large callables and move it around."
+	);
+	RecordProperty("Expected",
+		"- A task constructed from a callable invokes it, including move-only captures.\n"
+		"- Moving a task transfers the callable and leaves the source empty.\n"
+		"- Captured objects are destroyed exactly once when the task is destroyed.\n"
+		"- A task constructed from an empty std::function is empty."
+	);
+
+	int called = 0;
+	auto counter = std::make_shared<int>(0);
+	{
+		std::unique_ptr<int> p(new int(5));
+		sharaku::workque::task small(add_owned{&called, std::move(p)});
+		char pad[sharaku::workque::task::inline_size * 2] = {1};
+		sharaku::workque::task large([&called, pad, counter]() { called += pad[0]; });
+		EXPECT_EQ(2, counter.use_count());
+
+		small();
+		large();
+		EXPECT_EQ(6, called);
+
+		sharaku::workque::task moved(std::move(large));
+		EXPECT_FALSE(static_cast<bool>(large));
+		EXPECT_TRUE(static_cast<bool>(moved));
+		moved();
+		EXPECT_EQ(7, called);
+
+		small = std::move(moved);
+		small();
+		EXPECT_EQ(8, called);
+		EXPECT_EQ(2, counter.use_count());
+	}
+	EXPECT_EQ(1, counter.use_count());
+
+	sharaku::workque::task empty(std::function<void(void)>(nullptr));
+	EXPECT_FALSE(static_cast<bool>(empty));
+}
+
+TEST(test_worqpp_task, fire_and_forget)
+{
+	RecordProperty("Test",
+		"Push move-only callables to sharaku::workque::workque without a cancellation handle."
+	);
+	RecordProperty("Expected",
+		"- Callables are executed in nice order, and in push order for the same nice.\n"
+		"- Delayed callables are executed after the immediate ones."
+	);
+
+	sharaku::workque::workque wq;
+	std::vector<int> order;
+	std::unique_ptr<int> p(new int(3));
+	wq.push_for(std::chrono::milliseconds(10), 0, [&wq, &order]() { order.push_back(9); wq.quit(); });
+	wq.push(2, push_owned{&order, std::move(p)});
+	wq.push(1, [&order]() { order.push_back(1); });
+	wq.push(1, [&order]() { order.push_back(2); });
+	wq.run();
+
+	EXPECT_EQ((std::vector<int>{1, 2, 3, 9}), order);
+}
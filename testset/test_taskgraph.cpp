@@ -0,0 +1,150 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+#include <thread>
+#include "../include/workq++.hpp"
+#include "../include/wq-taskgraph.hpp"
+
+TEST(test_worqpp_taskgraph, order)
+{
+	RecordProperty("Test",
+		"Run a sharaku::workque::taskgraph of thousands of nodes with random predecessors on a multi-threaded sharaku::workque::workque, twice."
+	);
+	RecordProperty("Expected",
+		"- Every node runs exactly once per run, after all of its predecessors.\n"
+		"- The done callback is called once per run and wait() returns after all nodes finish.\n"
+		"- run() fails while the graph is running."
+	);
+
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::work_stealing);
+	wq.start(4);
+
+	const size_t n = 3000;
+	sharaku::workque::taskgraph graph(&wq);
+	std::vector<std::vector<sharaku::workque::taskgraph::node_id>> deps(n);
+	std::vector<std::atomic<uint64_t>> seq(n);
+	std::atomic<uint64_t> clock{0};
+	std::atomic<bool> gate{false};
+	uint32_t r = 12345;
+	for (size_t i = 0; i < n; i++) {
+		for (int k = 0; i && k < 3; k++) {
+			r = r * 1103515245 + 12345;
+			deps[i].push_back((r >> 8) % i);
+		}
+		graph.add([&seq, &clock, &gate, i]() {
+			// 実行中に run() を呼び出すまで終わらないようにする
+			while (i == 0 && !gate) {
+				std::this_thread::yield();
+			}
+			seq[i].store(++clock);
+		}, deps[i]);
+	}
+	EXPECT_EQ(n, graph.size());
+
+	for (int round = 0; round < 2; round++) {
+		for (auto &s : seq) {
+			s.store(0);
+		}
+		std::atomic<int> done{0};
+		gate = false;
+		EXPECT_TRUE(graph.run([&done]() { done++; }));
+		EXPECT_FALSE(graph.run());
+		gate = true;
+		graph.wait();
+		EXPECT_FALSE(graph.running());
+		EXPECT_EQ(1, done.load());
+
+		int unordered = 0;
+		int missing = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (seq[i].load() == 0) {
+				missing++;
+			}
+			for (auto d : deps[i]) {
+				if (seq[d].load() >= seq[i].load()) {
+					unordered++;
+				}
+			}
+		}
+		EXPECT_EQ(0, missing);
+		EXPECT_EQ(0, unordered);
+	}
+	wq.stop();
+}
+
+TEST(test_worqpp_taskgraph, critical_path)
+{
+	RecordProperty("Test",
+		"Run a sharaku::workque::taskgraph with a long chain of heavy nodes and independent light nodes on a single worker."
+	);
+	RecordProperty("Expected",
+		"- Nodes on the critical path run at the graph's nice value and the others one level lower.\n"
+		"- The head of the critical path runs before the light nodes added earlier."
+	);
+
+	sharaku::workque::workque wq;
+	sharaku::workque::taskgraph graph(&wq, 2);
+	std::vector<int> order;
+	std::vector<sharaku::workque::taskgraph::node_id> light;
+	for (int i = 0; i < 4; i++) {
+		light.push_back(graph.add([&order, i]() { order.push_back(100 + i); }));
+	}
+	auto a = graph.add([&order]() { order.push_back(0); }, {}, 10);
+	auto b = graph.add([&order]() { order.push_back(1); }, {a}, 10);
+	auto c = graph.add([&order]() { order.push_back(2); }, {b, light[0]}, 10);
+
+	EXPECT_TRUE(graph.run());
+	EXPECT_EQ(2u, graph.get_nice(a));
+	EXPECT_EQ(2u, graph.get_nice(b));
+	EXPECT_EQ(2u, graph.get_nice(c));
+	for (auto id : light) {
+		EXPECT_EQ(3u, graph.get_nice(id));
+	}
+
+	wq.start(1);
+	graph.wait();
+	wq.stop();
+	ASSERT_EQ(7u, order.size());
+	EXPECT_EQ(0, order[0]);
+	EXPECT_EQ(1, order[1]);
+}
+
+TEST(test_worqpp_taskgraph, errors)
+{
+	RecordProperty("Test",
+		"Add a node that depends on a node not yet added, and run a sharaku::workque::taskgraph whose node throws."
+	);
+	RecordProperty("Expected",
+		"- add() with an unknown dependency returns npos and does not add the node.\n"
+		"- A throwing node counts as finished: its successors run, wait() returns and rethrows the exception.\n"
+		"- error() reports the exception, and the next run() clears it."
+	);
+
+	sharaku::workque::workque wq;
+	sharaku::workque::taskgraph graph(&wq);
+	std::atomic<int> called{0};
+	bool fail = true;
+	auto a = graph.add([&called, &fail]() {
+		called++;
+		if (fail) {
+			throw std::runtime_error("node a");
+		}
+	});
+	EXPECT_TRUE(graph.add([]() {}, {a + 1}) == sharaku::workque::taskgraph::npos);
+	EXPECT_EQ(1u, graph.size());
+	graph.add([&called]() { called++; }, {a});
+
+	wq.start(2);
+	EXPECT_TRUE(graph.run());
+	EXPECT_THROW(graph.wait(), std::runtime_error);
+	EXPECT_EQ(2, called.load());
+	EXPECT_TRUE(graph.error() != nullptr);
+
+	fail = false;
+	EXPECT_TRUE(graph.run());
+	EXPECT_NO_THROW(graph.wait());
+	EXPECT_EQ(4, called.load());
+	EXPECT_TRUE(graph.error() == nullptr);
+	wq.stop();
+}
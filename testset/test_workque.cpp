@@ -0,0 +1,960 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include "../include/workq++.hpp"
+
+TEST(test_worqpp_workque, work_stealing)
+{
+	RecordProperty("Test",
+		"Push events from outside and from inside workers of a work-stealing sharaku::workque::workque."
+	);
+	RecordProperty("Expected",
+		"- Every event pushed from any thread is executed exactly once.\n"
+		"- stop() returns after all workers exit."
+	);
+
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::work_stealing);
+	std::atomic<int> called{0};
+	const int n = 1000;
+
+	wq.start(4);
+	for (int i = 0; i < n; i++) {
+		wq.push(i % 3, [&wq, &called]() {
+			called++;
+			for (int j = 0; j < 10; j++) {
+				wq.push(j, [&called]() { called++; });
+			}
+		});
+	}
+	while (called.load() < n * 11) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ(n * 11, called.load());
+}
+
+TEST(test_worqpp_workque, wakeup_stats)
+{
+	RecordProperty("Test",
+		"Push events to a multi-threaded sharaku::workque::workque while its workers are parked, busy and spinning, and read get_wakeup_stats()."
+	);
+	RecordProperty("Expected",
+		"- An event pushed while the workers are parked wakes one of them and is counted in wakeups.\n"
+		"- A burst pushed while every worker is busy wakes nobody and is counted in wakeups_skipped.\n"
+		"- Events that arrive while the workers spin are picked up without parking and counted in spin_hits."
+	);
+
+	for (auto mode : {sharaku::workque::sched_mode::global_fifo,
+	                  sharaku::workque::sched_mode::work_stealing}) {
+		sharaku::workque::workque wq(mode);
+		wq.with_spin(std::chrono::nanoseconds(0));
+		wq.start(2);
+		std::atomic<int> done{0};
+		auto wait_done = [&done](int n) {
+			const auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (done.load() < n && std::chrono::steady_clock::now() < limit) {
+				std::this_thread::yield();
+			}
+			return done.load() >= n;
+		};
+
+		// 両方のワーカーが待ちに入ってから登録する
+		const auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (wq.get_wakeup_stats().parks < 2 && std::chrono::steady_clock::now() < limit) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		const sharaku::workque::wakeup_stats parked = wq.get_wakeup_stats();
+		wq.push([&done]() { done++; });
+		ASSERT_TRUE(wait_done(1));
+		EXPECT_GT(wq.get_wakeup_stats().wakeups, parked.wakeups);
+
+		// すべてのワーカーが処理中の間に積んだ分は起こさない
+		std::atomic<bool> release{false};
+		std::atomic<int> started{0};
+		for (int i = 0; i < 2; i++) {
+			wq.push([&release, &started]() {
+				started++;
+				while (!release.load()) {
+					std::this_thread::yield();
+				}
+			});
+		}
+		while (started.load() < 2) {
+			std::this_thread::yield();
+		}
+		const sharaku::workque::wakeup_stats busy = wq.get_wakeup_stats();
+		for (int i = 0; i < 100; i++) {
+			wq.push([&done]() { done++; });
+		}
+		const sharaku::workque::wakeup_stats burst = wq.get_wakeup_stats();
+		EXPECT_EQ(busy.wakeups, burst.wakeups);
+		EXPECT_GE(burst.wakeups_skipped - busy.wakeups_skipped, 100u);
+		release = true;
+		ASSERT_TRUE(wait_done(101));
+
+		// スピン中に届いた処理は待ちに入らずに取り出す
+		wq.with_spin(std::chrono::seconds(1));
+		const sharaku::workque::wakeup_stats before = wq.get_wakeup_stats();
+		for (int i = 0; i < 10; i++) {
+			wq.push([&done]() { done++; });
+			ASSERT_TRUE(wait_done(102 + i));
+		}
+		EXPECT_GT(wq.get_wakeup_stats().spin_hits, before.spin_hits);
+		wq.stop();
+	}
+}
+
+TEST(test_worqpp_workque, event_pool)
+{
+	RecordProperty("Test",
+		"Create events from the pool of sharaku::workque::workque and release them repeatedly."
+	);
+	RecordProperty("Expected",
+		"- Events created by make_event() run their function.\n"
+		"- Released blocks are reused, so slabs are not allocated for every event."
+	);
+
+	sharaku::workque::workque wq;
+	int called = 0;
+
+	for (int i = 0; i < 1000; i++) {
+		std::shared_ptr<sharaku::workque::event> ev = wq.make_event(0, [&called]() { called++; });
+		(*ev)();
+	}
+
+	sharaku::workque::pool_stats st = wq.get_pool_stats();
+	EXPECT_EQ(1000, called);
+	EXPECT_EQ(1000u, st.allocs);
+	EXPECT_EQ(1000u, st.frees);
+	EXPECT_EQ(1u, st.slab_allocs);
+	EXPECT_EQ(0u, st.heap_fallbacks);
+}
+
+TEST(test_worqpp_workque, cancel)
+{
+	RecordProperty("Test",
+		"Cancel events waiting in the FIFO, in the timer, and running in sharaku::workque::workque."
+	);
+	RecordProperty("Expected",
+		"- cancel() returns true and the event is not executed while it is waiting in the FIFO or the timer.\n"
+		"- cancel() returns false once the event has started.\n"
+		"- An event that is already waiting is not queued twice."
+	);
+
+	sharaku::workque::workque wq;
+	std::atomic<int> called{0};
+	std::function<void(void)> func = [&called]() { called++; };
+
+	std::shared_ptr<sharaku::workque::event> ev1 = wq.push(0, std::function<void(void)>(func));
+	std::shared_ptr<sharaku::workque::event> ev2 = wq.push_for(std::chrono::milliseconds(10), std::function<void(void)>(func));
+	std::shared_ptr<sharaku::workque::event> ev3 = wq.push(0, std::function<void(void)>(func));
+	wq.push(ev3);
+	EXPECT_TRUE(ev1->is_pending());
+	EXPECT_TRUE(wq.cancel(ev1));
+	EXPECT_FALSE(wq.cancel(ev1));
+	EXPECT_TRUE(wq.cancel(ev2));
+
+	wq.start(1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	EXPECT_EQ(1, called.load());
+	EXPECT_FALSE(wq.cancel(ev3));
+
+	// 取消後に登録し直したものは実行される
+	wq.push(ev1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	wq.stop();
+
+	EXPECT_EQ(2, called.load());
+}
+
+TEST(test_worqpp_workque, push_bulk)
+{
+	RecordProperty("Test",
+		"Push ranges of callables, (nice, callable) pairs and events with push_bulk / push_bulk_for."
+	);
+	RecordProperty("Expected",
+		"- push_bulk returns the number of queued items and every item is executed once.\n"
+		"- Events that are already waiting are skipped.\n"
+		"- Delayed items are executed after the delay.\n"
+		"- Events given as (nice, event) pairs are queued at the pair's nice value."
+	);
+
+	sharaku::workque::workque wq;
+	std::atomic<int> called{0};
+	auto func = [&called]() { called++; };
+
+	std::vector<std::function<void(void)>> funcs(100, func);
+	std::vector<std::pair<sharaku::workque::nice_t, std::function<void(void)>>> pairs;
+	for (sharaku::workque::nice_t i = 0; i < 10; i++) {
+		pairs.emplace_back(i, func);
+	}
+	std::shared_ptr<sharaku::workque::event> ev = wq.make_event(0, func);
+	std::vector<std::shared_ptr<sharaku::workque::event>> evs = {ev, ev};
+
+	EXPECT_EQ(100u, wq.push_bulk(0, funcs.begin(), funcs.end()));
+	EXPECT_EQ(10u, wq.push_bulk(0, pairs));
+	EXPECT_EQ(1u, wq.push_bulk(evs.begin(), evs.end()));
+	EXPECT_EQ(100u, wq.push_bulk_for(std::chrono::milliseconds(10), 0, funcs));
+
+	wq.start(4);
+	while (called.load() < 211) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ(211, called.load());
+
+	// (nice, event) の要素は, eventのnice値を変更して積む
+	sharaku::workque::workque wq2;
+	std::vector<int> order;
+	std::vector<std::pair<sharaku::workque::nice_t, std::shared_ptr<sharaku::workque::event>>> evpairs;
+	evpairs.emplace_back(5, wq2.make_event(0, [&order]() { order.push_back(5); }));
+	evpairs.emplace_back(1, wq2.make_event(0, [&order]() { order.push_back(1); }));
+	std::vector<std::pair<sharaku::workque::nice_t, std::shared_ptr<sharaku::workque::event>>> moved;
+	moved.emplace_back(3, wq2.make_event(0, [&order]() { order.push_back(3); }));
+	EXPECT_EQ(2u, wq2.push_bulk(0, evpairs));
+	EXPECT_EQ(1u, wq2.push_bulk(0, std::make_move_iterator(moved.begin()), std::make_move_iterator(moved.end())));
+	EXPECT_EQ(5u, evpairs[0].second->get_nice());
+
+	wq2.push_for(std::chrono::milliseconds(10), 9, [&wq2]() { wq2.quit(); });
+	wq2.run();
+	EXPECT_EQ((std::vector<int>{1, 3, 5}), order);
+}
+
+TEST(test_worqpp_workque, lock_free_ring)
+{
+	RecordProperty("Test",
+		"Push into a sharaku::workque::workque using the lock-free ring backend until it is full."
+	);
+	RecordProperty("Expected",
+		"- try_push fails once the ring is full, and a rejected event is not left pending.\n"
+		"- push falls back to the locked FIFO when the ring is full.\n"
+		"- Everything queued, including delayed items, is executed."
+	);
+
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::lock_free_ring);
+	wq.with_ring_capacity(4);
+	std::atomic<int> called{0};
+	auto func = [&called]() { called++; };
+
+	for (int i = 0; i < 4; i++) {
+		EXPECT_TRUE(wq.try_push(func));
+	}
+	EXPECT_FALSE(wq.try_push(func));
+	std::shared_ptr<sharaku::workque::event> ev = wq.make_event(0, func);
+	EXPECT_FALSE(wq.try_push(ev));
+	EXPECT_FALSE(ev->is_pending());
+	wq.push(func);
+	wq.push_for(std::chrono::milliseconds(5), func);
+
+	wq.start(2);
+	while (called.load() < 6) {
+		std::this_thread::yield();
+	}
+	EXPECT_TRUE(wq.try_push(ev));
+	while (called.load() < 7) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ(7, called.load());
+}
+
+TEST(test_worqpp_workque, snapshot)
+{
+	RecordProperty("Test",
+		"Take statistics snapshots of a sharaku::workque::workque before and after running events."
+	);
+	RecordProperty("Expected",
+		"- Queue depth per nice level and pending timers are reported before execution.\n"
+		"- Executed count, per-worker counters and latency histograms cover every executed event.\n"
+		"- Cancelled events are not counted as executed."
+	);
+
+	sharaku::workque::workque wq;
+	wq.with_stats();
+	std::atomic<int> called{0};
+	auto func = [&called]() { called++; };
+
+	for (int i = 0; i < 10; i++) {
+		wq.push(0, func);
+	}
+	for (int i = 0; i < 5; i++) {
+		wq.push(3, func);
+	}
+	wq.push_for(std::chrono::milliseconds(1), 0, func);
+	std::shared_ptr<sharaku::workque::event> ev = wq.push(0, std::function<void(void)>(func));
+	wq.cancel(ev);
+
+	sharaku::workque::sched_stats st = wq.snapshot();
+	ASSERT_EQ(64u, st.depth.size());
+	EXPECT_EQ(11u, st.depth[0]);
+	EXPECT_EQ(5u, st.depth[3]);
+	EXPECT_EQ(1u, st.timers);
+	EXPECT_EQ(0u, st.executed);
+
+	wq.start(2);
+	while (called.load() < 16) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	st = wq.snapshot();
+	EXPECT_EQ(0u, st.depth[0]);
+	EXPECT_EQ(0u, st.timers);
+	EXPECT_EQ(16u, st.executed);
+	ASSERT_EQ(2u, st.workers.size());
+	uint64_t executed = 0;
+	for (auto &w : st.workers) {
+		EXPECT_FALSE(w.active);
+		executed += w.executed;
+	}
+	EXPECT_EQ(16u, executed);
+	EXPECT_EQ(16u, st.queue_delay.count);
+	EXPECT_EQ(16u, st.exec_time.count);
+	EXPECT_LE(st.queue_delay.percentile(0.5), st.queue_delay.percentile(0.99));
+	EXPECT_LE(st.queue_delay.percentile(0.99), st.queue_delay.max_ns);
+}
+
+TEST(test_worqpp_workque, latency_histogram)
+{
+	RecordProperty("Test",
+		"Map values to buckets of sharaku::workque::latency_histogram."
+	);
+	RecordProperty("Expected",
+		"- Every value falls in a bucket whose lower bound is not greater than the value.\n"
+		"- The relative width of a bucket is at most 1/8."
+	);
+
+	using sharaku::workque::latency_histogram;
+	for (uint64_t v : {0ull, 1ull, 7ull, 8ull, 15ull, 16ull, 100ull, 1000ull, 123456789ull, 1ull << 62}) {
+		const uint32_t b = latency_histogram::bucket(v);
+		ASSERT_LT(b, latency_histogram::buckets);
+		EXPECT_LE(latency_histogram::lower_bound(b), v);
+		EXPECT_GT(latency_histogram::lower_bound(b + 1), v);
+		EXPECT_LE(latency_histogram::lower_bound(b + 1) - latency_histogram::lower_bound(b),
+		          std::max<uint64_t>(1, latency_histogram::lower_bound(b) / 8));
+	}
+}
+
+TEST(test_worqpp_workque, topology)
+{
+	RecordProperty("Test",
+		"Parse CPU lists, build a NUMA topology and start a work-stealing sharaku::workque::workque with worker groups."
+	);
+	RecordProperty("Expected",
+		"- parse_cpulist expands ranges and single numbers.\n"
+		"- numa() returns at least one group.\n"
+		"- Workers of every group execute events pushed from any thread."
+	);
+
+	EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 8, 10, 11}), sharaku::workque::topology::parse_cpulist("0-3,8,10-11"));
+	EXPECT_TRUE(sharaku::workque::topology::parse_cpulist("").empty());
+
+	sharaku::workque::topology numa = sharaku::workque::topology::numa();
+	EXPECT_FALSE(numa.groups.empty());
+
+	sharaku::workque::topology topo;
+	topo.groups.push_back(sharaku::workque::worker_group{{0}, 2});
+	topo.groups.push_back(sharaku::workque::worker_group{{}, 2});
+
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::work_stealing);
+	std::atomic<int> called{0};
+	const int n = 200;
+
+	wq.start(topo);
+	for (int i = 0; i < n; i++) {
+		wq.push(0, [&wq, &called]() {
+			called++;
+			for (int j = 0; j < 10; j++) {
+				wq.push(1, [&called]() { called++; });
+			}
+		});
+	}
+	while (called.load() < n * 11) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ(n * 11, called.load());
+	EXPECT_EQ(4u, wq.snapshot().workers.size());
+}
+
+TEST(test_worqpp_workque, elastic)
+{
+	RecordProperty("Test",
+		"Start sharaku::workque::workque with an elastic_config, push a backlog of blocking events and let it drain."
+	);
+	RecordProperty("Expected",
+		"- Threads are added up to max_threads while the backlog exceeds the threshold.\n"
+		"- Threads idle longer than keepalive retire down to min_threads.\n"
+		"- Every event is executed exactly once."
+	);
+
+	sharaku::workque::elastic_config cfg;
+	cfg.min_threads = 1;
+	cfg.max_threads = 4;
+	cfg.backlog = 2;
+	cfg.max_delay = std::chrono::milliseconds(1);
+	cfg.keepalive = std::chrono::milliseconds(20);
+
+	sharaku::workque::workque wq;
+	wq.with_spin(std::chrono::nanoseconds(0));
+	std::atomic<int> called{0};
+	const int n = 40;
+
+	wq.start(cfg);
+	for (int i = 0; i < n; i++) {
+		wq.push(0, [&called]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			called++;
+		});
+	}
+	while (called.load() < n) {
+		std::this_thread::yield();
+	}
+	EXPECT_GT(wq.snapshot().threads_started, 0u);
+	EXPECT_LE(wq.snapshot().threads, 4u);
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (wq.snapshot().threads > 1 && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	sharaku::workque::sched_stats st = wq.snapshot();
+	EXPECT_EQ(1u, st.threads);
+	EXPECT_EQ(st.threads_started, st.threads_retired);
+
+	// 終了したスレッドの後も追加できる
+	for (int i = 0; i < n; i++) {
+		wq.push(0, [&called]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			called++;
+		});
+	}
+	while (called.load() < n * 2) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ(n * 2, called.load());
+	EXPECT_EQ(0u, wq.snapshot().threads);
+}
+
+TEST(test_worqpp_workque, timer_leader)
+{
+	RecordProperty("Test",
+		"Push staggered timers to a multi-threaded sharaku::workque::workque while the workers are busy and idle."
+	);
+	RecordProperty("Expected",
+		"- Only one worker waits for the next deadline, yet every timer fires, and none fires early.\n"
+		"- With four idle workers, a single pending timer wakes one worker per deadline, not all of them.\n"
+		"- Timers keep firing while the worker that was waiting for them executes a long event."
+	);
+
+	for (auto mode : {sharaku::workque::sched_mode::global_fifo,
+	                  sharaku::workque::sched_mode::work_stealing,
+	                  sharaku::workque::sched_mode::lock_free_ring}) {
+		sharaku::workque::workque wq(mode);
+		wq.with_spin(std::chrono::nanoseconds(0));
+		wq.start(4);
+
+		// 全ワーカーが待ちに入るまで待つ
+		while (wq.get_wakeup_stats().parks < 4) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		// タイマーを1つずつ発火させ, 待ちに入り直した回数を数える.
+		// リーダーだけが起床するなら1期限あたり2回程度(リーダー就任と発火後),
+		// 全ワーカーが期限で起床すると1期限あたり4回以上になる.
+		const int k = 5;
+		const auto before = wq.get_wakeup_stats();
+		std::atomic<int> fired{0};
+		for (int i = 0; i < k; i++) {
+			wq.push_for(std::chrono::milliseconds(10), 0, [&fired]() { fired++; });
+			while (fired.load() < i + 1) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		const auto after = wq.get_wakeup_stats();
+		EXPECT_LE(after.parks - before.parks, static_cast<uint64_t>(3 * k));
+		EXPECT_LE(after.wakeups - before.wakeups, static_cast<uint64_t>(k));
+
+		const int n = 60;
+		std::atomic<int> called{0};
+		std::atomic<int> early{0};
+		for (int i = 0; i < n; i++) {
+			const auto delay = std::chrono::milliseconds(i % 20 + 1);
+			const auto due = std::chrono::steady_clock::now() + delay;
+			wq.push_for(delay, 0, [&called, &early, due, i]() {
+				if (std::chrono::steady_clock::now() < due) {
+					early++;
+				}
+				if (i == 0) {
+					// 残りのタイマーはこの間も他のワーカーで処理される
+					std::this_thread::sleep_for(std::chrono::milliseconds(30));
+				}
+				called++;
+			});
+		}
+		while (called.load() < n) {
+			std::this_thread::yield();
+		}
+		wq.stop();
+
+		EXPECT_EQ(n, called.load());
+		EXPECT_EQ(0, early.load());
+	}
+}
+
+TEST(test_worqpp_workque, push_every)
+{
+	RecordProperty("Test",
+		"Run a periodic event with sharaku::workque::workque::push_every() whose body takes part of the period, and one that overruns several periods under each missed_tick policy."
+	);
+	RecordProperty("Expected",
+		"- Ticks follow absolute deadlines: the body's run time does not accumulate as drift.\n"
+		"- After an overrun, catch_up runs every missed tick, coalesce runs one, skip runs none before the next deadline.\n"
+		"- cancel() stops the periodic event even while its body is running."
+	);
+
+	using clock = std::chrono::steady_clock;
+	{
+		sharaku::workque::workque wq;
+		wq.start(1);
+		const auto period = std::chrono::milliseconds(5);
+		const int n = 20;
+		std::atomic<int> called{0};
+		std::atomic<int> early{0};
+		const auto t0 = clock::now();
+		std::shared_ptr<sharaku::workque::event> ev = wq.push_every(period, 0, [&]() {
+			const int i = called.load();
+			if (clock::now() < t0 + period * (i + 1)) {
+				early++;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(3));
+			called++;
+		});
+		while (called.load() < n) {
+			std::this_thread::yield();
+		}
+		const auto elapsed = clock::now() - t0;
+		EXPECT_TRUE(wq.cancel(ev));
+		wq.stop();
+		EXPECT_EQ(0, early.load());
+		// 実行時間が周期に積み重なると 20 * 8ms 以上かかる
+		EXPECT_LT(elapsed, std::chrono::milliseconds(150));
+	}
+
+	const sharaku::workque::missed_tick policies[] = {
+		sharaku::workque::missed_tick::catch_up,
+		sharaku::workque::missed_tick::coalesce,
+		sharaku::workque::missed_tick::skip,
+	};
+	for (const auto policy : policies) {
+		sharaku::workque::workque wq;
+		wq.start(1);
+		const auto period = std::chrono::milliseconds(30);
+		std::mutex mtx;
+		std::vector<clock::time_point> at;
+		clock::time_point stalled;
+		const auto t0 = clock::now();
+		std::shared_ptr<sharaku::workque::event> ev = wq.push_every(period, 0, [&]() {
+			std::unique_lock<std::mutex> lock(mtx);
+			at.push_back(clock::now());
+			if (at.size() == 1) {
+				// 周期の中ほどまで止め, 2回目以降の期限をいくつか過ぎさせる
+				lock.unlock();
+				std::this_thread::sleep_until(t0 + period * 4 + period / 2);
+				lock.lock();
+				stalled = clock::now();
+			}
+		}, policy);
+
+		// 止まっている間に過ぎた期限の数と, 止まった後の最初の期限から期待値を決める
+		int missed = 0;
+		clock::time_point next;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				if (stalled != clock::time_point()) {
+					const int last = static_cast<int>((stalled - t0) / period);
+					missed = last - 1;
+					next = t0 + period * (last + 1);
+					if (at.back() >= next) {
+						break;
+					}
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		EXPECT_TRUE(wq.cancel(ev));
+		wq.stop();
+
+		int expected = 0;
+		switch (policy) {
+		case sharaku::workque::missed_tick::catch_up:
+			expected = missed;
+			break;
+		case sharaku::workque::missed_tick::coalesce:
+			expected = missed > 0 ? 1 : 0;
+			break;
+		case sharaku::workque::missed_tick::skip:
+			expected = 0;
+			break;
+		}
+		std::unique_lock<std::mutex> lock(mtx);
+		EXPECT_GE(missed, 1);
+		int before = 0;
+		for (size_t i = 1; i < at.size(); i++) {
+			if (at[i] < next) {
+				before++;
+			}
+		}
+		EXPECT_EQ(expected, before);
+	}
+
+	{
+		sharaku::workque::workque wq;
+		wq.start(2);
+		std::atomic<int> called{0};
+		std::atomic<bool> running{false};
+		std::shared_ptr<sharaku::workque::event> ev =
+			wq.push_every(std::chrono::milliseconds(2), 0, [&]() {
+				called++;
+				running = true;
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			});
+		while (!running.load()) {
+			std::this_thread::yield();
+		}
+		EXPECT_TRUE(wq.cancel(ev));
+		EXPECT_FALSE(wq.cancel(ev));
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		wq.stop();
+		EXPECT_EQ(1, called.load());
+		EXPECT_FALSE(ev->is_pending());
+	}
+}
+
+TEST(test_worqpp_workque, nice_weights)
+{
+	RecordProperty("Test",
+		"Keep nice 0 busy with events that push themselves again on a sharaku::workque::workque with nice weights, and push a nice 5 event."
+	);
+	RecordProperty("Expected",
+		"- The nice 5 event runs while nice 0 still has work, instead of starving."
+	);
+
+	for (auto mode : {sharaku::workque::sched_mode::global_fifo,
+	                  sharaku::workque::sched_mode::work_stealing}) {
+		sharaku::workque::workque wq(mode);
+		wq.with_nice_weights({8, 4, 2, 1});
+
+		std::atomic<bool> done{false};
+		std::atomic<int> busy{0};
+		std::function<void(void)> hog = [&]() {
+			busy++;
+			if (!done.load()) {
+				wq.push(0, [&]() { hog(); });
+			}
+		};
+		wq.start(1);
+		for (int i = 0; i < 4; i++) {
+			wq.push(0, [&]() { hog(); });
+		}
+		std::atomic<bool> ran{false};
+		wq.push(5, [&]() { ran = true; });
+		const auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (!ran.load() && std::chrono::steady_clock::now() < limit) {
+			std::this_thread::yield();
+		}
+		done = true;
+		wq.stop();
+		EXPECT_TRUE(ran.load());
+		EXPECT_GT(busy.load(), 0);
+	}
+}
+
+TEST(test_worqpp_workque, earliest_deadline)
+{
+	RecordProperty("Test",
+		"Push events with deadlines to a sharaku::workque::workque in earliest_deadline mode while its worker is busy, including events whose deadline has already passed."
+	);
+	RecordProperty("Expected",
+		"- Events run in deadline order, then nice order, and events without a deadline run last.\n"
+		"- Late events pushed with deadline_miss::drop are not run, and late events with an expiry callback run the callback instead.\n"
+		"- snapshot() counts the late events and the dropped ones."
+	);
+
+	using clock = std::chrono::steady_clock;
+	sharaku::workque::workque wq(sharaku::workque::sched_mode::earliest_deadline);
+	std::atomic<bool> release{false};
+	std::atomic<bool> blocked{false};
+	std::vector<int> order;
+	std::atomic<int> ran{0};
+	wq.push(0, [&]() {
+		blocked = true;
+		while (!release.load()) {
+			std::this_thread::yield();
+		}
+	});
+	wq.start(1);
+	while (!blocked.load()) {
+		std::this_thread::yield();
+	}
+
+	const auto now = clock::now();
+	wq.push(2, [&]() { ran++; order.push_back(6); });
+	wq.push(now + std::chrono::seconds(5), 0, [&]() { ran++; order.push_back(5); });
+	wq.push(now + std::chrono::seconds(2), 1, [&]() { ran++; order.push_back(3); });
+	wq.push(now + std::chrono::seconds(1), 0, [&]() { ran++; order.push_back(1); });
+	wq.push(now + std::chrono::seconds(2), 0, [&]() { ran++; order.push_back(2); });
+	wq.push(now + std::chrono::seconds(2), 1, [&]() { ran++; order.push_back(4); });
+
+	std::atomic<int> late{0};
+	std::atomic<int> expired{0};
+	wq.push(now - std::chrono::milliseconds(1), 0, [&]() { late++; },
+	        sharaku::workque::deadline_miss::drop);
+	wq.push(now - std::chrono::milliseconds(1), 0, [&]() { late++; }, [&]() { expired++; });
+	std::shared_ptr<sharaku::workque::event> ev = wq.make_event(0, [&]() { late++; });
+	wq.push(now - std::chrono::milliseconds(1), ev, sharaku::workque::deadline_miss::drop);
+	EXPECT_TRUE(ev->is_pending());
+
+	release = true;
+	// 期限を過ぎたものが先に取り出されるため, 期限のないものが最後になる
+	while (ran.load() < 6) {
+		std::this_thread::yield();
+	}
+	wq.stop();
+
+	EXPECT_EQ((std::vector<int>{1, 2, 3, 4, 5, 6}), order);
+	EXPECT_EQ(0, late.load());
+	EXPECT_EQ(1, expired.load());
+	EXPECT_FALSE(ev->is_pending());
+	const sharaku::workque::sched_stats st = wq.snapshot();
+	EXPECT_EQ(3u, st.deadline_missed);
+	EXPECT_EQ(2u, st.deadline_dropped);
+}
+
+TEST(test_worqpp_workque, capacity)
+{
+	RecordProperty("Test",
+		"Push more events than the capacity set with with_capacity() to a sharaku::workque::workque under each overflow_policy, with watermarks set."
+	);
+	RecordProperty("Expected",
+		"- reject discards the new events, and try_push() fails, when the total or per-level limit is reached.\n"
+		"- drop_oldest discards the oldest events, caller_runs runs the new event in the caller.\n"
+		"- block waits until a worker makes room, and try_push_for() gives up after its timeout.\n"
+		"- The watermark callback is called once at the high watermark and once back at the low watermark.\n"
+		"- In work_stealing, events pushed from a worker are also bounded (they do not bypass the limit via the local deque).\n"
+		"- Concurrent producers never push more than the total limit, with either the FIFO or the ring.\n"
+		"- With concurrent pushes and pops, the watermark callback alternates between above and below, ending below."
+	);
+
+	using sharaku::workque::overflow_policy;
+	{
+		sharaku::workque::workque wq;
+		sharaku::workque::capacity_config cfg;
+		cfg.total = 4;
+		cfg.per_level = 2;
+		cfg.policy = overflow_policy::reject;
+		wq.with_capacity(cfg);
+		std::atomic<int> called{0};
+		for (int i = 0; i < 3; i++) {
+			wq.push(0, [&called]() { called++; });
+		}
+		for (int i = 0; i < 3; i++) {
+			wq.push(1, [&called]() { called++; });
+		}
+		EXPECT_FALSE(wq.try_push(2, [&called]() { called++; }));
+		std::shared_ptr<sharaku::workque::event> ev = wq.push(2, std::function<void(void)>([&called]() { called++; }));
+		EXPECT_FALSE(ev->is_pending());
+		sharaku::workque::sched_stats st = wq.snapshot();
+		EXPECT_EQ(2u, st.depth[0]);
+		EXPECT_EQ(2u, st.depth[1]);
+		EXPECT_EQ(4u, st.rejected);
+
+		wq.start(1);
+		while (called.load() < 4) {
+			std::this_thread::yield();
+		}
+		wq.stop();
+		EXPECT_EQ(4, called.load());
+	}
+	{
+		sharaku::workque::workque wq;
+		sharaku::workque::capacity_config cfg;
+		cfg.total = 3;
+		cfg.policy = overflow_policy::drop_oldest;
+		wq.with_capacity(cfg);
+		std::mutex mtx;
+		std::vector<int> order;
+		for (int i = 1; i <= 5; i++) {
+			wq.push(0, [&mtx, &order, i]() {
+				std::unique_lock<std::mutex> lock(mtx);
+				order.push_back(i);
+			});
+		}
+		EXPECT_EQ(2u, wq.snapshot().evicted);
+		wq.start(1);
+		for (;;) {
+			std::unique_lock<std::mutex> lock(mtx);
+			if (order.size() == 3) {
+				break;
+			}
+			lock.unlock();
+			std::this_thread::yield();
+		}
+		wq.stop();
+		EXPECT_EQ((std::vector<int>{3, 4, 5}), order);
+	}
+	{
+		sharaku::workque::workque wq;
+		sharaku::workque::capacity_config cfg;
+		cfg.total = 1;
+		cfg.policy = overflow_policy::caller_runs;
+		wq.with_capacity(cfg);
+		wq.push(0, []() {});
+		std::thread::id ran;
+		wq.push(0, [&ran]() { ran = std::this_thread::get_id(); });
+		EXPECT_EQ(std::this_thread::get_id(), ran);
+		EXPECT_EQ(1u, wq.snapshot().caller_ran);
+	}
+	{
+		sharaku::workque::workque wq;
+		sharaku::workque::capacity_config cfg;
+		cfg.total = 2;
+		cfg.policy = overflow_policy::block;
+		wq.with_capacity(cfg);
+		std::atomic<int> high{0};
+		std::atomic<int> low{0};
+		wq.with_watermarks(2, 0, [&](bool above) {
+			(above ? high : low)++;
+		});
+
+		std::atomic<bool> release{false};
+		std::atomic<bool> blocked{false};
+		std::atomic<int> called{0};
+		wq.push(0, [&]() {
+			blocked = true;
+			while (!release.load()) {
+				std::this_thread::yield();
+			}
+		});
+		wq.start(1);
+		while (!blocked.load()) {
+			std::this_thread::yield();
+		}
+		wq.push(0, [&called]() { called++; });
+		wq.push(0, [&called]() { called++; });
+		EXPECT_EQ(1, high.load());
+		EXPECT_FALSE(wq.try_push_for(std::chrono::milliseconds(5), 0, [&called]() { called++; }));
+
+		std::atomic<bool> pushed{false};
+		std::thread producer([&]() {
+			wq.push(0, [&called]() { called++; });
+			pushed = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		EXPECT_FALSE(pushed.load());
+		release = true;
+		producer.join();
+		while (called.load() < 3) {
+			std::this_thread::yield();
+		}
+		wq.stop();
+		EXPECT_TRUE(pushed.load());
+		sharaku::workque::sched_stats st = wq.snapshot();
+		EXPECT_EQ(2u, st.blocked);
+		EXPECT_EQ(1u, st.rejected);
+		EXPECT_EQ(1, high.load());
+		EXPECT_EQ(1, low.load());
+	}
+	{
+		// work_stealing でワーカー内から登録するものも上限の対象になる
+		sharaku::workque::workque wq(sharaku::workque::sched_mode::work_stealing);
+		sharaku::workque::capacity_config cfg;
+		cfg.total = 4;
+		cfg.policy = overflow_policy::reject;
+		wq.with_capacity(cfg);
+		std::atomic<int> called{0};
+		std::atomic<bool> pushed{false};
+		wq.push(0, [&]() {
+			for (int i = 0; i < 10; i++) {
+				wq.push(0, [&called]() { called++; });
+			}
+			pushed = true;
+		});
+		wq.start(1);
+		while (!pushed.load() || called.load() < 4) {
+			std::this_thread::yield();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		wq.stop();
+		EXPECT_EQ(4, called.load());
+		EXPECT_EQ(6u, wq.snapshot().rejected);
+	}
+	for (sharaku::workque::sched_mode mode : {sharaku::workque::sched_mode::global_fifo,
+	                                          sharaku::workque::sched_mode::lock_free_ring}) {
+		// 同時に登録しても上限を超えない
+		sharaku::workque::workque wq(mode);
+		sharaku::workque::capacity_config cfg;
+		cfg.total = 16;
+		cfg.policy = overflow_policy::reject;
+		wq.with_capacity(cfg);
+		std::atomic<int> called{0};
+		std::vector<std::thread> producers;
+		for (int t = 0; t < 8; t++) {
+			producers.emplace_back([&wq, &called]() {
+				for (int i = 0; i < 100; i++) {
+					wq.push(0, [&called]() { called++; });
+				}
+			});
+		}
+		for (std::thread &th : producers) {
+			th.join();
+		}
+		EXPECT_EQ(784u, wq.snapshot().rejected);
+		wq.start(1);
+		while (called.load() < 16) {
+			std::this_thread::yield();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		wq.stop();
+		EXPECT_EQ(16, called.load());
+	}
+	{
+		// 同時に登録, 取り出しをしても, 閾値の通知は上下交互に呼ばれる
+		sharaku::workque::workque wq;
+		std::mutex mtx;
+		std::vector<bool> changes;
+		wq.with_watermarks(8, 2, [&mtx, &changes](bool above) {
+			std::unique_lock<std::mutex> lock(mtx);
+			changes.push_back(above);
+		});
+		std::atomic<int> called{0};
+		wq.start(2);
+		std::vector<std::thread> producers;
+		for (int t = 0; t < 4; t++) {
+			producers.emplace_back([&wq, &called]() {
+				for (int i = 0; i < 2000; i++) {
+					wq.push(0, [&called]() { called++; });
+				}
+			});
+		}
+		for (std::thread &th : producers) {
+			th.join();
+		}
+		while (called.load() < 8000) {
+			std::this_thread::yield();
+		}
+		wq.stop();
+		std::unique_lock<std::mutex> lock(mtx);
+		for (size_t i = 0; i < changes.size(); i++) {
+			EXPECT_EQ(i % 2 == 0, changes[i]) << i;
+		}
+		EXPECT_EQ(0u, changes.size() % 2);
+	}
+}
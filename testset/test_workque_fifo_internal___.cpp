@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+#include "../include/workq++.hpp"
+
+using prio_fifo = sharaku::workque::__internal__::workque::prio_fifo_internal___<int>;
+
+TEST(test_worqpp_prio_fifo, order)
+{
+	RecordProperty("Test",
+		"Push values with various nice values into a prio_fifo_internal___ and pop them."
+	);
+	RecordProperty("Expected",
+		"- Values are popped in nice order, and in push order for the same nice.\n"
+		"- Nice values beyond the number of levels are clamped to the lowest priority level."
+	);
+
+	prio_fifo fifo(256);
+	fifo.push(4000000000u, 9);
+	fifo.push(200, 5);
+	fifo.push(3, 3);
+	fifo.push(0, 1);
+	fifo.push(3, 4);
+	fifo.push(0, 2);
+	fifo.push(255, 8);
+	fifo.push(70, 6);
+	fifo.push(130, 7);
+
+	sharaku::workque::nice_t level;
+	EXPECT_TRUE(fifo.front_level(level));
+	EXPECT_EQ(0u, level);
+	EXPECT_EQ(2u, fifo.size(255));
+
+	std::vector<int> popped;
+	int v;
+	while (fifo.pop(v)) {
+		popped.push_back(v);
+	}
+	EXPECT_EQ((std::vector<int>{1, 2, 3, 4, 6, 7, 5, 9, 8}), popped);
+	EXPECT_FALSE(fifo.front_level(level));
+}
+
+TEST(test_worqpp_prio_fifo, erase)
+{
+	RecordProperty("Test",
+		"Erase values from a prio_fifo_internal___."
+	);
+	RecordProperty("Expected",
+		"- Only the matching value is removed and the order of the others is kept.\n"
+		"- A level emptied by erase is no longer reported as the front level."
+	);
+
+	prio_fifo fifo(64);
+	for (int i = 0; i < 40; i++) {
+		fifo.push(1, i);
+	}
+	fifo.push(7, 100);
+	EXPECT_TRUE(fifo.erase(1, [](int v) { return v == 17; }));
+	EXPECT_FALSE(fifo.erase(1, [](int v) { return v == 17; }));
+	EXPECT_TRUE(fifo.erase(7, [](int v) { return v == 100; }));
+
+	int v, expect = 0;
+	while (fifo.pop(v)) {
+		if (expect == 17) {
+			expect++;
+		}
+		EXPECT_EQ(expect++, v);
+	}
+	EXPECT_EQ(40, expect);
+}
+
+TEST(test_worqpp_prio_fifo, weighted)
+{
+	RecordProperty("Test",
+		"Set weights on a prio_fifo_internal___ and pop from several busy levels."
+	);
+	RecordProperty("Expected",
+		"- Each round pops as many values from a level as its weight, in nice order.\n"
+		"- Levels beyond the weights use the last weight, and lower levels are not starved.\n"
+		"- front_level() reports the level the next pop() takes from.\n"
+		"- Clearing the weights restores strict priority."
+	);
+
+	prio_fifo fifo(256);
+	fifo.set_weights({4, 2, 1});
+	for (int i = 0; i < 100; i++) {
+		fifo.push(0, 0);
+		fifo.push(1, 1);
+		fifo.push(200, 2);
+	}
+
+	int count[3] = {};
+	std::vector<int> popped;
+	for (int i = 0; i < 70; i++) {
+		sharaku::workque::nice_t level;
+		int v;
+		ASSERT_TRUE(fifo.front_level(level));
+		ASSERT_TRUE(fifo.pop(v));
+		EXPECT_EQ(level, fifo.level(v == 2 ? 200 : v));
+		count[v]++;
+		if (i < 7) {
+			popped.push_back(v);
+		}
+	}
+	EXPECT_EQ((std::vector<int>{0, 0, 0, 0, 1, 1, 2}), popped);
+	EXPECT_EQ(40, count[0]);
+	EXPECT_EQ(20, count[1]);
+	EXPECT_EQ(10, count[2]);
+
+	fifo.set_weights({});
+	int v;
+	for (int i = 0; i < 60; i++) {
+		ASSERT_TRUE(fifo.pop(v));
+		EXPECT_EQ(0, v);
+	}
+	ASSERT_TRUE(fifo.pop(v));
+	EXPECT_EQ(1, v);
+}
@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include "../include/workq++.hpp"
+
+using mpmc_ring = sharaku::workque::__internal__::workque::mpmc_ring_internal___<int>;
+using chase_lev = sharaku::workque::__internal__::workque::chase_lev_deque___<int>;
+
+TEST(test_worqpp_mpmc_ring, push_pop)
+{
+	RecordProperty("Test",
+		"Push into and pop from an mpmc_ring_internal___ from one thread, then from several threads."
+	);
+	RecordProperty("Expected",
+		"- Capacity is rounded up to a power of two and try_push fails when full.\n"
+		"- Values are popped in push order.\n"
+		"- With concurrent producers and consumers, every value is popped exactly once."
+	);
+
+	mpmc_ring ring(5);
+	EXPECT_EQ(8u, ring.capacity());
+	for (int i = 0; i < 8; i++) {
+		int v = i;
+		EXPECT_TRUE(ring.try_push(v));
+	}
+	int v = 8;
+	EXPECT_FALSE(ring.try_push(v));
+	for (int i = 0; i < 8; i++) {
+		EXPECT_TRUE(ring.try_pop(v));
+		EXPECT_EQ(i, v);
+	}
+	EXPECT_FALSE(ring.try_pop(v));
+
+	mpmc_ring shared(64);
+	const int n = 20000;
+	std::vector<std::atomic<int>> seen(n * 2);
+	for (auto &s : seen) {
+		s.store(0);
+	}
+	std::atomic<int> popped{0};
+	std::vector<std::thread> th;
+	for (int p = 0; p < 2; p++) {
+		th.emplace_back([&shared, p]() {
+			for (int i = 0; i < n; i++) {
+				int x = p * n + i;
+				while (!shared.try_push(x)) {
+					std::this_thread::yield();
+				}
+			}
+		});
+		th.emplace_back([&shared, &seen, &popped]() {
+			int x;
+			while (popped.load() < n * 2) {
+				if (shared.try_pop(x)) {
+					seen[x]++;
+					popped++;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (auto &t : th) {
+		t.join();
+	}
+	for (int i = 0; i < n * 2; i++) {
+		EXPECT_EQ(1, seen[i].load());
+	}
+}
+
+TEST(test_worqpp_chase_lev, push_steal)
+{
+	RecordProperty("Test",
+		"Push into a chase_lev_deque___ beyond its initial size and steal from it."
+	);
+	RecordProperty("Expected",
+		"- The deque grows and values are taken in push order.\n"
+		"- size() and empty() follow the number of remaining values."
+	);
+
+	chase_lev deque;
+	for (int i = 0; i < 1000; i++) {
+		deque.push(i);
+	}
+	EXPECT_EQ(1000u, deque.size());
+	int v;
+	for (int i = 0; i < 1000; i++) {
+		EXPECT_TRUE(deque.steal(v));
+		EXPECT_EQ(i, v);
+	}
+	EXPECT_TRUE(deque.empty());
+	EXPECT_FALSE(deque.steal(v));
+}
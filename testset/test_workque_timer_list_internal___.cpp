@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "../include/workq++.hpp"
+
+using timer_wheel = sharaku::workque::__internal__::workque::timer_wheel_internal___<int>;
+
+TEST(test_worqpp_timer_wheel, expire_order)
+{
+	RecordProperty("Test",
+		"Insert timers with random deadlines into a timer_wheel_internal___ and advance it step by step."
+	);
+	RecordProperty("Expected",
+		"- No timer expires before its deadline.\n"
+		"- Every timer expires within one tick after its deadline has been reached.\n"
+		"- Timers beyond the highest level are kept in the overflow list and still expire."
+	);
+
+	timer_wheel wheel(std::chrono::milliseconds(1), 2);
+	auto origin = std::chrono::steady_clock::now();
+	std::mt19937 rnd(1);
+	std::vector<std::chrono::steady_clock::time_point> deadline;
+	for (int i = 0; i < 2000; i++) {
+		deadline.push_back(origin + std::chrono::milliseconds(rnd() % 20000));
+		wheel.insert(deadline.back(), i);
+	}
+
+	std::vector<int> expired(deadline.size(), 0);
+	for (auto now = origin; wheel.size(); now += std::chrono::microseconds(700)) {
+		wheel.advance(now, [&](int &&i) {
+			EXPECT_LE(deadline[i], now);
+			EXPECT_GT(deadline[i] + std::chrono::milliseconds(2), now);
+			expired[i]++;
+		});
+	}
+	for (auto n : expired) {
+		EXPECT_EQ(1, n);
+	}
+}
+
+TEST(test_worqpp_timer_wheel, cancel)
+{
+	RecordProperty("Test",
+		"Cancel timers registered in a timer_wheel_internal___."
+	);
+	RecordProperty("Expected",
+		"- cancel() returns true only once for a pending timer.\n"
+		"- Cancelled timers never expire and their handles stay invalid after the node is reused."
+	);
+
+	timer_wheel wheel;
+	auto now = std::chrono::steady_clock::now();
+	auto h1 = wheel.insert(now + std::chrono::milliseconds(10), 1);
+	auto h2 = wheel.insert(now + std::chrono::seconds(100000), 2);
+	EXPECT_TRUE(wheel.cancel(h1));
+	EXPECT_FALSE(wheel.cancel(h1));
+	auto h3 = wheel.insert(now + std::chrono::milliseconds(10), 3);
+	EXPECT_FALSE(wheel.cancel(h1));
+	EXPECT_TRUE(wheel.cancel(h2));
+	EXPECT_EQ(1u, wheel.size());
+
+	std::vector<int> expired;
+	wheel.advance(now + std::chrono::seconds(200000), [&](int &&i) { expired.push_back(i); });
+	EXPECT_EQ(std::vector<int>{3}, expired);
+	EXPECT_FALSE(wheel.cancel(h3));
+	EXPECT_EQ(std::chrono::steady_clock::time_point(), wheel.next_time());
+}
+
+TEST(test_worqpp_timer_wheel, slack)
+{
+	RecordProperty("Test",
+		"Insert sub-millisecond timers with a slack into a timer_wheel_internal___ and advance it step by step."
+	);
+	RecordProperty("Expected",
+		"- No timer expires before its deadline or later than its slack (plus one tick).\n"
+		"- Timers whose windows overlap expire together, so far fewer steps expire anything than without slack.\n"
+		"- wakeups_saved() counts the steps that were merged."
+	);
+
+	const auto tick = std::chrono::microseconds(100);
+	const auto slack = std::chrono::milliseconds(2);
+	timer_wheel wheel(tick, 4);
+	timer_wheel plain(tick, 4);
+	auto origin = std::chrono::steady_clock::now();
+	std::vector<std::chrono::steady_clock::time_point> deadline;
+	for (int i = 0; i < 200; i++) {
+		deadline.push_back(origin + std::chrono::microseconds(37 * i + 50));
+		wheel.insert(deadline.back(), i, slack);
+		plain.insert(deadline.back(), i);
+	}
+
+	int steps = 0;
+	int plain_steps = 0;
+	for (auto now = origin; wheel.size() || plain.size(); now += std::chrono::microseconds(50)) {
+		bool fired = false;
+		wheel.advance(now, [&](int &&i) {
+			EXPECT_LE(deadline[i], now);
+			EXPECT_GE(deadline[i] + slack + tick * 2, now);
+			fired = true;
+		});
+		bool plain_fired = false;
+		plain.advance(now, [&](int &&) { plain_fired = true; });
+		steps += fired;
+		plain_steps += plain_fired;
+	}
+	EXPECT_LT(steps * 4, plain_steps);
+	EXPECT_GT(wheel.wakeups_saved(), 0u);
+	EXPECT_EQ(0u, plain.wakeups_saved());
+}